@@ -0,0 +1,296 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Actions named by the rules of a policy. A rule may be followed on its line
+ * by a label, such as "accept" or "deny", and a packet then classifies to the
+ * action of the first rule it matches. Rules without a label each get an
+ * action of their own named after their number, so that they are output as
+ * they would be without actions.
+ *
+ * Only the action of the first match is wanted, so rules whose removal does
+ * not change it for any packet can go, and every rule that goes takes a bit
+ * off every row of every table. actions_reduce repeats three steps until none
+ * of them changes anything:
+ *
+ *   - A rule covered by an earlier rule never matches first, so it is
+ *     dropped whatever its action.
+ *   - A rule covered by a later rule of the same action is dropped, as long
+ *     as no rule of another action between them overlaps it: the packets it
+ *     matched then go on to the later rule or to one of the same action.
+ *   - Two rules of the same action with the same ? mask, differing in one
+ *     fixed bit, become one with that bit a ?, again as long as no rule of
+ *     another action between them overlaps the later one.
+ *
+ * Each rule is only compared with the ACTION_WINDOW rules before and after
+ * it, which keeps the passes linear in the rules of large policies at the
+ * cost of missing rules that could go. Rules are compared only on the bits
+ * classification reads: the first b bits, as the tables take them, and only
+ * as many bytes as a packet has. */
+
+#include "grouper.h"
+
+struct RULE_ACTIONS {
+        uint64_t rules;         /* Number of rules */
+        uint64_t count;         /* Number of distinct actions */
+        char ** names;          /* Name of each action */
+        size_t * lengths;       /* Length of each name */
+        uint32_t * of_rule;     /* Action of each rule */
+};
+
+/* Returns the 64 bit FNV-1a hash of a name */
+static uint64_t hash_name(const char * name)
+{
+        uint64_t hash = UINT64_C(14695981039346656037);
+        for(; *name != '\0'; ++name){
+                hash ^= (uint8_t) *name;
+                hash *= UINT64_C(1099511628211);
+        }
+        return hash;
+}
+
+/* Gathers the action named by each of n rules. labels[i] is the label of rule
+ * i, or NULL if it has none, and labels may itself be NULL if no rule has
+ * one. The labels are copied. */
+rule_actions * actions_new(char ** labels, uint64_t n)
+{
+        rule_actions * a = calloc(1, sizeof(rule_actions));
+        uint64_t slots = 1;
+        while(slots < 2 * n) slots *= 2;
+        uint32_t * table = calloc(slots, sizeof(uint32_t));
+        if(a == NULL || table == NULL){
+                Error("Could not allocate memory for actions!\n");
+                exit(EXIT_FAILURE);
+        }
+        a->rules = n;
+        a->names = malloc(n * sizeof(char *));
+        a->lengths = malloc(n * sizeof(size_t));
+        a->of_rule = malloc(n * sizeof(uint32_t));
+        if(a->names == NULL || a->lengths == NULL || a->of_rule == NULL){
+                Error("Could not allocate memory for actions!\n");
+                exit(EXIT_FAILURE);
+        }
+
+        char number[21];        /* The 20 digits of a rule number */
+        for(uint64_t i = 0; i < n; ++i){
+                const char * name = labels != NULL ? labels[i] : NULL;
+                if(name == NULL){
+                        snprintf(number, sizeof(number), "%"PRIu64, i + 1);
+                        name = number;
+                }
+                /* table holds the action of each name + 1, or 0 if empty */
+                uint64_t s = hash_name(name) & (slots - 1);
+                while(table[s] != 0 &&
+                      strcmp(a->names[table[s] - 1], name) != 0){
+                        s = (s + 1) & (slots - 1);
+                }
+                if(table[s] == 0){
+                        a->names[a->count] = strdup(name);
+                        if(a->names[a->count] == NULL){
+                                Error("Could not allocate memory for "
+                                      "actions!\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        a->lengths[a->count] = strlen(name);
+                        table[s] = ++a->count;
+                }
+                a->of_rule[i] = table[s] - 1;
+        }
+        free(table);
+        return a;
+}
+
+/* Frees the actions of a policy */
+void actions_free(rule_actions * a)
+{
+        for(uint64_t k = 0; k < a->count; ++k) free(a->names[k]);
+        free(a->names);
+        free(a->lengths);
+        free(a->of_rule);
+        free(a);
+}
+
+/* Returns the name of the action of a match, a rule number from 1 or 0 for
+ * none, and its length in len. No match is named "0". */
+const char * action_name(const rule_actions * a, uint64_t match, size_t * len)
+{
+        if(match == 0){
+                *len = 1;
+                return "0";
+        }
+        const uint32_t k = a->of_rule[match - 1];
+        *len = a->lengths[k];
+        return a->names[k];
+}
+
+/* The bytes of the masks that classification reads */
+typedef struct {
+        const policy * pol;
+        uint64_t len;           /* Bytes of a packet that count */
+        uint8_t last_mask;      /* Bits of the last of them that count */
+} mask_span;
+
+/* Returns the bits of byte k of a mask that classification reads */
+static inline uint8_t counted(const mask_span * span, const uint8_t * mask,
+                              uint64_t k)
+{
+        return k + 1 == span->len ? mask[k] & span->last_mask : mask[k];
+}
+
+/* Returns whether some packet matches both rules i and j */
+static bool overlap(const mask_span * span, uint64_t i, uint64_t j)
+{
+        const policy * pol = span->pol;
+        const uint8_t * qi = pol->q_masks[i], * bi = pol->b_masks[i];
+        const uint8_t * qj = pol->q_masks[j], * bj = pol->b_masks[j];
+        for(uint64_t k = 0; k < span->len; ++k){
+                if(counted(span, qi, k) & qj[k] & (bi[k] ^ bj[k])) return false;
+        }
+        return true;
+}
+
+/* Returns whether every packet matching rule j matches rule i */
+static bool covers(const mask_span * span, uint64_t i, uint64_t j)
+{
+        const policy * pol = span->pol;
+        const uint8_t * qi = pol->q_masks[i], * bi = pol->b_masks[i];
+        const uint8_t * qj = pol->q_masks[j], * bj = pol->b_masks[j];
+        for(uint64_t k = 0; k < span->len; ++k){
+                const uint8_t q = counted(span, qi, k);
+                if((q & ~qj[k]) || (q & (bi[k] ^ bj[k]))) return false;
+        }
+        return true;
+}
+
+/* Makes rule i match the packets of rule j as well if they have the same ?
+ * mask and differ in one fixed bit, by making that bit a ?. Returns whether
+ * they did. */
+static bool merge(const mask_span * span, uint64_t i, uint64_t j)
+{
+        const policy * pol = span->pol;
+        uint8_t * qi = pol->q_masks[i], * bi = pol->b_masks[i];
+        const uint8_t * qj = pol->q_masks[j], * bj = pol->b_masks[j];
+        const uint64_t len = span->len;
+        uint64_t at = len;
+        uint8_t bit = 0;
+        for(uint64_t k = 0; k < len; ++k){
+                const uint8_t q = counted(span, qi, k);
+                if(q != counted(span, qj, k)) return false;
+                const uint8_t differ = q & (bi[k] ^ bj[k]);
+                if(differ == 0) continue;
+                if(at != len || (differ & (differ - 1)) != 0) return false;
+                at = k;
+                bit = differ;
+        }
+        if(at == len) return false;
+        qi[at] &= ~bit;
+        bi[at] &= ~bit;
+        return true;
+}
+
+/* Returns whether rule j can go, being covered by an earlier rule, or merged
+ * into an earlier or covered by a later rule of the same action */
+static bool redundant(const mask_span * span, const bool * live, uint64_t j)
+{
+        const uint32_t * act = span->pol->actions->of_rule;
+        const uint64_t first = j > ACTION_WINDOW ? j - ACTION_WINDOW : 0;
+        const uint64_t last = min(span->pol->n, j + ACTION_WINDOW + 1);
+        for(uint64_t i = j; i-- > first; ){
+                if(live[i] && covers(span, i, j)) return true;
+        }
+        for(uint64_t i = j; i-- > first; ){
+                if(!live[i]) continue;
+                if(act[i] != act[j]){
+                        if(overlap(span, i, j)) break;
+                }else if(merge(span, i, j)){
+                        return true;
+                }
+        }
+        for(uint64_t k = j + 1; k < last; ++k){
+                if(!live[k]) continue;
+                if(act[k] != act[j]){
+                        if(overlap(span, k, j)) break;
+                }else if(covers(span, k, j)){
+                        return true;
+                }
+        }
+        return false;
+}
+
+/* Drops and merges rules of *pol, which must have actions, wherever the action
+ * of the first rule a packet matches stays the same, and adds the rules before
+ * and after to rc */
+void actions_reduce(policy * pol, run_counters * rc)
+{
+        rule_actions * a = pol->actions;
+        const uint64_t n = pol->n;
+        /* Like the tables, only the first b bits count, in the order
+         * extract_section takes them, which is from the least significant bit
+         * of each byte */
+        mask_span span = {.pol = pol,
+                          .len = min(pol->B / BitsInByte, pol->pl),
+                          .last_mask = 0xff};
+        if(span.len == pol->B / BitsInByte && pol->b % BitsInByte != 0){
+                span.last_mask = (1 << (pol->b % BitsInByte)) - 1;
+        }
+        bool * live = malloc(n * sizeof(bool));
+        if(live == NULL){
+                Error("Could not allocate memory for actions!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t w = 0; w < n; ++w) live[w] = true;
+
+        bool changed = true;
+        while(changed){
+                changed = false;
+                for(uint64_t j = 0; j < n; ++j){
+                        if(live[j] && redundant(&span, live, j)){
+                                live[j] = false;
+                                changed = true;
+                        }
+                }
+        }
+
+        /* Close up the rules left */
+        uint64_t kept = 0;
+        for(uint64_t w = 0; w < n; ++w){
+                if(!live[w]) continue;
+                if(kept != w){
+                        memcpy(pol->q_masks[kept], pol->q_masks[w],
+                               pol->B / BitsInByte);
+                        memcpy(pol->b_masks[kept], pol->b_masks[w],
+                               pol->B / BitsInByte);
+                        a->of_rule[kept] = a->of_rule[w];
+                }
+                kept++;
+        }
+        const uint64_t N = 8 * ceil_div(kept, 8);
+        Trace("Merged %"PRIu64" rules of %"PRIu64" actions into %"PRIu64
+              ", taking the smallest tables from %"PRIu64" to %"PRIu64
+              " bytes\n", n, a->count, kept,
+              ceil_div(2 * pol->N * pol->b, 8), ceil_div(2 * N * pol->b, 8));
+        a->rules = kept;
+        pol->n = kept;
+        pol->N = N;
+        rc->action_rules_read += n;
+        rc->action_rules_kept += kept;
+        rc->action_count += a->count;
+        free(live);
+}
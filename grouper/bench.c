@@ -0,0 +1,459 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Benchmark harness. It is linked with the rest of grouper and sweeps every
+ * combination of numbers of rules, policy bits and memory budgets. For each
+ * combination a policy and input are generated in memory from a seed, so a run
+ * can be reproduced exactly, and the three phases of grouper are timed over a
+ * number of repetitions after some warmups: reading the policy, building the
+ * tables and classifying the input. The median and percentiles of each phase's
+ * throughput are written out as JSON or CSV. */
+
+#include "grouper.h"
+#include <sys/mman.h>           /* For memfd_create() */
+#include <fcntl.h>              /* For open() */
+
+#define MAX_STEPS 64            /* Most values swept of any parameter */
+#define MAX_REPS 1000           /* Most repetitions of a combination */
+#define PHASES 3
+
+/* Phases of a run */
+static const char * phase_names[PHASES] = {"read", "build", "classify"};
+/* What each phase's throughput counts */
+static const char * phase_units[PHASES] = {"rules/s", "bytes/s", "packets/s"};
+/* Why a combination the engine cannot take is skipped */
+static const char * plan_reasons[] = {
+        [PLAN_NO_MEMORY]        = "not enough memory",
+        [PLAN_NO_SLICED_MEMORY] = "not enough memory to bitslice",
+        [PLAN_NOT_SLICEABLE]    = "too many rules to bitslice",
+        [PLAN_NO_TREE_MEMORY]   = "not enough memory for a tree"
+};
+
+/* A list of values to sweep */
+typedef struct {
+        uint64_t n;
+        uint64_t values[MAX_STEPS];
+} steps;
+
+/* Everything measured for one combination */
+typedef struct {
+        uint64_t rules;
+        uint64_t bits;
+        uint64_t memory;        /* Budget in bytes */
+        const char * skipped;   /* Why it was not run, or NULL */
+        uint64_t tables;
+        const char * engine;
+        uint64_t work[PHASES];  /* Rules, table bytes and packets handled */
+        uint64_t reps;
+        long usec[PHASES][MAX_REPS];
+} result;
+
+/* Options of the harness itself */
+typedef struct {
+        steps rules;
+        steps bits;
+        steps memory;
+        uint64_t packets;
+        uint64_t reps;
+        uint64_t warmups;
+        uint64_t seed;
+        bool csv;
+} bench_options;
+
+/* Grouper options given, restored before each run */
+static options opts_requested;
+
+/* splitmix64, so runs don't depend on the C library's rand() */
+static uint64_t next_random(uint64_t * state)
+{
+        uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        return z ^ (z >> 31);
+}
+
+/* Parses a comma separated list of numbers */
+static void parse_steps(const char * arg, steps * s)
+{
+        s->n = 0;
+        const char * p = arg;
+        while(*p != '\0'){
+                if(s->n == MAX_STEPS){
+                        Error("At most %d values can be swept.\n", MAX_STEPS);
+                        exit(EXIT_FAILURE);
+                }
+                char * end;
+                s->values[s->n++] = strtoull(p, &end, 10);
+                if(end == p || (*end != ',' && *end != '\0')){
+                        Error("Invalid list '%s'.\n", arg);
+                        exit(EXIT_FAILURE);
+                }
+                p = *end == ',' ? end + 1 : end;
+        }
+}
+
+/* Writes a policy of random rules over bits bits in the format pol_gen uses,
+ * returning its length. Packets are the bits rounded up to whole bytes. */
+static size_t generate_policy(uint64_t rules, uint64_t bits, uint64_t * state,
+                              char ** text)
+{
+        const size_t size = 32 + rules * (bits + 1);
+        char * t = malloc(size);
+        if(t == NULL){
+                Error("Could not allocate memory for policy!\n");
+                exit(EXIT_FAILURE);
+        }
+        size_t len = sprintf(t, "%"PRIu64"\n", ceil_div(bits, 8));
+        for(uint64_t i = 0; i < rules; ++i){
+                for(uint64_t j = 0; j < bits; ++j){
+                        t[len++] = "01?"[next_random(state) % 3];
+                }
+                t[len++] = '\n';
+        }
+        *text = t;
+        return len;
+}
+
+/* Writes count random packets of pl bytes to an in memory file */
+static int generate_input(uint64_t count, uint64_t pl, uint64_t * state)
+{
+        int fd = memfd_create("grouper-bench-input", 0);
+        if(fd < 0){
+                Error("Could not create input file! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        uint8_t * packets = malloc(count * pl);
+        if(packets == NULL){
+                Error("Could not allocate memory for input!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t i = 0; i < count * pl; i += sizeof(uint64_t)){
+                uint64_t r = next_random(state);
+                memcpy(packets + i, &r, min(sizeof(uint64_t), count * pl - i));
+        }
+        for(uint64_t done = 0; done < count * pl; ){
+                ssize_t ret = write(fd, packets + done, count * pl - done);
+                if(ret < 0){
+                        Error("Could not write input! errno = %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+                done += ret;
+        }
+        free(packets);
+        return fd;
+}
+
+/* Runs every phase once for a combination, adding the times to r unless it is
+ * a warmup. Marks r skipped if the engine cannot take the combination. */
+static void run_once(const char * text, size_t len, int infd, int outfd,
+                     result * r, bool warmup)
+{
+        profile_t timer;
+        long usec[PHASES];
+        opts = opts_requested;
+
+        FILE * file = fmemopen((void *) text, len, "r");
+        if(file == NULL){
+                Error("Could not open policy! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        start_timing(&timer);
+        policy pol = read_policy(file);
+        usec[0] = end_timing(&timer);
+        fclose(file);
+
+        table_set ts;
+        start_timing(&timer);
+        uint64_t bitwidth;
+        plan_status status;
+        uint64_t t = try_plan_tables(pol, r->memory * 8, &bitwidth, &status);
+        if(t != TABLE_ERROR){
+                t = try_build_tables(pol, t, bitwidth, r->memory * 8, &ts,
+                                     &status);
+        }
+        array2d_free(pol.q_masks);
+        array2d_free(pol.b_masks);
+        pol.q_masks = pol.b_masks = NULL;
+        usec[1] = end_timing(&timer);
+        if(t == TABLE_ERROR){
+                r->skipped = plan_reasons[status];
+                return;
+        }
+
+        lseek(infd, 0, SEEK_SET);
+        start_timing(&timer);
+        input_stream * in = input_open(infd, pol.pl);
+        output_stream * out = output_open(outfd);
+        read_input_and_classify(pol, &ts, in, out);
+        input_close(in);
+        output_close(out);
+        usec[2] = end_timing(&timer);
+
+        r->tables = t;
+        r->engine = opts.engine == ENGINE_BITSLICED ? "bitsliced" : "generic";
+        if(ts.tree != NULL) r->engine = "tree";
+        if(ts.pool != NULL){
+                r->engine = opts.engine == ENGINE_BITSLICED ? "bitsliced dedup"
+                                                           : "generic dedup";
+        }
+        r->work[0] = pol.n;
+        r->work[1] = table_set_bytes(&ts);
+        free_table_set(&ts);
+        if(warmup) return;
+        for(uint64_t p = 0; p < PHASES; ++p){
+                r->usec[p][r->reps] = usec[p];
+        }
+        r->reps++;
+}
+
+/* Benchmarks one combination */
+static void run_combination(const bench_options * b, uint64_t rules,
+                            uint64_t bits, uint64_t memory, result * r)
+{
+        memset(r, 0, sizeof(*r));
+        r->rules = rules;
+        r->bits = bits;
+        r->memory = memory;
+        r->work[2] = b->packets;
+
+        uint64_t t = min_tables(memory * 8, rules, bits);
+        if(t == TABLE_ERROR){
+                r->skipped = "not enough memory";
+                return;
+        }
+        if(t == 1){
+                /* As with bigtest.py, a single table is out of scope */
+                r->skipped = "single table";
+                return;
+        }
+
+        /* Every memory budget sees the same policy and input */
+        uint64_t state = b->seed ^ (rules * UINT64_C(0x100000001b3)) ^
+                (bits << 40);
+        char * text;
+        size_t len = generate_policy(rules, bits, &state, &text);
+        int infd = generate_input(b->packets, ceil_div(bits, 8), &state);
+        int outfd = open("/dev/null", O_WRONLY);
+        if(outfd < 0){
+                Error("Could not open /dev/null! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+
+        Error("%"PRIu64" rules, %"PRIu64" bits, %"PRIu64" bytes...\n",
+              rules, bits, memory);
+        for(uint64_t i = 0; i < b->warmups + b->reps && r->skipped == NULL;
+            ++i){
+                run_once(text, len, infd, outfd, r, i < b->warmups);
+        }
+        free(text);
+        close(infd);
+        close(outfd);
+}
+
+static int compare_double(const void * a, const void * b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+/* Returns the p'th percentile of n sorted values by nearest rank */
+static double percentile(const double * sorted, uint64_t n, double p)
+{
+        uint64_t rank = (uint64_t) ceil(p / 100 * n);
+        return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+/* Summary of a phase over the repetitions */
+typedef struct {
+        double rate[3];         /* Median, 10th and 90th percentile */
+        double usec[3];         /* Same of the time taken */
+} summary;
+
+static summary summarise(const result * r, uint64_t p)
+{
+        static const double pcts[3] = {50, 10, 90};
+        double rates[MAX_REPS], usecs[MAX_REPS];
+        for(uint64_t i = 0; i < r->reps; ++i){
+                usecs[i] = r->usec[p][i];
+                /* Keep zero length phases from dividing by zero */
+                rates[i] = r->work[p] * 1e6 / (usecs[i] > 0 ? usecs[i] : 1);
+        }
+        qsort(rates, r->reps, sizeof(double), compare_double);
+        qsort(usecs, r->reps, sizeof(double), compare_double);
+        summary s;
+        for(uint64_t i = 0; i < 3; ++i){
+                s.rate[i] = percentile(rates, r->reps, pcts[i]);
+                s.usec[i] = percentile(usecs, r->reps, pcts[i]);
+        }
+        return s;
+}
+
+static void print_csv_header(FILE * f)
+{
+        fprintf(f, "rules,bits,memory,status,tables,engine,packets,repetitions,"
+                "phase,unit,median,p10,p90,median_usec,p10_usec,p90_usec\n");
+}
+
+static void print_csv(FILE * f, const result * r, uint64_t packets)
+{
+        if(r->skipped != NULL){
+                fprintf(f, "%"PRIu64",%"PRIu64",%"PRIu64",%s,,,,,,,,,,,,\n",
+                        r->rules, r->bits, r->memory, r->skipped);
+                return;
+        }
+        for(uint64_t p = 0; p < PHASES; ++p){
+                summary s = summarise(r, p);
+                fprintf(f, "%"PRIu64",%"PRIu64",%"PRIu64",ok,%"PRIu64",%s,"
+                        "%"PRIu64",%"PRIu64",%s,%s,%.0f,%.0f,%.0f,%.0f,%.0f,"
+                        "%.0f\n", r->rules, r->bits, r->memory, r->tables,
+                        r->engine, packets, r->reps, phase_names[p],
+                        phase_units[p], s.rate[0], s.rate[1], s.rate[2],
+                        s.usec[0], s.usec[1], s.usec[2]);
+        }
+}
+
+static void print_json(FILE * f, const result * r, uint64_t packets, bool first)
+{
+        fprintf(f, "%s\n  {\"rules\": %"PRIu64", \"bits\": %"PRIu64
+                ", \"memory\": %"PRIu64, first ? "" : ",", r->rules, r->bits,
+                r->memory);
+        if(r->skipped != NULL){
+                fprintf(f, ", \"skipped\": \"%s\"}", r->skipped);
+                return;
+        }
+        fprintf(f, ", \"tables\": %"PRIu64", \"engine\": \"%s\", \"packets\": "
+                "%"PRIu64", \"repetitions\": %"PRIu64",\n   \"phases\": {",
+                r->tables, r->engine, packets, r->reps);
+        for(uint64_t p = 0; p < PHASES; ++p){
+                summary s = summarise(r, p);
+                fprintf(f, "%s\n    \"%s\": {\"unit\": \"%s\", \"median\": %.0f, "
+                        "\"p10\": %.0f, \"p90\": %.0f, \"median_usec\": %.0f, "
+                        "\"p10_usec\": %.0f, \"p90_usec\": %.0f}",
+                        p == 0 ? "" : ",", phase_names[p], phase_units[p],
+                        s.rate[0], s.rate[1], s.rate[2], s.usec[0], s.usec[1],
+                        s.usec[2]);
+        }
+        fprintf(f, "}}");
+}
+
+int main(int argc, char * argv[])
+{
+        bench_options b = {.packets = 100000, .reps = 5, .warmups = 1,
+                           .seed = 1, .csv = false};
+        parse_steps("100,1000", &b.rules);
+        parse_steps("24,32", &b.bits);
+        parse_steps("100000,1000000,10000000", &b.memory);
+        FILE * f = stdout;
+
+        int opt;
+        while((opt = getopt(argc, argv, "n:b:m:p:r:w:S:f:o:e:dg:I:")) != -1){
+                switch(opt){
+                case 'n':
+                        parse_steps(optarg, &b.rules);
+                        break;
+                case 'b':
+                        parse_steps(optarg, &b.bits);
+                        break;
+                case 'm':
+                        parse_steps(optarg, &b.memory);
+                        break;
+                case 'p':
+                        b.packets = atoll(optarg);
+                        break;
+                case 'r':
+                        b.reps = atoll(optarg);
+                        if(b.reps < 1 || b.reps > MAX_REPS){
+                                Error("Repetitions must be between 1 and "
+                                      "%d.\n", MAX_REPS);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'w':
+                        b.warmups = atoll(optarg);
+                        break;
+                case 'S':
+                        b.seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 'f':
+                        if(strcmp(optarg, "json") == 0){
+                                b.csv = false;
+                        }else if(strcmp(optarg, "csv") == 0){
+                                b.csv = true;
+                        }else{
+                                Error("Unknown format '%s'.\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'o':
+                        f = fopen(optarg, "w");
+                        if(f == NULL){
+                                Error("Could not open '%s' for writing.\n",
+                                      optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                default:
+                        if(parse_common_option(opt, optarg)) break;
+                        Error("Usage: %s [-n <rules,...>] [-b <bits,...>]"
+                              " [-m <memory,...>] [-p <packets>]"
+                              " [-r <repetitions>] [-w <warmups>] [-S <seed>]"
+                              " [-f json|csv] [-o <output file>]"
+                              " [-e auto|generic|bitsliced|tree|trial]"
+                              " [-d]"
+                              " [-g <group size>] [-I auto|uring|plain|mmap]\n",
+                              argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        opts_requested = opts;
+
+        result * r = malloc(sizeof(result));
+        if(r == NULL){
+                Error("Could not allocate memory for results!\n");
+                exit(EXIT_FAILURE);
+        }
+        if(b.csv){
+                print_csv_header(f);
+        }else{
+                fprintf(f, "[");
+        }
+        bool first = true;
+        for(uint64_t i = 0; i < b.bits.n; ++i){
+                for(uint64_t j = 0; j < b.rules.n; ++j){
+                        for(uint64_t k = 0; k < b.memory.n; ++k){
+                                run_combination(&b, b.rules.values[j],
+                                                b.bits.values[i],
+                                                b.memory.values[k], r);
+                                if(b.csv){
+                                        print_csv(f, r, b.packets);
+                                }else{
+                                        print_json(f, r, b.packets, first);
+                                }
+                                fflush(f);
+                                first = false;
+                        }
+                }
+        }
+        if(!b.csv) fprintf(f, "\n]\n");
+        free(r);
+        if(f != stdout) fclose(f);
+        return EXIT_SUCCESS;
+}
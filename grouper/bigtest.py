@@ -185,7 +185,9 @@ def multi_d_test(mem_steps, rule_steps, bit_steps,
                  test_filename = 'test_file.csv',
                  max_steps = None,
                  massive = False,
-                 dryrun = False):
+                 dryrun = False,
+                 shard_steps = [1],
+                 shard_processes = False):
     """Do multi-dimensional test with the given steps"""
     # make a new data file if necessary
     
@@ -196,7 +198,7 @@ def multi_d_test(mem_steps, rule_steps, bit_steps,
                   'kbps','pps','table build time', 'memory used',
                   'number of tables', 'policy read time', 'total run time',
                   'repeat run', 'command', 'cpu process time',
-                  'real process time']
+                  'real process time', 'shards', 'real pps']
         dep_fields = len(fields) - 3 # number of dependent fields 
         writer.writerow(fields)
         # dict for memoizing results
@@ -239,69 +241,87 @@ def multi_d_test(mem_steps, rule_steps, bit_steps,
                     print "\tShould take %d tables and %d bytes" % \
                         (tables, memory_used)
 
-                    runstring = "%s %d %s %s %s" % (programname, mem, rule_filename,
-                                      data_filename, os.devnull)
-
-                    #check if this run has already been done
-                    key = (tables, memory_used, bits, rules)
-                    if key in memoizer:
-                        res = memoizer[key]
-                        write_array = [mem, rules, bits, res['kbps'],
-                                       res['pps'], res['build_time'], 
-                                       memory_used, tables, res['pol_read'],
-                                       res['total_time'], 'true', runstring,
-                                       res['cpu_process'], res['real_process']]
-                        writer.writerow(write_array)
-                        print "\tRun already completed, using cached values"
-                        continue
+                    for shards in shard_steps:
+                        shard_opts = ""
+                        if shards > 1:
+                            shard_opts = "-s %d %s" % (shards,
+                                                       "-P" if shard_processes else "")
+                        runstring = "%s %s %d %s %s %s" % (programname, shard_opts,
+                                                           mem, rule_filename,
+                                                           data_filename, os.devnull)
+
+                        #check if this run has already been done
+                        key = (tables, memory_used, bits, rules, shards)
+                        if key in memoizer:
+                            res = memoizer[key]
+                            write_array = [mem, rules, bits, res['kbps'],
+                                           res['pps'], res['build_time'], 
+                                           memory_used, tables, res['pol_read'],
+                                           res['total_time'], 'true', runstring,
+                                           res['cpu_process'], res['real_process'],
+                                           shards, res['real_pps']]
+                            writer.writerow(write_array)
+                            print "\tRun already completed, using cached values"
+                            continue
                     
-                    #run the benchmark for the current memory size over the input
-                    print "\tBenchmarking '", runstring , "' ... "
-                    timings = {}
-                    if not dryrun:
-                        runbench = Popen(runstring , stderr = STDOUT, stdout = PIPE,
-                                         shell=True)
-                        timings = eval(runbench.communicate()[0]) #expecting a dict
-                    else:
-                        #fake run timings
-                        timings = { 'read' : 123456, 'build' : 123456,
-                                    'cpu_process' : 123456, 
-                                    'real_process' : 123456, 'total' : 456789 }
-
-                    print "\tTimings:", timings                  
-                    # calculate final values
-
-                    # the timing values returned are in microseconds, so we must
-                    # divide them by 1,000,000 to get seconds
-                    usec2sec = lambda x: Decimal(x) / 1000000
-                    read_secs = usec2sec(timings['read'])
-                    build_secs = usec2sec(timings['build'])
-                    cpu_process_secs = usec2sec(timings['cpu_process'])
-                    if cpu_process_secs == Decimal(0):
-                        print "CPU time measured was below system resolution, " \
-                        "increase the number of packets being processed and try again"
-                        os.remove(rule_filename)
-                        os.remove(data_filename)
-                        exit()
-                    real_process_secs = usec2sec(timings['real_process'])
-                    total_secs = usec2sec(timings['total'])
-                    num_packets = data_size * 1000
-                    pps = Decimal(num_packets) / cpu_process_secs
-                    Kbps = Decimal(1500 * 8 * num_packets) / cpu_process_secs
+                        #run the benchmark for the current memory size over the input
+                        print "\tBenchmarking '", runstring , "' ... "
+                        timings = {}
+                        if not dryrun:
+                            runbench = Popen(runstring , stderr = STDOUT, stdout = PIPE,
+                                             shell=True)
+                            output = runbench.communicate()[0]
+                            if runbench.returncode != 0:
+                                # e.g. too little memory to split into shards
+                                print "\tRun failed:", output
+                                writer.writerow([mem, rules, bits] + ['']*dep_fields)
+                                continue
+                            timings = eval(output) #expecting a dict
+                        else:
+                            #fake run timings
+                            timings = { 'read' : 123456, 'build' : 123456,
+                                        'cpu_process' : 123456, 
+                                        'real_process' : 123456, 'total' : 456789 }
+
+                        print "\tTimings:", timings                  
+                        # calculate final values
+
+                        # the timing values returned are in microseconds, so we must
+                        # divide them by 1,000,000 to get seconds
+                        usec2sec = lambda x: Decimal(x) / 1000000
+                        read_secs = usec2sec(timings['read'])
+                        build_secs = usec2sec(timings['build'])
+                        cpu_process_secs = usec2sec(timings['cpu_process'])
+                        if cpu_process_secs == Decimal(0):
+                            print "CPU time measured was below system resolution, " \
+                            "increase the number of packets being processed and try again"
+                            os.remove(rule_filename)
+                            os.remove(data_filename)
+                            exit()
+                        real_process_secs = usec2sec(timings['real_process'])
+                        total_secs = usec2sec(timings['total'])
+                        num_packets = data_size * 1000
+                        pps = Decimal(num_packets) / cpu_process_secs
+                        # shard processes don't count towards our cpu time, so
+                        # the throughput of sharded runs is taken from real time
+                        real_pps = Decimal(num_packets) / real_process_secs
+                        Kbps = Decimal(1500 * 8 * num_packets) / cpu_process_secs
                     
-                    # append current run info to the benchmark file
-                    writer.writerow([mem, rules, bits, q1(Kbps),
-                                     q1(pps), q0001(build_secs),
-                                     memory_used, tables, q0001(read_secs),
-                                     q0001(total_secs), 'false', runstring,
-                                     q0001(cpu_process_secs), q0001(real_process_secs)])
-                    # add current run info to the memoizer
-                    memoizer[key] = dict(kbps = q1(Kbps), pps = q1(pps), 
-                                         build_time = q0001(build_secs), 
-                                         pol_read = q0001(read_secs),
-                                         total_time = q0001(total_secs),
-                                         cpu_process = q0001(cpu_process_secs),
-                                         real_process = q0001(real_process_secs))
+                        # append current run info to the benchmark file
+                        writer.writerow([mem, rules, bits, q1(Kbps),
+                                         q1(pps), q0001(build_secs),
+                                         memory_used, tables, q0001(read_secs),
+                                         q0001(total_secs), 'false', runstring,
+                                         q0001(cpu_process_secs), q0001(real_process_secs),
+                                         shards, q1(real_pps)])
+                        # add current run info to the memoizer
+                        memoizer[key] = dict(kbps = q1(Kbps), pps = q1(pps), 
+                                             build_time = q0001(build_secs), 
+                                             pol_read = q0001(read_secs),
+                                             total_time = q0001(total_secs),
+                                             cpu_process = q0001(cpu_process_secs),
+                                             real_process = q0001(real_process_secs),
+                                             real_pps = q1(real_pps))
                 #clean up rule file
                 os.remove(rule_filename)
             #clean up data file
@@ -374,6 +394,14 @@ def main():
         parser.add_option('-M','--massive_test', dest='massive', type='int',
                           help = "Number of levels in a massive test. Supplying this "
                           "option obviates supplying -a")
+        parser.add_option('-s', '--shard-steps', dest='shard_steps',
+                          default = "[1]",
+                          help = "A string denoting a list of shard counts to "
+                          "run each test with")
+        parser.add_option('-P', '--shard-processes', dest='shard_processes',
+                          action = 'store_true', default = False,
+                          help = "Run shards as separate processes instead of "
+                          "threads")
         parser.add_option('-T', '--testrun', dest='dryrun', action='store_true',
                           default = False, 
                           help = "Do a dry run of the test script, don't "
@@ -434,7 +462,9 @@ def main():
                          programname = options.programname,
                          max_steps = options.max_steps,
                          massive = options.massive,
-                         dryrun = options.dryrun)
+                         dryrun = options.dryrun,
+                         shard_steps = list(eval(options.shard_steps)),
+                         shard_processes = options.shard_processes)
             round_end = time.time()
             print "Round %d took %s" % (i, durationstr(round_end - round_start))
         t_end = time.time()
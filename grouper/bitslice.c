@@ -0,0 +1,105 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The bitsliced engine handles policies of at most BITSLICE_MAX_RULES
+ * rules. The table rows are padded to 64, 128 or 256 bits so that each row is
+ * one, two or four machine words, and a whole block of packets is classified
+ * at once: the rows of every packet in the block are gathered from one table
+ * at a time (see locate_rows) and ANDed into per packet running totals held in
+ * vector registers. */
+
+#include "grouper.h"
+
+typedef uint64_t slice64  __attribute__ ((vector_size (8)));
+typedef uint64_t slice128 __attribute__ ((vector_size (16)));
+typedef uint64_t slice256 __attribute__ ((vector_size (32)));
+
+/* Returns the row width in bits the bitsliced engine needs for n rules */
+uint64_t bitslice_width(uint64_t n)
+{
+        if(n <= 64) return 64;
+        if(n <= 128) return 128;
+        return 256;
+}
+
+/* Generates the block classifier for one row width. SLICE is the vector type
+ * holding a whole row and WORDS the number of 64 bit words in it. Rows are
+ * loaded with memcpy since the tables are only guaranteed 16 byte alignment. */
+#define BITSLICE_CLASSIFIER(NAME, SLICE, WORDS)                                \
+static void NAME(uint64_t tables, uint64_t count,                             \
+                 const uint8_t * rows[][count], uint64_t matches[count])      \
+{                                                                             \
+        SLICE total[BITSLICE_BLOCK];                                          \
+        for(uint64_t p = 0; p < count; ++p){                                  \
+                memcpy(&total[p], rows[0][p], sizeof(SLICE));                 \
+        }                                                                     \
+        for(uint64_t i = 1; i < tables; ++i){                                 \
+                for(uint64_t p = 0; p < count; ++p){                          \
+                        SLICE row;                                            \
+                        memcpy(&row, rows[i][p], sizeof(SLICE));              \
+                        total[p] &= row;                                      \
+                }                                                             \
+        }                                                                     \
+        for(uint64_t p = 0; p < count; ++p){                                  \
+                matches[p] = 0;                                               \
+                for(uint64_t w = 0; w < WORDS; ++w){                          \
+                        if(total[p][w] != 0){                                 \
+                                matches[p] = w * 64 +                         \
+                                        __builtin_ctzll(total[p][w]) + 1;     \
+                                break;                                        \
+                        }                                                     \
+                }                                                             \
+        }                                                                     \
+}
+
+BITSLICE_CLASSIFIER(classify_slice64,  slice64,  1)
+BITSLICE_CLASSIFIER(classify_slice128, slice128, 2)
+BITSLICE_CLASSIFIER(classify_slice256, slice256, 4)
+
+/* Classifies a block of up to BITSLICE_BLOCK packets with tables whose rows are
+ * bitslice_width bits wide */
+void classify_bitsliced(policy pol, const table_set * ts, const uint8_t * packets,
+                        uint64_t count, uint64_t matches[count])
+{
+        const uint64_t tables = ts->dims.even_d + ts->dims.odd_d;
+        const uint8_t * rows[tables][count];
+        locate_rows(pol, ts, packets, count, rows);
+        match_bitsliced_rows(ts->dims, count, rows, matches);
+}
+
+/* Classifies a block of up to BITSLICE_BLOCK packets from the rows located for
+ * them */
+void match_bitsliced_rows(table_dims dim, uint64_t count,
+                          const uint8_t * rows[][count],
+                          uint64_t matches[count])
+{
+        const uint64_t tables = dim.even_d + dim.odd_d;
+        switch(dim.bitwidth){
+        case 64:
+                classify_slice64(tables, count, rows, matches);
+                break;
+        case 128:
+                classify_slice128(tables, count, rows, matches);
+                break;
+        default:
+                classify_slice256(tables, count, rows, matches);
+        }
+}
@@ -0,0 +1,196 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The flow cache remembers the rule matched by recently seen packets, so that
+ * packets repeating a recent header skip the table lookup. It is set
+ * associative: a packet's hash picks a set of FLOW_CACHE_WAYS entries, whose
+ * tags and matches share one cache line, and only entries with the packet's
+ * tag have their keys compared. A full set replaces its entries round robin.
+ *
+ * Only the first b bits of a packet take part in classification, so those are
+ * the key; packets that differ only in later bytes share an entry. A cache
+ * belongs to one thread and remembers which tables its matches came from, it
+ * empties itself when it is used with any others. */
+
+#include "grouper.h"
+
+/* One set of entries, a cache line in all */
+typedef struct {
+        uint32_t tags[FLOW_CACHE_WAYS];         /* Hash tags, 0 if empty */
+        uint64_t matches[FLOW_CACHE_WAYS];      /* Rule matched by each key */
+        uint32_t victim;                        /* Way to replace next */
+} __attribute__ ((aligned (CACHE_LINE))) cache_set;
+
+struct FLOW_CACHE {
+        uint64_t set_mask;      /* Number of sets - 1 */
+        uint64_t key_len;       /* Bytes of a key */
+        uint8_t last_mask;      /* Bits of the last key byte that count */
+        uint64_t generation;    /* Tables the matches came from */
+        cache_set * sets;
+        uint8_t * keys;         /* Key of every entry */
+        uint8_t * pending;      /* Packets missed in a group */
+        uint64_t hits;
+        uint64_t misses;
+};
+
+/* Counter handed out to each set of tables built */
+static uint64_t generations = 0;
+
+/* Returns a generation no other set of tables has */
+uint64_t new_generation(void)
+{
+        return __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+}
+
+/* Creates a cache of at least entries entries for the packets of pol */
+flow_cache * flow_cache_new(policy pol, uint64_t entries)
+{
+        flow_cache * c = calloc(1, sizeof(flow_cache));
+        if(c == NULL){
+                Error("Could not allocate memory for flow cache!\n");
+                exit(EXIT_FAILURE);
+        }
+        uint64_t sets = 1;
+        while(sets * FLOW_CACHE_WAYS < entries) sets *= 2;
+        c->set_mask = sets - 1;
+        c->key_len = min(ceil_div(pol.b, BitsInByte), pol.pl);
+        c->last_mask = pol.b % BitsInByte == 0 ? 0xff
+                : (1 << (pol.b % BitsInByte)) - 1;
+        c->sets = aligned_alloc(CACHE_LINE, sets * sizeof(cache_set));
+        c->keys = malloc(sets * FLOW_CACHE_WAYS * c->key_len);
+        c->pending = malloc(MAX_GROUP_SIZE * pol.pl);
+        if(c->sets == NULL || c->keys == NULL || c->pending == NULL){
+                Error("Could not allocate memory for flow cache!\n");
+                exit(EXIT_FAILURE);
+        }
+        flow_cache_clear(c);
+        return c;
+}
+
+/* Empties a cache */
+void flow_cache_clear(flow_cache * c)
+{
+        memset(c->sets, 0, (c->set_mask + 1) * sizeof(cache_set));
+        c->generation = 0;
+}
+
+/* Frees a cache, adding its hits and misses to *hits and *misses */
+void flow_cache_free(flow_cache * c, uint64_t * hits, uint64_t * misses)
+{
+        *hits += c->hits;
+        *misses += c->misses;
+        free(c->sets);
+        free(c->keys);
+        free(c->pending);
+        free(c);
+}
+
+/* Copies the key of a packet to key, returning its 64 bit FNV-1a hash */
+static inline uint64_t make_key(const flow_cache * c, const uint8_t * packet,
+                                uint8_t * key)
+{
+        memcpy(key, packet, c->key_len);
+        key[c->key_len - 1] &= c->last_mask;
+        uint64_t hash = UINT64_C(14695981039346656037);
+        for(uint64_t i = 0; i < c->key_len; ++i){
+                hash ^= key[i];
+                hash *= UINT64_C(1099511628211);
+        }
+        return hash;
+}
+
+/* The tag of a hash, never 0 */
+static inline uint32_t hash_tag(uint64_t hash)
+{
+        return (hash >> 32) | 1;
+}
+
+/* Returns the way of a set holding key, or FLOW_CACHE_WAYS if none does */
+static inline uint64_t find_way(const flow_cache * c, uint64_t hash,
+                                const uint8_t * key)
+{
+        const uint64_t set = hash & c->set_mask;
+        const cache_set * s = &c->sets[set];
+        const uint32_t tag = hash_tag(hash);
+        for(uint64_t w = 0; w < FLOW_CACHE_WAYS; ++w){
+                if(s->tags[w] == tag &&
+                   memcmp(c->keys + (set * FLOW_CACHE_WAYS + w) * c->key_len,
+                          key, c->key_len) == 0){
+                        return w;
+                }
+        }
+        return FLOW_CACHE_WAYS;
+}
+
+/* Remembers the rule matched by a key, unless it is already known */
+static inline void insert(flow_cache * c, uint64_t hash, const uint8_t * key,
+                          uint64_t match)
+{
+        if(find_way(c, hash, key) != FLOW_CACHE_WAYS) return;
+        const uint64_t set = hash & c->set_mask;
+        cache_set * s = &c->sets[set];
+        const uint64_t w = s->victim;
+        s->victim = (w + 1) % FLOW_CACHE_WAYS;
+        s->tags[w] = hash_tag(hash);
+        s->matches[w] = match;
+        memcpy(c->keys + (set * FLOW_CACHE_WAYS + w) * c->key_len, key,
+               c->key_len);
+}
+
+/* Classifies a group of up to MAX_GROUP_SIZE packets, looking each up in the
+ * cache first. The packets missed are gathered and classified together by
+ * classify, then remembered. */
+void classify_cached(policy pol, const table_set * ts, flow_cache * c,
+                     classifier classify, const uint8_t * packets,
+                     uint64_t count, uint64_t matches[count])
+{
+        if(c->generation != ts->generation){
+                flow_cache_clear(c);
+                c->generation = ts->generation;
+        }
+
+        uint64_t which[count];
+        uint64_t hashes[count];
+        uint8_t keys[count][c->key_len];
+        uint64_t npending = 0;
+        for(uint64_t p = 0; p < count; ++p){
+                const uint8_t * packet = packets + p * pol.pl;
+                uint64_t hash = make_key(c, packet, keys[p]);
+                uint64_t w = find_way(c, hash, keys[p]);
+                if(w != FLOW_CACHE_WAYS){
+                        matches[p] = c->sets[hash & c->set_mask].matches[w];
+                        continue;
+                }
+                memcpy(c->pending + npending * pol.pl, packet, pol.pl);
+                hashes[npending] = hash;
+                which[npending++] = p;
+        }
+        c->hits += count - npending;
+        c->misses += npending;
+        if(npending == 0) return;
+
+        uint64_t local[npending];
+        classify(pol, ts, c->pending, npending, local);
+        for(uint64_t i = 0; i < npending; ++i){
+                matches[which[i]] = local[i];
+                insert(c, hashes[i], keys[which[i]], local[i]);
+        }
+}
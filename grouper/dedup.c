@@ -0,0 +1,319 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Deduplicated tables store a 32 bit row id for every table entry, indexing a
+ * pool of unique rows shared by all tables. Rows are built one at a time with
+ * build_row and hashed, so a table is never held in full. Every table is
+ * deduplicated on its own by one of a pool of threads, and the unique rows of
+ * all tables are then merged into the shared pool. */
+
+#include "grouper.h"
+
+#define ROW_ID_BITS 32
+#define MAX_UNIQUE_ROWS UINT32_MAX
+#define INITIAL_DICT_ROWS 64
+
+/* Unique rows and a hash index over them */
+typedef struct {
+        uint64_t bytewidth;     /* Width of a row */
+        uint8_t * rows;         /* count x bytewidth unique rows */
+        uint64_t * hashes;      /* Hash of each unique row */
+        uint64_t count;         /* Number of unique rows */
+        uint64_t capacity;      /* Rows allocated */
+        uint32_t * slots;       /* Open addressed hash slots, holding id + 1 */
+        uint64_t slot_mask;     /* Number of slots - 1 */
+} row_dict;
+
+/* State shared by the threads building one set of deduplicated tables */
+typedef struct {
+        policy * pol;
+        table_set * ts;
+        row_dict * dicts;       /* Unique rows of each table */
+        uint64_t next_table;    /* Next table to hand out */
+        uint64_t limit;         /* Bytes the dictionaries may use */
+        uint64_t used;          /* Bytes held by dictionaries so far */
+        bool overflow;          /* The dictionaries did not fit within limit.
+                                 * Only accessed atomically. */
+} dedup_job;
+
+/* 64 bit FNV-1a hash of a row */
+static uint64_t hash_row(const uint8_t * row, uint64_t bytewidth)
+{
+        uint64_t hash = UINT64_C(14695981039346656037);
+        for(uint64_t i = 0; i < bytewidth; ++i){
+                hash ^= row[i];
+                hash *= UINT64_C(1099511628211);
+        }
+        return hash;
+}
+
+static void dict_init(row_dict * dict, uint64_t bytewidth)
+{
+        dict->bytewidth = bytewidth;
+        dict->count = 0;
+        dict->capacity = INITIAL_DICT_ROWS;
+        dict->rows = malloc(dict->capacity * bytewidth);
+        dict->hashes = malloc(dict->capacity * sizeof(uint64_t));
+        dict->slot_mask = 2 * INITIAL_DICT_ROWS - 1;
+        dict->slots = calloc(dict->slot_mask + 1, sizeof(uint32_t));
+        if(dict->rows == NULL || dict->hashes == NULL || dict->slots == NULL){
+                Error("Could not allocate memory for row dictionary!\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void dict_free(row_dict * dict)
+{
+        free(dict->rows);
+        free(dict->hashes);
+        free(dict->slots);
+        dict->rows = NULL;
+        dict->hashes = NULL;
+        dict->slots = NULL;
+}
+
+/* Returns the bytes of memory a dictionary holds */
+static uint64_t dict_bytes(const row_dict * dict)
+{
+        return dict->capacity * (dict->bytewidth + sizeof(uint64_t)) +
+                (dict->slot_mask + 1) * sizeof(uint32_t);
+}
+
+/* Doubles the row storage and the hash slots of a dictionary */
+static void dict_grow(row_dict * dict)
+{
+        dict->capacity *= 2;
+        dict->rows = realloc(dict->rows, dict->capacity * dict->bytewidth);
+        dict->hashes = realloc(dict->hashes, dict->capacity * sizeof(uint64_t));
+        free(dict->slots);
+        dict->slot_mask = 2 * dict->capacity - 1;
+        dict->slots = calloc(dict->slot_mask + 1, sizeof(uint32_t));
+        if(dict->rows == NULL || dict->hashes == NULL || dict->slots == NULL){
+                Error("Could not allocate memory for row dictionary!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t id = 0; id < dict->count; ++id){
+                uint64_t s = dict->hashes[id] & dict->slot_mask;
+                while(dict->slots[s] != 0) s = (s + 1) & dict->slot_mask;
+                dict->slots[s] = id + 1;
+        }
+}
+
+/* Returns the id of a row, adding it to the dictionary if it is new. added is
+ * set to whether the row was new. */
+static uint32_t dict_insert(row_dict * dict, const uint8_t * row, bool * added)
+{
+        uint64_t hash = hash_row(row, dict->bytewidth);
+        uint64_t s = hash & dict->slot_mask;
+        for(; dict->slots[s] != 0; s = (s + 1) & dict->slot_mask){
+                uint32_t id = dict->slots[s] - 1;
+                if(dict->hashes[id] == hash && 
+                   memcmp(dict->rows + id * dict->bytewidth, row,
+                          dict->bytewidth) == 0){
+                        *added = false;
+                        return id;
+                }
+        }
+        if(dict->count == MAX_UNIQUE_ROWS){
+                Error("Too many unique rows for %d bit row ids!\n", ROW_ID_BITS);
+                exit(EXIT_FAILURE);
+        }
+        uint32_t id = dict->count++;
+        memcpy(dict->rows + id * dict->bytewidth, row, dict->bytewidth);
+        dict->hashes[id] = hash;
+        dict->slots[s] = id + 1;
+        if(dict->count == dict->capacity) dict_grow(dict);
+        *added = true;
+        return id;
+}
+
+/* Returns the fewest tables whose row ids alone fit in m bits. Fewer tables
+ * than that cannot fit no matter how well the rows deduplicate. */
+uint64_t min_tables_dedup(uint64_t m, uint64_t b)
+{
+        for(uint64_t t = 2; t <= b; ++t){
+                double ids = ((t - b % t) * exp2(b/t) + (b % t) * exp2(b/t + 1))
+                        * ROW_ID_BITS;
+                if(ids <= m) return t;
+        }
+        return UINT64_MAX;
+}
+
+/* Returns whether a job's dictionaries have outgrown its limit */
+static bool overflowed(dedup_job * job)
+{
+        return __atomic_load_n(&job->overflow, __ATOMIC_RELAXED);
+}
+
+/* Charges the growth of a dictionary to a job, given the bytes already
+ * charged for it, and returns the bytes charged now */
+static uint64_t charge_dict(dedup_job * job, const row_dict * dict,
+                            uint64_t charged)
+{
+        const uint64_t bytes = dict_bytes(dict);
+        if(bytes != charged &&
+           __atomic_add_fetch(&job->used, bytes - charged, __ATOMIC_RELAXED)
+           > job->limit){
+                __atomic_store_n(&job->overflow, true, __ATOMIC_RELAXED);
+        }
+        return bytes;
+}
+
+/* Thread function deduplicating tables until none are left */
+static void * dedup_tables_thread(void * args)
+{
+        dedup_job * job = args;
+        const table_dims * dims = &job->ts->dims;
+        const uint64_t tables = dims->even_d + dims->odd_d;
+        uint8_t * row = malloc(dims->bytewidth);
+        if(row == NULL){
+                Error("Could not allocate memory for table row!\n");
+                exit(EXIT_FAILURE);
+        }
+
+        uint64_t k;
+        while(!overflowed(job) &&
+              (k = __sync_fetch_and_add(&job->next_table, 1)) < tables){
+                /* Find where this table's section is and where its ids go */
+                bool even = k < dims->even_d;
+                uint64_t i = even ? k : k - dims->even_d;
+                uint64_t size = even ? dims->even_s : dims->odd_s;
+                uint64_t start = even ? i * size :
+                        dims->even_d * dims->even_s + i * size;
+                uint64_t height = even ? dims->even_h : dims->odd_h;
+                uint64_t depth = even ? dims->even_d : dims->odd_d;
+                uint32_t * ids = even ? job->ts->even_ids : job->ts->odd_ids;
+
+                Trace("Deduplicating %s table %"PRIu64"\n",
+                      even ? "even" : "odd", i);
+                const uint64_t started = timeline_start();
+                section_masks sm = get_section_masks(*job->pol, start, size);
+                row_dict * dict = &job->dicts[k];
+                dict_init(dict, dims->bytewidth);
+                uint64_t charged = charge_dict(job, dict, 0);
+                for(uint64_t h = 0; h < height && !overflowed(job); ++h){
+                        bool added;
+                        memset(row, 0, dims->bytewidth);
+                        build_row(&sm, h, row);
+                        ids[h * depth + i] = dict_insert(dict, row, &added);
+                        if(added) charged = charge_dict(job, dict, charged);
+                }
+                free_section_masks(&sm);
+                timeline_end("dedup table", started, "table", k);
+        }
+        free(row);
+        return NULL;
+}
+
+/* Builds deduplicated tables in at most m bits of memory. Returns FAILURE,
+ * leaving ts empty, if they do not fit. The budget is checked against
+ * everything the dictionaries hold, rows, hashes and slots, including the
+ * dictionary of every table and the shared pool held together while they are
+ * merged. */
+int build_dedup_tables(policy pol, table_dims dims, uint64_t m, table_set * ts)
+{
+        const uint64_t tables = dims.even_d + dims.odd_d;
+        uint64_t id_bytes = table_rows(dims) * sizeof(uint32_t);
+        if(id_bytes * 8 > m) return FAILURE;
+
+        *ts = (table_set) TABLE_SET_INIT;
+        ts->dims = dims;
+        ts->even_ids = malloc(dims.even_h * dims.even_d * sizeof(uint32_t));
+        ts->odd_ids = malloc(dims.odd_h * dims.odd_d * sizeof(uint32_t));
+        if(ts->even_ids == NULL || (dims.odd_d != 0 && ts->odd_ids == NULL)){
+                free_table_set(ts);
+                return FAILURE;
+        }
+
+        dedup_job job = {
+                .pol = &pol,
+                .ts = ts,
+                .dicts = calloc(tables, sizeof(row_dict)),
+                .next_table = 0,
+                .limit = m / 8 - id_bytes,
+                .used = 0,
+                .overflow = false
+        };
+        if(job.dicts == NULL){
+                Error("Could not allocate memory for row dictionaries!\n");
+                exit(EXIT_FAILURE);
+        }
+
+        uint64_t nthreads = min((uint64_t) sysconf(_SC_NPROCESSORS_ONLN), tables);
+        pthread_t threads[nthreads];
+        for(uint64_t i = 0; i < nthreads; ++i){
+                pthread_create(&threads[i], NULL, dedup_tables_thread, &job);
+        }
+        for(uint64_t i = 0; i < nthreads; ++i){
+                pthread_join(threads[i], NULL);
+        }
+
+        /* Merge the unique rows of every table into the shared pool, and
+         * renumber each table's ids to point into it */
+        row_dict pool;
+        dict_init(&pool, dims.bytewidth);
+        uint64_t pool_charged = charge_dict(&job, &pool, 0);
+        for(uint64_t k = 0; k < tables && !overflowed(&job); ++k){
+                row_dict * dict = &job.dicts[k];
+                uint32_t * remap = malloc(dict->count * sizeof(uint32_t));
+                if(remap == NULL){
+                        Error("Could not allocate memory for row ids!\n");
+                        exit(EXIT_FAILURE);
+                }
+                for(uint64_t id = 0; id < dict->count; ++id){
+                        bool added;
+                        remap[id] = dict_insert(&pool, dict->rows +
+                                                id * dims.bytewidth, &added);
+                        if(added){
+                                pool_charged = charge_dict(&job, &pool,
+                                                           pool_charged);
+                        }
+                }
+                bool even = k < dims.even_d;
+                uint64_t i = even ? k : k - dims.even_d;
+                uint64_t height = even ? dims.even_h : dims.odd_h;
+                uint64_t depth = even ? dims.even_d : dims.odd_d;
+                uint32_t * ids = even ? ts->even_ids : ts->odd_ids;
+                for(uint64_t h = 0; h < height; ++h){
+                        ids[h * depth + i] = remap[ids[h * depth + i]];
+                }
+                free(remap);
+                job.used -= dict_bytes(dict);
+                dict_free(dict);
+        }
+        for(uint64_t k = 0; k < tables; ++k) dict_free(&job.dicts[k]);
+        free(job.dicts);
+
+        if(overflowed(&job)){
+                dict_free(&pool);
+                free_table_set(ts);
+                return FAILURE;
+        }
+
+        /* The pool rows become the table set's pool, the index is dropped.
+         * Should shrinking them fail, they are kept as they are. */
+        ts->pool = realloc(pool.rows, pool.count * dims.bytewidth);
+        if(ts->pool == NULL) ts->pool = pool.rows;
+        ts->unique_rows = pool.count;
+        free(pool.hashes);
+        free(pool.slots);
+        return SUCCESS;
+}
@@ -21,160 +21,442 @@ This file is part of Grouper.
 
 #include "grouper.h"
 
+options opts = OPTIONS_INIT;
+run_counters counters = {0};
+
+/* The benchmark harness links the rest of grouper with its own main */
+#ifndef GROUPER_NO_MAIN
+
+/* Times and hardware event counts of the phases of a run */
+typedef struct {
+        profile_t phase;        /* Start of the phase under way */
+        perf_counters pc;
+        long read, build, real_process; /* Microseconds of each phase */
+        clock_t cpu_process;    /* We measure processing time in CPU seconds */
+        long io_wait;           /* Part of processing spent waiting on I/O */
+        uint64_t read_counts[PERF_EVENTS];     /* Hardware counts of each */
+        uint64_t build_counts[PERF_EVENTS];    /* phase, if asked for */
+        uint64_t classify_counts[PERF_EVENTS];
+} run_timing;
+
+/* Starts timing a phase and counting its hardware events */
+static void phase_start(run_timing * rt)
+{
+        start_timing(&rt->phase);
+        perf_start(&rt->pc);
+}
+
+/* Ends a phase, storing its hardware event counts in counts, and returns the
+ * microseconds it took */
+static long phase_end(run_timing * rt, uint64_t counts[PERF_EVENTS])
+{
+        perf_stop(&rt->pc, counts);
+        return end_timing(&rt->phase);
+}
+
+/* Starts the classify phase, opening the input and output streams for the
+ * packets of pol */
+static void classify_start(run_timing * rt, policy pol, input_stream ** in,
+                           output_stream ** out)
+{
+        phase_start(rt);
+        stats_classifying(pol.pl);
+        rt->cpu_process = clock();
+        *in = input_open(fileno(stdin), pol.pl);
+        *out = output_open(fileno(stdout));
+        if(opts.actions) output_actions(*out, pol.actions);
+}
+
+/* Ends the classify phase, closing the streams */
+static void classify_end(run_timing * rt, input_stream * in,
+                         output_stream * out)
+{
+        rt->io_wait = input_close(in) + output_close(out);
+        rt->real_process = phase_end(rt, rt->classify_counts);
+        rt->cpu_process = clock() - rt->cpu_process;
+        Trace("Took (%ld cpu, %ld real) microseconds to finish processing "
+              "packets\n", rt->cpu_process, rt->real_process);
+}
+
+/* Frees the masks of a policy once its tables are built from them */
+static void free_masks(policy * pol)
+{
+        array2d_free(pol->q_masks);
+        array2d_free(pol->b_masks);
+        pol->q_masks = NULL;
+        pol->b_masks = NULL;
+}
+
 int main(int argc, char* argv[])
 {
-        profile_t outer_time, inner_time;
-        long total_time, read_time, build_time, real_process_time;
-        clock_t cpu_process_time;   /* We measure processing time in CPU seconds */
+        profile_t outer_time;
+        long total_time;
+        run_timing rt = {.pc = PERF_COUNTERS_INIT, .read = 0, .build = 0,
+                         .real_process = 0, .cpu_process = 0, .io_wait = 0};
+        uint64_t dedup_rows = 0;    /* Unique rows when tables are deduplicated */
+        double dedup_ratio = 0;     /* Table rows per unique row */
+        input_stream * in;
+        output_stream * out;
         start_timing(&outer_time);
+
+        /* Parse the options preceding the positional arguments */
+        int opt;
+        while((opt = getopt(argc, argv, "g:e:ds:PI:c:CL:U:lb:BT:M:t:A:Ha")) != -1){
+                switch(opt){
+                case 's':
+                        opts.shards = atoll(optarg);
+                        if(opts.shards < 1 || opts.shards > MAX_SHARDS){
+                                Error("Shards must be between 1 and %d.\n",
+                                      MAX_SHARDS);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'P':
+                        opts.shard_processes = true;
+                        break;
+                case 'c':
+                        opts.cache_entries = atoll(optarg);
+                        break;
+                case 'C':
+                        opts.counters = true;
+                        break;
+                case 'L':
+                        opts.latency_every = atoll(optarg);
+                        break;
+                case 'U':
+                        opts.stats_socket = optarg;
+                        break;
+                case 'l':
+                        opts.lazy = true;
+                        break;
+                case 'B':
+                        opts.build_behind = true;
+                        break;
+                case 'T':
+                        opts.tier_dir = optarg;
+                        break;
+                case 'M':
+                        opts.shared_name = optarg;
+                        break;
+                case 't':
+                        opts.timeline = optarg;
+                        break;
+                case 'A':
+                        if(strcmp(optarg, "text") == 0){
+                                opts.report = REPORT_TEXT;
+                        }else if(strcmp(optarg, "json") == 0){
+                                opts.report = REPORT_JSON;
+                        }else{
+                                Error("Unknown report format '%s'.\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'H':
+                        opts.hybrid = true;
+                        break;
+                case 'a':
+                        opts.actions = true;
+                        break;
+                case 'b':
+                        opts.lazy_threads = atoll(optarg);
+                        if(opts.lazy_threads > MAX_LAZY_THREADS){
+                                Error("Error: at most %d background threads.\n",
+                                      MAX_LAZY_THREADS);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                default:
+                        /* Print usage below unless grouper and bench share it */
+                        if(!parse_common_option(opt, optarg)) argc = 0;
+                }
+        }
+        if(opts.lazy && opts.report != REPORT_NONE){
+                Error("Error: lazy tables cannot be reported on.\n");
+                exit(EXIT_FAILURE);
+        }
+        if(opts.lazy && opts.dedup){
+                Error("Error: deduplicated tables cannot be built lazily.\n");
+                exit(EXIT_FAILURE);
+        }
+        if(opts.tier_dir != NULL &&
+           (opts.dedup || opts.lazy || opts.shards > 1 ||
+            opts.engine == ENGINE_BITSLICED)){
+                Error("Error: tables kept on disk cannot be deduplicated, "
+                      "lazy, sharded or bitsliced.\n");
+                exit(EXIT_FAILURE);
+        }
+        if(opts.shared_name != NULL &&
+           (opts.dedup || opts.lazy || opts.shards > 1 ||
+            opts.tier_dir != NULL)){
+                Error("Error: shared tables cannot be deduplicated, lazy, "
+                      "sharded or kept on disk.\n");
+                exit(EXIT_FAILURE);
+        }
+        if(opts.hybrid && opts.shards > 1){
+                Error("Error: hashed rules cannot be sharded.\n");
+                exit(EXIT_FAILURE);
+        }
+        if(opts.engine == ENGINE_TREE &&
+           (opts.dedup || opts.lazy || opts.shards > 1 ||
+            opts.tier_dir != NULL || opts.shared_name != NULL)){
+                Error("Error: the decision tree engine cannot be combined "
+                      "with deduplicated, lazy, sharded, tiered or shared "
+                      "tables.\n");
+                exit(EXIT_FAILURE);
+        }
+        int nargs = argc - optind;
+        char ** args = argv + optind;
         
         /* Check for the proper number of arguments. Print usage if wrong
          * number */
-        if (argc < 3){
+        if (nargs < 2){
                 Error( 
-                        "Usage: %s <max memory> <policy file.pol> [<input file>]"
-                        " [<output file>]\n", argv[0] );
+                        "Usage: %s [-g <group size>] [-e auto|generic|bitsliced|tree|trial]"
+                        " [-d]"
+                        " [-s <shards> [-P]] [-I auto|uring|plain|mmap]"
+                        " [-c <cache entries>] [-C] [-L <sample every>]"
+                        " [-U <stats socket>] [-l [-b <threads>]] [-B]"
+                        " [-T <table directory>] [-M <shared name>]"
+                        " [-t <timeline file>] [-A text|json] [-H] [-a]"
+                        " <max memory> <policy file.pol>[,<policy file.pol>...]"
+                        " [<input file>] [<output file>]\n", argv[0] );
                 exit(EXIT_FAILURE);
         }
         /* Parse the number of memory bits available */
         /* The input is in bytes, so convert it to bits for the algorithm */
-        uint64_t memsize_bits = atoll(argv[1]) * 8; 
+        uint64_t memsize_bits = atoll(args[0]) * 8; 
   
-        /* open the policy file*/
-        FILE *pol_file = fopen(argv[2], "r");
-        /* Exit if file fails to open */
-        if (pol_file == NULL){
-                Error( "Invalid policy file: \'%s\' \n", argv[2]);
+        /* open the policy files, separated by commas when there are
+         * several */
+        FILE * pol_files[MAX_POLICIES];
+        uint64_t npolicies = 0;
+        for(char * name = strtok(args[1], ","); name != NULL;
+            name = strtok(NULL, ",")){
+                if(npolicies == MAX_POLICIES){
+                        Error("Error: at most %d policies.\n", MAX_POLICIES);
+                        exit(EXIT_FAILURE);
+                }
+                pol_files[npolicies] = fopen(name, "r");
+                /* Exit if file fails to open */
+                if (pol_files[npolicies] == NULL){
+                        Error( "Invalid policy file: \'%s\' \n", name);
+                        exit(EXIT_FAILURE);
+                }
+                npolicies++;
+        }
+        if(npolicies == 0){
+                Error("Error: no policy file given.\n");
+                exit(EXIT_FAILURE);
+        }
+        if(npolicies > 1 &&
+           (opts.shards > 1 || opts.build_behind || opts.cache_entries != 0 ||
+            opts.shared_name != NULL || opts.report != REPORT_NONE)){
+                Error("Error: several policies cannot be combined with -s, "
+                      "-B, -c, -M or -A.\n");
+                exit(EXIT_FAILURE);
+        }
+        if(npolicies > 1 && opts.actions){
+                Error("Error: actions cannot be output for several "
+                      "policies.\n");
                 exit(EXIT_FAILURE);
         }
 
         /* Check for input file & ensure it can be opened. */
-        if(argc >= 4){
+        if(nargs >= 3){
                 FILE * in_temp = stdin;
-                stdin = fopen(argv[3], "r");
+                stdin = fopen(args[2], "r");
                 if(stdin == NULL){
                         Error("Input file '%s' is invalid or "
                                 "non-existent. Falling back to stdin.\n", 
-                                argv[3]);
+                                args[2]);
                         stdin = in_temp;
                 }
         }
 
         /* Check for output file & ensure it can be opened. */
-        if(argc >= 5){
+        if(nargs >= 4){
                 FILE * out_temp = stdout;               
-                stdout = fopen(argv[4], "w");
+                stdout = fopen(args[3], "w");
                 if(stdout == NULL){
                         Error("Output file '%s' cannot be opened for "
-                                "writing. Falling back to stdout.\n", argv[4]);
+                                "writing. Falling back to stdout.\n", args[3]);
                         stdout = out_temp;
                 }
         }
         
-        start_timing(&inner_time);
-        policy pol = read_policy(pol_file);
-        fclose(pol_file);
-        read_time = end_timing(&inner_time);
-        Trace("Took %ld microseconds to finish reading the input file.\n", read_time);
+        timeline_init(opts.timeline);
+        latency_init(opts.latency_every);
+        stats_start(opts.stats_socket);
 
-        /* Calculate number of tables required.  */
-        uint64_t t = min_tables(memsize_bits, pol.n , pol.b);
-
-        if (t == TABLE_ERROR){
-                Error("Error: not enough memory to build tables. "
-                      "Needs at least %"PRIu64" bytes.\n",
-                      ceil_div((2*pol.N*pol.b),8));
-                exit(EXIT_FAILURE);
+        /* Without counters, the timing record is all there is */
+        if(opts.counters && !perf_open(&rt.pc)){
+                Trace("No hardware counters are available.\n");
         }
 
-        Trace( "%"PRIu64" tables needed for memory size of %"PRIu64
-                " bits.\n",t, memsize_bits);
+        phase_start(&rt);
+        policy pols[MAX_POLICIES];
+        for(uint64_t k = 0; k < npolicies; ++k){
+                const uint64_t read_started = timeline_start();
+                pols[k] = read_policy(pol_files[k]);
+                timeline_end("read policy", read_started, "rules", pols[k].n);
+                fclose(pol_files[k]);
+                /* Every policy classifies the same packets */
+                if(pols[k].pl != pols[0].pl){
+                        Error("Error: the policies are for packets of "
+                              "different lengths.\n");
+                        exit(EXIT_FAILURE);
+                }
+                /* Rules that never change the action of the first match go
+                 * before anything is built from them */
+                if(opts.actions){
+                        if(pols[k].actions == NULL){
+                                pols[k].actions = actions_new(NULL,
+                                                              pols[k].n);
+                        }
+                        actions_reduce(&pols[k], &counters);
+                }
+                /* Hashed rules come out of the policy and the memory left */
+                if(opts.hybrid) hybrid_split(&pols[k], &counters);
+        }
+        if(opts.hybrid){
+                if(counters.hybrid_bytes * 8 >= memsize_bits){
+                        Error("Error: not enough memory for hashed rules. "
+                              "Needs more than %"PRIu64" bytes.\n",
+                              counters.hybrid_bytes);
+                        exit(EXIT_FAILURE);
+                }
+                memsize_bits -= counters.hybrid_bytes * 8;
+        }
+        policy pol = pols[0];
+        rt.read = phase_end(&rt, rt.read_counts);
+        Trace("Took %ld microseconds to finish reading the input file.\n",
+              rt.read);
+
+        /* Calculate number of tables required. Several policies plan their
+         * own. */
+        uint64_t bitwidth = 0;
+        uint64_t t = 0;
+        if(npolicies == 1){
+                t = plan_tables(pol, memsize_bits, &bitwidth);
+                Trace( "%"PRIu64" tables needed for memory size of %"PRIu64
+                        " bits.\n",t, memsize_bits);
+        }
 
-        /* Handle the special single table case */
-        if (t == 1){
+        if(npolicies > 1){
+                phase_start(&rt);
+                multi_policy * mp = multi_build(pols, npolicies, memsize_bits);
+                rt.build = phase_end(&rt, rt.build_counts);
+                Trace("Took %ld microseconds to finish building tables for "
+                      "%"PRIu64" policies.\n", rt.build, npolicies);
+
+                stats_built(multi_table_bytes(mp), rt.build);
+                classify_start(&rt, pol, &in, &out);
+                read_input_and_classify_multi(mp, in, out);
+                classify_end(&rt, in, out);
+
+                multi_free(mp);
+                /* The policies' hashed rules went with their tables */
+                pol.hybrid = NULL;
+        }else if (t == 1){
+                /* Handle the special single table case */
                 /* Find the width of the binary representation of the number of
                  * rules in bytes  */
-                uint64_t width = ceil_div(ceil(log2(pol.n)), 8);
+                uint64_t width = ceil_div(ceil(log2(pol.n + 1)), 8);
                 uint8_t (*single_table)[width];
-                start_timing(&inner_time);
+                phase_start(&rt);
+                const uint64_t started = timeline_start();
                 single_table = (uint8_t (*)[width]) create_single_table(pol, width);
-                array2d_free(pol.q_masks);
-                array2d_free(pol.b_masks);
-                build_time = end_timing(&inner_time);
+                timeline_end("build single table", started, NULL, 0);
+                free_masks(&pol);
+                rt.build = phase_end(&rt, rt.build_counts);
                 Trace("Took %ld microseconds to finish building single table\n",
-                      build_time);
+                      rt.build);
 
-                start_timing(&inner_time);
-                cpu_process_time = clock();
+                stats_built((UINT64_C(1) << pol.b) * width, rt.build);
                 /* Process packets with single table here */
-                read_input_and_classify_single(pol, width, single_table);
-                
-                real_process_time = end_timing(&inner_time);
-                cpu_process_time = clock() - cpu_process_time;
-                Trace("Took %ld microseconds to finish processing with single table\n",
-                        real_process_time);
-                
-        }else{
-                /* Calculate heights and depths */
-                table_dims d = {
-                        .even_s  = pol.b/t,
-                        .odd_s   = pol.b/t + 1,
-                        .even_h  = (uint64_t) exp2(pol.b/t),
-                        .odd_h   = (uint64_t) exp2(pol.b/t + 1),
-                        .even_d  = t - pol.b % t,
-                        .odd_d   = pol.b % t,
-                        .bitwidth   = pol.N,
-                        .bytewidth  = pol.N / 8
-                };
-
-                Trace("\nCreating %"PRIu64" tables %"PRIu64" of "
-			"which will be %"PRIu64" x %"PRIu64",\nand %"PRIu64" of "
-			"which will be %"PRIu64" x %"PRIu64".\n\n",t, d.even_d, 
-			d.bitwidth, d.even_h, d.odd_d, d.bitwidth, d.odd_h);
-
-                /* Create two large table arrays */
-                uint8_t (*even_tables)[d.even_d][d.bytewidth] =
-                        calloc(d.even_h * d.even_d, 
-                               sizeof(uint8_t[d.bytewidth]));
-                if(even_tables == NULL){
-                        Error("Could not allocate memory for even tables!"
-                              " errno = %d\n", errno);
-                        exit(EXIT_FAILURE);
+                classify_start(&rt, pol, &in, &out);
+                read_input_and_classify_single(pol, width, single_table,
+                                               in, out);
+                classify_end(&rt, in, out);
+        }else if(opts.shards > 1){
+                phase_start(&rt);
+                shard * shards = NULL;
+                shard_pipeline * pipe;
+                if(opts.shard_processes){
+                        pipe = start_shard_processes(pol, opts.shards,
+                                                     memsize_bits);
+                }else{
+                        shards = build_shards(pol, opts.shards, memsize_bits);
+                        pipe = start_shard_threads(pol, shards, opts.shards);
                 }
-                uint8_t (*odd_tables) [d.odd_d] [d.bytewidth] = 
-                        calloc(d.odd_h  * d.odd_d, 
-                               sizeof(uint8_t[d.bytewidth]));
-                if(odd_tables == NULL){
-                        Error("Could not allocate memory for odd tables!"
-                              " errno = %d\n", errno);
-                        exit(EXIT_FAILURE);
+                free_masks(&pol);
+                rt.build = phase_end(&rt, rt.build_counts);
+                Trace("Took %ld microseconds to finish building %"PRIu64
+                      " shards.\n", rt.build, opts.shards);
+
+                stats_built(shard_table_bytes(pipe), rt.build);
+                classify_start(&rt, pol, &in, &out);
+                read_input_and_classify_sharded(pipe, in, out);
+                classify_end(&rt, in, out);
+
+                if(shards != NULL) free_shards(shards, opts.shards);
+        }else if(opts.build_behind){
+                /* Building is part of processing, it has no phase of its own */
+                table_set ts = TABLE_SET_INIT;
+                for(uint64_t e = 0; e < PERF_EVENTS; ++e){
+                        rt.build_counts[e] = PERF_UNAVAILABLE;
+                }
+                classify_start(&rt, pol, &in, &out);
+                t = read_input_and_classify_building(pol, t, bitwidth,
+                                                     memsize_bits, &ts,
+                                                     &rt.build, in, out);
+                classify_end(&rt, in, out);
+                Trace("Took %ld microseconds to build %"PRIu64" tables while "
+                      "classifying\n", rt.build, t);
+                if(ts.pool != NULL){
+                        dedup_rows = ts.unique_rows;
+                        dedup_ratio = (double)table_rows(ts.dims) / ts.unique_rows;
+                }
+                if(opts.report != REPORT_NONE){
+                        report_tables(pol, &ts, opts.report == REPORT_JSON,
+                                      stderr);
                 }
-                
-                start_timing(&inner_time);
-                fill_tables(pol, d, even_tables, odd_tables);
+
+                free_masks(&pol);
+                free_table_set(&ts);
+        }else{
+                table_set ts = TABLE_SET_INIT;
+                phase_start(&rt);
+
+                t = build_tables(pol, t, bitwidth, memsize_bits, &ts);
 
                 /* Free intermittant resources */
-                array2d_free(pol.q_masks);
-                array2d_free(pol.b_masks);
-                pol.q_masks = NULL;
-                pol.b_masks = NULL;
+                free_masks(&pol);
                 
-                build_time = end_timing(&inner_time);
-                Trace("Took %ld microseconds to finish building tables.\n",build_time);
+                rt.build = phase_end(&rt, rt.build_counts);
+                Trace("Took %ld microseconds to finish building tables.\n",
+                      rt.build);
+                if(ts.pool != NULL){
+                        dedup_rows = ts.unique_rows;
+                        dedup_ratio = (double)table_rows(ts.dims) / ts.unique_rows;
+                        Trace("%"PRIu64" tables hold %"PRIu64" unique rows out "
+                              "of %"PRIu64"\n", t, ts.unique_rows,
+                              table_rows(ts.dims));
+                }
+                /* The report is not part of any phase */
+                if(opts.report != REPORT_NONE){
+                        report_tables(pol, &ts, opts.report == REPORT_JSON,
+                                      stderr);
+                }
 
                 /* Read input and classify input until EOF */
-                start_timing(&inner_time);
-                cpu_process_time = clock();
-                read_input_and_classify(pol,d,even_tables,odd_tables);
-                real_process_time = end_timing(&inner_time);
-                cpu_process_time = clock() - cpu_process_time;
-                Trace("Took (%ld cpu, %ld real) microseconds to finish processing "
-                      "packets\n", cpu_process_time, real_process_time);
+                stats_built(table_set_bytes(&ts), rt.build);
+                classify_start(&rt, pol, &in, &out);
+                read_input_and_classify(pol, &ts, in, out);
+                classify_end(&rt, in, out);
                 
                 /* Release resources: */
-                free(even_tables);
-                free(odd_tables);
-                
+                free_table_set(&ts);
         }
         
         total_time = end_timing(&outer_time);
@@ -182,11 +464,243 @@ int main(int argc, char* argv[])
         /* We print the next line unconditionally for external tools to do
          * record keeping */
         fprintf(stderr, "{ 'read' : %ld, 'build' : %ld, 'cpu_process' : %ld,"
-                " 'real_process' : %ld, 'total' : %ld }\n", read_time, build_time, 
-                cpu_process_time, real_process_time, total_time);
+                " 'real_process' : %ld, 'total' : %ld", rt.read, rt.build,
+                rt.cpu_process, rt.real_process, total_time);
+        /* Real processing time is split into waiting on input and output and
+         * the rest, spent classifying */
+        fprintf(stderr, ", 'io_wait' : %ld, 'compute' : %ld", rt.io_wait,
+                rt.real_process - rt.io_wait);
+        if(dedup_rows != 0){
+                fprintf(stderr, ", 'unique_rows' : %"PRIu64", 'dedup_ratio' : %.2f",
+                        dedup_rows, dedup_ratio);
+        }
+        if(opts.cache_entries != 0){
+                fprintf(stderr, ", 'cache_hits' : %"PRIu64", 'cache_misses' : "
+                        "%"PRIu64, counters.cache_hits, counters.cache_misses);
+        }
+        if(opts.build_behind){
+                fprintf(stderr, ", 'linear_packets' : %"PRIu64", 'table_packets'"
+                        " : %"PRIu64, counters.linear_packets,
+                        counters.table_packets);
+        }
+        if(counters.tier_file_bytes != 0){
+                const uint64_t lookups = counters.tier_hits +
+                        counters.tier_misses;
+                fprintf(stderr, ", 'tier_file_bytes' : %"PRIu64", 'tier_hits'"
+                        " : %"PRIu64", 'tier_misses' : %"PRIu64", "
+                        "'tier_hit_rate' : %.4f, 'tier_planned_hit_rate' : "
+                        "%.4f, 'tier_faults' : %"PRIu64,
+                        counters.tier_file_bytes, counters.tier_hits,
+                        counters.tier_misses, lookups != 0 ?
+                        (double) counters.tier_hits / lookups : 0.0,
+                        counters.tier_planned, counters.tier_faults);
+        }
+        if(counters.shared_built + counters.shared_attached != 0){
+                fprintf(stderr, ", 'shared_built' : %"PRIu64", "
+                        "'shared_attached' : %"PRIu64, counters.shared_built,
+                        counters.shared_attached);
+        }
+        if(counters.tree_nodes != 0){
+                fprintf(stderr, ", 'tree_nodes' : %"PRIu64", 'tree_leaf_rules'"
+                        " : %"PRIu64, counters.tree_nodes,
+                        counters.tree_leaf_rules);
+        }
+        if(counters.tree_trial_ns != 0){
+                fprintf(stderr, ", 'tree_trial_ns' : %.2f, 'table_trial_ns' : "
+                        "%.2f", counters.tree_trial_ns,
+                        counters.table_trial_ns);
+        }
+        if(opts.hybrid){
+                fprintf(stderr, ", 'hybrid_rules' : %"PRIu64", 'hybrid_masks'"
+                        " : %"PRIu64", 'hybrid_bytes' : %"PRIu64", "
+                        "'table_rules' : %"PRIu64, counters.hybrid_rules,
+                        counters.hybrid_masks, counters.hybrid_bytes,
+                        counters.hybrid_table_rules);
+        }
+        if(pol.hybrid != NULL) hybrid_free(pol.hybrid);
+        if(opts.actions){
+                fprintf(stderr, ", 'action_rules_read' : %"PRIu64", "
+                        "'action_rules_kept' : %"PRIu64", 'actions' : %"PRIu64
+                        ", 'action_row_bytes_read' : %"PRIu64", "
+                        "'action_row_bytes_kept' : %"PRIu64,
+                        counters.action_rules_read, counters.action_rules_kept,
+                        counters.action_count,
+                        ceil_div(counters.action_rules_read, 8),
+                        ceil_div(counters.action_rules_kept, 8));
+        }
+        for(uint64_t k = 0; k < npolicies; ++k){
+                if(pols[k].actions != NULL) actions_free(pols[k].actions);
+        }
+        if(npolicies > 1){
+                fprintf(stderr, ", 'policies' : %"PRIu64", 'section_layouts' : "
+                        "%"PRIu64, npolicies, counters.section_layouts);
+        }
+        if(counters.lazy_rows != 0){
+                fprintf(stderr, ", 'lazy_built' : %"PRIu64", 'lazy_rows' : "
+                        "%"PRIu64, counters.lazy_built, counters.lazy_rows);
+        }
+        if(opts.counters){
+                perf_print(stderr, "read", rt.read_counts);
+                perf_print(stderr, "build", rt.build_counts);
+                perf_print(stderr, "classify", rt.classify_counts);
+                perf_close(&rt.pc);
+        }
+        latency_print(stderr);
+        fprintf(stderr, " }\n");
+        stats_stop();
+        timeline_write();
 
         return EXIT_SUCCESS;
 }
+#endif /* GROUPER_NO_MAIN */
+
+/* Parses one of the options grouper and bench both take into opts: -e, -d, -g
+ * and -I. Returns false if opt is none of them, and exits if its argument is
+ * bad. */
+bool parse_common_option(int opt, const char * arg)
+{
+        switch(opt){
+        case 'e':
+                if(strcmp(arg, "auto") == 0){
+                        opts.engine = ENGINE_AUTO;
+                }else if(strcmp(arg, "generic") == 0){
+                        opts.engine = ENGINE_GENERIC;
+                }else if(strcmp(arg, "bitsliced") == 0){
+                        opts.engine = ENGINE_BITSLICED;
+                }else if(strcmp(arg, "tree") == 0){
+                        opts.engine = ENGINE_TREE;
+                }else if(strcmp(arg, "trial") == 0){
+                        opts.engine = ENGINE_AUTO;
+                        opts.tree_trial = true;
+                }else{
+                        Error("Unknown engine '%s'.\n", arg);
+                        exit(EXIT_FAILURE);
+                }
+                return true;
+        case 'd':
+                opts.dedup = true;
+                return true;
+        case 'g':
+                opts.group_size = atoll(arg);
+                if(opts.group_size < 1 || opts.group_size > MAX_GROUP_SIZE){
+                        Error("Group size must be between 1 and %d.\n",
+                              MAX_GROUP_SIZE);
+                        exit(EXIT_FAILURE);
+                }
+                return true;
+        case 'I':
+                if(strcmp(arg, "auto") == 0){
+                        opts.io = IO_AUTO;
+                }else if(strcmp(arg, "uring") == 0){
+                        opts.io = IO_URING;
+                }else if(strcmp(arg, "plain") == 0){
+                        opts.io = IO_PLAIN;
+                }else if(strcmp(arg, "mmap") == 0){
+                        opts.io = IO_MMAP;
+                }else{
+                        Error("Unknown I/O mode '%s'.\n", arg);
+                        exit(EXIT_FAILURE);
+                }
+                return true;
+        default:
+                return false;
+        }
+}
+
+/* Works out how many tables to build for a policy in m bits of memory and how
+ * many bits wide their rows are, settling which engine classifies with
+ * them. Exits if they cannot fit. */
+uint64_t plan_tables(policy pol, uint64_t m, uint64_t * bitwidth)
+{
+        plan_status status;
+        uint64_t t = try_plan_tables(pol, m, bitwidth, &status);
+        switch(status){
+        case PLAN_OK:
+                break;
+        case PLAN_NO_MEMORY:
+                Error("Error: not enough memory to build tables. "
+                      "Needs at least %"PRIu64" bytes.\n",
+                      ceil_div((2*pol.N*pol.b),8));
+                exit(EXIT_FAILURE);
+        case PLAN_NO_SLICED_MEMORY:
+                Error("Error: not enough memory to build bitsliced tables. "
+                      "Needs at least %"PRIu64" bytes.\n",
+                      ceil_div(2*bitslice_width(pol.n)*pol.b, 8));
+                exit(EXIT_FAILURE);
+        default:
+                Error("Error: the bitsliced engine needs a policy of at most "
+                      "%d rules and more than one table, and cannot be "
+                      "sharded.\n", BITSLICE_MAX_RULES);
+                exit(EXIT_FAILURE);
+        }
+        return t;
+}
+
+/* As plan_tables, but returns TABLE_ERROR and sets status to why instead of
+ * exiting when the tables cannot fit */
+uint64_t try_plan_tables(policy pol, uint64_t m, uint64_t * bitwidth,
+                         plan_status * status)
+{
+        uint64_t t = min_tables(m, pol.n , pol.b);
+        *status = PLAN_OK;
+
+        /* A decision tree takes the place of tables, but is built by
+         * build_tables all the same, so it goes down the multiple table path.
+         * It is tried against the tables when they are many and a trial is
+         * asked for. Its packed rules alone take as much memory as the
+         * smallest tables, so it is no way out when those do not fit. */
+        if(opts.engine == ENGINE_TREE){
+                Trace("Classifying with a decision tree\n");
+                *bitwidth = pol.N;
+                return t == TABLE_ERROR ? 2 : max(t, 2);
+        }
+        opts.try_tree = opts.tree_trial && opts.engine == ENGINE_AUTO &&
+                t > 2 && !opts.dedup && !opts.lazy && opts.shards == 1 &&
+                opts.tier_dir == NULL && opts.shared_name == NULL;
+
+        /* Tables kept on disk need m for their row cache alone, unless one
+         * table fits in memory anyway */
+        if(opts.tier_dir != NULL && t != 1){
+                t = plan_tiered(pol, m, opts.tier_dir, &counters.tier_planned);
+                Trace("Keeping %"PRIu64" tables in '%s', expected hit rate "
+                      "%.4f\n", t, opts.tier_dir, counters.tier_planned);
+                *bitwidth = pol.N;
+                opts.engine = ENGINE_GENERIC;
+                return t;
+        }
+
+        if (t == TABLE_ERROR){
+                *status = PLAN_NO_MEMORY;
+                return TABLE_ERROR;
+        }
+
+        /* Rows of small policies are padded to whole words for the bitsliced
+         * engine. It is picked automatically as long as the padding does not
+         * cost any extra tables. */
+        *bitwidth = pol.N;
+        bool sliced = false;
+        if(t > 1 && opts.engine != ENGINE_GENERIC && opts.shards == 1 &&
+           pol.n <= BITSLICE_MAX_RULES){
+                uint64_t width = bitslice_width(pol.n);
+                uint64_t sliced_t = min_tables(m, width, pol.b);
+                if(opts.engine == ENGINE_BITSLICED || sliced_t == t){
+                        if(sliced_t == TABLE_ERROR){
+                                *status = PLAN_NO_SLICED_MEMORY;
+                                return TABLE_ERROR;
+                        }
+                        t = sliced_t;
+                        *bitwidth = width;
+                        sliced = true;
+                }
+        }
+        if(opts.engine == ENGINE_BITSLICED && !sliced){
+                *status = PLAN_NOT_SLICEABLE;
+                return TABLE_ERROR;
+        }
+        opts.engine = sliced ? ENGINE_BITSLICED : ENGINE_GENERIC;
+        opts.try_tree = opts.try_tree && !sliced;
+        return t;
+}
 
 /* Determine the minimum number of tables that will fit in a
    prescribed amount of memory 
@@ -239,6 +753,172 @@ uint64_t min_tables(uint64_t m , uint64_t n , uint64_t b)
         return high;
 }
 
+/* Calculates the dimensions of t tables for a policy, with rows bitwidth bits
+ * wide */
+table_dims make_dims(policy pol, uint64_t t, uint64_t bitwidth)
+{
+        table_dims d = {
+                .even_s  = pol.b/t,
+                .odd_s   = pol.b/t + 1,
+                .even_h  = (uint64_t) exp2(pol.b/t),
+                .odd_h   = (uint64_t) exp2(pol.b/t + 1),
+                .even_d  = t - pol.b % t,
+                .odd_d   = pol.b % t,
+                .bitwidth   = bitwidth,
+                .bytewidth  = bitwidth / 8
+        };
+        return d;
+}
+
+/* Returns the total number of rows in all tables */
+uint64_t table_rows(table_dims dims)
+{
+        return dims.even_h * dims.even_d + dims.odd_h * dims.odd_d;
+}
+
+/* Returns the bytes of memory taken by a table set */
+uint64_t table_set_bytes(const table_set * ts)
+{
+        if(ts->tree != NULL) return tree_bytes(ts->tree);
+        if(ts->tier != NULL) return tier_cache_bytes(ts->tier);
+        if(ts->pool != NULL){
+                return table_rows(ts->dims) * sizeof(uint32_t) +
+                        ts->unique_rows * ts->dims.bytewidth;
+        }
+        return table_rows(ts->dims) * ts->dims.bytewidth;
+}
+
+/* Builds a decision tree for a policy alongside the tables of ts, and if it
+ * classifies faster, frees the tables and keeps the tree in their place. Both
+ * are held at once while they are timed, so the tree only gets the part of m
+ * bits of memory the tables leave. */
+static void try_tree(policy pol, uint64_t m, table_set * ts)
+{
+        const uint64_t used = table_set_bytes(ts) * 8;
+        if(used >= m) return;
+        const uint64_t started = timeline_start();
+        decision_tree * dt = tree_build(pol, m - used);
+        timeline_end("build tree", started, NULL, 0);
+        if(dt == NULL) return;
+        const bool faster = tree_faster(pol, ts, dt, &counters.tree_trial_ns,
+                                        &counters.table_trial_ns);
+        Trace("Decision tree took %.2f ns per packet, tables %.2f\n",
+              counters.tree_trial_ns, counters.table_trial_ns);
+        if(!faster){
+                tree_free(dt, NULL);
+                return;
+        }
+        free(ts->even_tables);
+        free(ts->odd_tables);
+        ts->even_tables = ts->odd_tables = NULL;
+        ts->tree = dt;
+        opts.engine = ENGINE_TREE;
+}
+
+/* Builds the tables for a policy into ts, in at most m bits of memory. t is the
+ * number of full tables that fit, as found by min_tables. Returns the number of
+ * tables actually built, which can be fewer when the rows are deduplicated. */
+uint64_t build_tables(policy pol, uint64_t t, uint64_t bitwidth, uint64_t m,
+                      table_set * ts)
+{
+        plan_status status;
+        t = try_build_tables(pol, t, bitwidth, m, ts, &status);
+        if(status == PLAN_NO_TREE_MEMORY){
+                Error("Error: not enough memory to build a decision "
+                      "tree. Needs more than %"PRIu64" bytes.\n", m / 8);
+                exit(EXIT_FAILURE);
+        }
+        return t;
+}
+
+/* As build_tables, but returns TABLE_ERROR and sets status to why instead of
+ * exiting when a decision tree does not fit */
+uint64_t try_build_tables(policy pol, uint64_t t, uint64_t bitwidth,
+                          uint64_t m, table_set * ts, plan_status * status)
+{
+        *ts = (table_set) TABLE_SET_INIT;
+        *status = PLAN_OK;
+
+        if(opts.engine == ENGINE_TREE){
+                const uint64_t started = timeline_start();
+                ts->tree = tree_build(pol, m);
+                timeline_end("build tree", started, NULL, 0);
+                if(ts->tree == NULL){
+                        *status = PLAN_NO_TREE_MEMORY;
+                        return TABLE_ERROR;
+                }
+                ts->generation = new_generation();
+                return t;
+        }
+
+        /* Deduplicated tables may fit the budget with fewer tables than full
+         * ones, so try those first, starting from the fewest tables whose row
+         * ids alone would fit. */
+        if(opts.dedup && bitwidth > 8 * sizeof(uint32_t)){
+                for(uint64_t dt = min_tables_dedup(m, pol.b); dt <= t; ++dt){
+                        table_dims d = make_dims(pol, dt, bitwidth);
+                        if(build_dedup_tables(pol, d, m, ts) == SUCCESS){
+                                ts->generation = new_generation();
+                                return dt;
+                        }
+                        Trace("Deduplicated %"PRIu64" tables do not fit.\n", dt);
+                }
+        }
+
+        table_dims d = make_dims(pol, t, bitwidth);
+        if(opts.tier_dir != NULL){
+                ts->dims = d;
+                ts->tier = tier_build(pol, d, m, opts.tier_dir);
+                ts->generation = new_generation();
+                return t;
+        }
+        if(opts.shared_name != NULL){
+                if(shared_tables(pol, d, opts.shared_name, ts)){
+                        counters.shared_built++;
+                }else{
+                        counters.shared_attached++;
+                }
+                ts->generation = new_generation();
+                return t;
+        }
+
+        Trace("\nCreating %"PRIu64" tables %"PRIu64" of "
+              "which will be %"PRIu64" x %"PRIu64",\nand %"PRIu64" of "
+              "which will be %"PRIu64" x %"PRIu64".\n\n",t, d.even_d, 
+              d.bitwidth, d.even_h, d.odd_d, d.bitwidth, d.odd_h);
+
+        /* Create two large table arrays */
+        uint8_t (*even_tables)[d.even_d][d.bytewidth] =
+                calloc(d.even_h * d.even_d, sizeof(uint8_t[d.bytewidth]));
+        if(even_tables == NULL){
+                Error("Could not allocate memory for even tables!"
+                      " errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        uint8_t (*odd_tables) [d.odd_d] [d.bytewidth] = 
+                calloc(d.odd_h  * d.odd_d, sizeof(uint8_t[d.bytewidth]));
+        if(odd_tables == NULL){
+                Error("Could not allocate memory for odd tables!"
+                      " errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+
+        ts->dims = d;
+        ts->even_tables = (uint8_t *) even_tables;
+        ts->odd_tables = (uint8_t *) odd_tables;
+        ts->generation = new_generation();
+        if(opts.lazy){
+                /* Rows are left zeroed until a packet needs them */
+                ts->lazy = lazy_new(pol, ts, opts.lazy_threads);
+                return t;
+        }
+        const uint64_t started = timeline_start();
+        fill_tables(pol, d, even_tables, odd_tables);
+        timeline_end("fill tables", started, "tables", t);
+        if(opts.try_tree) try_tree(pol, m, ts);
+        return t;
+}
+
 /* reads in a policy from a file and creates the relevant patterns in memory */
 policy read_policy(FILE * file)
 {
@@ -258,20 +938,25 @@ policy read_policy(FILE * file)
 
 
         /* Scan the rest of the file, finding the number of lines and the max
-         * line length (which will be the max relevant bits */
+         * line length (which will be the max relevant bits). A rule may be
+         * followed by whitespace and the label of its action. */
+        bool in_label = false;
         while(fscanf(file, "%c", &tmp) != EOF){
-                /* Ensure 1,0,?,\n are the only characters in the file  */
-                if(tmp != '0' && tmp != '1' && tmp != '?' && tmp != '\n'){
-                        Trace( "Invalid character \'%c\' in policy "
-                                "file. Aborting... \n", tmp);
-                        exit(EXIT_FAILURE);
-                }
-
                 if(tmp == '\n'){
                         pol.n++;
                         if(curr_bits > pol.b) 
                                 pol.b = curr_bits;
                         curr_bits = 0;
+                        in_label = false;
+                }else if(in_label){
+                        continue;
+                }else if(tmp == ' ' || tmp == '\t'){
+                        in_label = true;
+                }else if(tmp != '0' && tmp != '1' && tmp != '?'){
+                        /* Ensure 1,0,? are the only characters in a rule */
+                        Trace( "Invalid character \'%c\' in policy "
+                                "file. Aborting... \n", tmp);
+                        exit(EXIT_FAILURE);
                 }else {
                         curr_bits ++ ;
                 }
@@ -287,12 +972,36 @@ policy read_policy(FILE * file)
            
         rewind(file);
         getline(&tmpstring, &n, file); /*consume the first line again.*/
-        free(tmpstring);
 
-        /* Read in the rest of the file */
+        /* Read in the rest of the file, keeping the label of each rule that
+         * has one */
+        char ** labels = calloc(pol.n, sizeof(char *));
+        bool labelled = false;
+        if(labels == NULL){
+                Error("Could not allocate memory for policy!\n");
+                exit(EXIT_FAILURE);
+        }
         for (uint64_t i = 0; i < pol.n; i++){
-                fgets(rule_array[i], pol.b + 2, file);
+                getline(&tmpstring, &n, file);
+                size_t bits = strcspn(tmpstring, " \t\n");
+                memcpy(rule_array[i], tmpstring, bits);
+                rule_array[i][bits] = '\n';
+                char * label = tmpstring + bits;
+                label += strspn(label, " \t");
+                size_t length = strcspn(label, "\n");
+                while(length > 0 && (label[length - 1] == ' ' ||
+                                     label[length - 1] == '\t')){
+                        length--;
+                }
+                if(length > 0){
+                        labels[i] = strndup(label, length);
+                        labelled = true;
+                }
         }
+        free(tmpstring);
+        if(labelled) pol.actions = actions_new(labels, pol.n);
+        for (uint64_t i = 0; i < pol.n; i++) free(labels[i]);
+        free(labels);
         
         /* We convert bits to bytes rounding up to the next byte */
         pol.B = 8 * ceil_div(pol.b, 8);
@@ -367,6 +1076,14 @@ void array2d_free(uint8_t ** arr)
         free(arr);
 }
 
+/* Joins a thread filling table k, timing the wait for the timeline */
+static void join_fill_thread(pthread_t thread, uint64_t k)
+{
+        const uint64_t started = timeline_start();
+        pthread_join(thread, NULL);
+        timeline_end("join fill thread", started, "table", k);
+}
+
 /* Fills a filtering table given a policy  */
 void fill_tables(policy pol,
                  table_dims dims,
@@ -398,7 +1115,8 @@ void fill_tables(policy pol,
                         /* We've hit the maximum number of active threads so we
                          * need to join some before continuing */
                         for(;min_even_thread<i; min_even_thread++, active_threads--){
-                                pthread_join(even_threads[min_even_thread], NULL);
+                                join_fill_thread(even_threads[min_even_thread],
+                                                 min_even_thread);
                         }
                 }
                 /* We do some assigning to auto variables here because all
@@ -418,11 +1136,13 @@ void fill_tables(policy pol,
                         /* First join any even threads */
                         for(; min_even_thread < dims.even_d;
                             min_even_thread++, active_threads--){
-                                pthread_join(even_threads[min_even_thread], NULL);
+                                join_fill_thread(even_threads[min_even_thread],
+                                                 min_even_thread);
                         }
                         /* Then join any odd threads */
                         for(;min_odd_thread<i;min_odd_thread++, active_threads--){
-                                pthread_join(odd_threads[min_odd_thread], NULL);
+                                join_fill_thread(odd_threads[min_odd_thread],
+                                                 dims.even_d + min_odd_thread);
                         }
                 }
                 /* We do some assigning to auto variables here because all
@@ -438,11 +1158,11 @@ void fill_tables(policy pol,
         }
         /* join all remaining even threads */
         for(uint64_t i = min_even_thread; i < dims.even_d; i++, active_threads--){
-                pthread_join(even_threads[i], NULL);
+                join_fill_thread(even_threads[i], i);
         }
         /* join all remaining odd threads */
         for(uint64_t i = min_odd_thread; i < dims.odd_d; i++, active_threads--){
-                pthread_join(odd_threads[i], NULL);
+                join_fill_thread(odd_threads[i], dims.even_d + i);
         }
         
 }
@@ -463,6 +1183,7 @@ void * fill_even_table(void * args)
         uint64_t e_array_Bwidth = ceil_div(dims->even_s, 8);
 
         Trace("Generating even table %"PRIu64"\n",d);
+        const uint64_t started = timeline_start();
         /* This next loop iterates to pol.n instead of dims.bitwidth
          * because there are only n rules in pol.q_masks and
          * pol.b_masks*/
@@ -495,6 +1216,7 @@ void * fill_even_table(void * args)
                         }
                 }
         }
+        timeline_end("fill even table", started, "table", d);
         return NULL;
 }
 
@@ -511,6 +1233,7 @@ void * fill_odd_table(void * args)
                 ((thread_args*)args)->tables;
 
         Trace("Generating odd table %"PRIu64"\n", d);
+        const uint64_t started = timeline_start();
         /* Precalculate odd array size */
         uint64_t o_array_Bwidth = ceil_div(dims->odd_s, 8);
         /* Offset to get to the beginning of the odd sections of the b and q
@@ -547,6 +1270,7 @@ void * fill_odd_table(void * args)
                         }
                 }
         }
+        timeline_end("fill odd table", started, "table", dims->even_d + d);
         return NULL;
 }
 
@@ -578,6 +1302,61 @@ void copy_section(const uint8_t * src_array, uint8_t * dst_array,
         }
 } 
         
+/* Extracts one section of every rule's masks, so that the rows of a table can
+ * be built one at a time with build_row */
+section_masks get_section_masks(policy pol, uint64_t startbit, uint64_t size)
+{
+        section_masks sm = {
+                .n = pol.n,
+                .q = malloc(pol.n * sizeof(uint64_t)),
+                .b = malloc(pol.n * sizeof(uint64_t))
+        };
+        if(sm.q == NULL || sm.b == NULL){
+                Error("Could not allocate memory for section masks!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t w = 0; w < pol.n; ++w){
+                sm.q[w] = extract_section(pol.q_masks[w], startbit, size);
+                sm.b[w] = extract_section(pol.b_masks[w], startbit, size);
+        }
+        return sm;
+}
+
+/* Frees the masks returned by get_section_masks */
+void free_section_masks(section_masks * sm)
+{
+        free(sm->q);
+        free(sm->b);
+        sm->q = sm->b = NULL;
+}
+
+/* Builds the table row for one value of a section. The row must be zeroed. */
+void build_row(const section_masks * sm, uint64_t index, uint8_t * row)
+{
+        for(uint64_t w = 0; w < sm->n; ++w){
+                if((index & sm->q[w]) == sm->b[w]){
+                        BitTrue(row, w);
+                }
+        }
+}
+
+/* Frees the tables of a table set */
+void free_table_set(table_set * ts)
+{
+        if(ts->lazy != NULL){
+                lazy_free(ts->lazy, &counters.lazy_built, &counters.lazy_rows);
+        }
+        if(ts->tier != NULL) tier_free(ts->tier, &counters);
+        if(ts->shared != NULL) shared_detach(ts);
+        if(ts->tree != NULL) tree_free(ts->tree, &counters);
+        free(ts->even_tables);
+        free(ts->odd_tables);
+        free(ts->even_ids);
+        free(ts->odd_ids);
+        free(ts->pool);
+        *ts = (table_set) TABLE_SET_INIT;
+}
+
 /* Creates a single table for rule matching */
 uint8_t * create_single_table(policy pol, uint64_t width)
 {
@@ -589,8 +1368,9 @@ uint8_t * create_single_table(policy pol, uint64_t width)
                  * j starts at 1, since rule 0 means "no match" */
                 for(union64 j = {.num = 1}; j.num <= pol.n; j.num++){
                         /* Mask and compare with the current i */
-                        if((i.num & (uint64_t)pol.q_masks[j.num - 1]) 
-                           != (uint64_t)pol.b_masks[j.num - 1]){
+                        if((i.num & extract_section(pol.q_masks[j.num - 1], 0,
+                                                    pol.b))
+                           == extract_section(pol.b_masks[j.num - 1], 0, pol.b)){
                                 Trace("Input %"PRIu64" (",i.num);
                                 for(uint64_t k = pol.B/8; k != 0; k--){
                                         printbits(i.arr[k-1]);
@@ -617,134 +1397,239 @@ uint8_t * create_single_table(policy pol, uint64_t width)
 /* Classify packets with a single table */
 void read_input_and_classify_single(policy pol, 
                                     uint64_t width, 
-                                    uint8_t (*table)[width])
+                                    uint8_t (*table)[width],
+                                    input_stream * in,
+                                    output_stream * out)
 {
         uint64_t packets_read = 0;
-        union64 inpacket = {.num = 0}; /* Current input temp */
         union64 rule_matched = {.num = 0}; /* It is important this is zeroed as
                                             * we will be copying into its least
                                             * significant bytes only, relying on
                                             * the most significant bytes to
                                             * remain zero.*/
-        while(fread(inpacket.arr, sizeof(uint8_t), pol.pl, stdin) == pol.pl){
-                memcpy(rule_matched.arr, table[inpacket.num], width);
-                Print("%"PRIu64"\n", rule_matched.num);
-                packets_read++;
+        uint64_t matches[MAX_GROUP_SIZE];
+        const uint8_t * packets;
+        uint64_t count;
+        while((count = input_next(in, &packets, MAX_GROUP_SIZE)) > 0){
+                const uint64_t started = latency_sampled() ? now_ns() : 0;
+                const uint64_t group_started = timeline_start();
+                for(uint64_t p = 0; p < count; ++p){
+                        /* Only the first b bits of a packet index the table */
+                        uint64_t index = extract_section(packets + p * pol.pl,
+                                                         0, pol.b);
+                        memcpy(rule_matched.arr, table[index], width);
+                        matches[p] = rule_matched.num;
+                }
+                if(pol.hybrid != NULL){
+                        hybrid_resolve(pol, packets, count, matches);
+                }
+                timeline_end("classify group", group_started, "packets",
+                             count);
+                if(started != 0) latency_record(now_ns() - started, count);
+                latency_poll();
+                output_matches(out, matches, count);
+                packets_read += count;
         }
         Trace("Packets read in: %"PRIu64"\n", packets_read);
 }
 
-/* Filters incoming packets and classifies them to stdout */
-void read_input_and_classify(policy pol, table_dims dim, 
-                     uint8_t even_tables[dim.even_h][dim.even_d][dim.bytewidth], 
-                     uint8_t odd_tables[dim.odd_h][dim.odd_d][dim.bytewidth])
+/* Filters incoming packets and classifies them to the output */
+void read_input_and_classify(policy pol, const table_set * ts,
+                             input_stream * in, output_stream * out)
 {
         
         uint64_t packets_read = 0; 
-        /* Place to store the current input */
-        uint8_t inpacket[pol.pl];
-
-        /* Read in bytewidth bytes and end if less than that is read in */
-        while(fread(inpacket, sizeof(uint8_t), pol.pl, stdin) == pol.pl){
-                packets_read++;
-                /* Create a temporary spot for reading in the inpacket */
-                union64 even_index[dim.even_d];
-                union64 odd_index[dim.odd_d];
-                /* Zero out index arrays */
-                memset(even_index, 0, dim.even_d * sizeof(union64));
-                memset(odd_index, 0, dim.odd_d * sizeof(union64));
-                
-                /* Copy in sections of inpacket to even_index array*/
-                for (uint64_t i = 0; i < dim.even_d; ++i){
-                        copy_section(inpacket,
-                                     even_index[i].arr, 
-                                     i*dim.even_s, dim.even_s);
-                }
-                
-                /* precompute bit offset of odd sections  */
-                uint64_t offset = dim.even_d * dim.even_s;
-                /* Copy in sections of inpacket to odd_index array*/
-                for (uint64_t i = 0; i < dim.odd_d; ++i){
-                        copy_section(inpacket,
-                                     odd_index[i].arr,
-                                     offset + i*dim.odd_s, dim.odd_s);
-                }
-
-                /* create a running total to decide which rule is satisfied */
-                uint8_t bit_total[pol.N/8];
-                /* Zero out bit_total */
-                memset(bit_total, 0, pol.N/8);
-                /* Copy the first bit array into the total Note that we must
-                 * have at least one even section, its the odd sections that may
-                 * not exist. So it is ok for the next for loop to start at 1
-                 * instead of 0 */
-                memcpy(bit_total, &even_tables[even_index[0].num][0][0], pol.N/8);
-
-                /* Loop through the remaining even bit arrays and AND them with
-                 * the total */
-                for(uint64_t i = 1; i < dim.even_d;++i){
-                        and_bitarray(&even_tables[even_index[i].num][i][0], 
-                                     bit_total, pol.N/8);
-                }
-
-                 /* Loop through the remaining odd bit arrays and AND them with
-                 * the total */
-                for(uint64_t i = 0; i < dim.odd_d; ++i){
-                        and_bitarray(&odd_tables[odd_index[i].num][i][0],
-                                     bit_total, pol.N/8);
-                }
-                /* Loop through and determine the first bit that is set, if none
-                 * is set, we say rule 0 is matched. */
-                bool match = false;
-                for(uint64_t i = 0; i < pol.N; ++i){
-                        if(BitValue(bit_total,i) == true){
-                                Print("%"PRIu64"\n",i+1);
-                                //Trace("Packet %"PRIu64" ",packets_read);
-                                //Trace(" matched rule %"PRIu64"\n",i+1);
-                                match = true;
-                                break;
-                        }
+        /* Packets are read and classified a group at a time so that the table
+         * rows for the whole group can be fetched from memory in parallel */
+        const bool bitsliced = ts->tree == NULL &&
+                opts.engine == ENGINE_BITSLICED;
+        const uint64_t group = bitsliced ? BITSLICE_BLOCK : opts.group_size;
+        const classifier classify = ts->tree != NULL ? classify_tree
+                : bitsliced ? classify_bitsliced : classify_group;
+        uint64_t * matches = malloc(group * sizeof(uint64_t));
+        if(matches == NULL){
+                Error("Could not allocate memory for packet group!\n");
+                exit(EXIT_FAILURE);
+        }
+        flow_cache * cache = NULL;
+        if(opts.cache_entries != 0){
+                cache = flow_cache_new(pol, opts.cache_entries);
+        }
+
+        /* Classify up to a group of packets at a time, straight out of the
+         * input buffers */
+        const uint8_t * inpackets;
+        uint64_t count;
+        while((count = input_next(in, &inpackets, group)) > 0){
+                packets_read += count;
+                const uint64_t started = latency_sampled() ? now_ns() : 0;
+                const uint64_t group_started = timeline_start();
+                if(cache != NULL){
+                        classify_cached(pol, ts, cache, classify, inpackets,
+                                        count, matches);
+                }else{
+                        classify(pol, ts, inpackets, count, matches);
                 }
-                if (!match) { 
-                        Print("0\n");
-                        //Trace("Packet %"PRIu64" ",packets_read);
-                        //Trace(" matched rule 0\n");
+                if(pol.hybrid != NULL){
+                        hybrid_resolve(pol, inpackets, count, matches);
                 }
+                timeline_end("classify group", group_started, "packets",
+                             count);
+                if(started != 0) latency_record(now_ns() - started, count);
+                latency_poll();
+                output_matches(out, matches, count);
         }
 
+        free(matches);
+        if(cache != NULL){
+                flow_cache_free(cache, &counters.cache_hits,
+                                &counters.cache_misses);
+        }
+        counters.table_packets += packets_read;
         Trace("Packets read in: %"PRIu64"\n", packets_read);
 
 }
 
-/* AND two bit arrays together, the second argument holds the results */
-static inline void and_bitarray(const uint8_t* new, uint8_t* total, uint64_t size)
+/* Finds the row of every table for each packet in a group, prefetching them
+ * as it goes. rows[i][p] is set to the row of table i for packet p, with the
+ * odd tables numbered after the even ones. The section indices of the whole
+ * group are computed before any row is touched, so the memory accesses for all
+ * of them are in flight at once instead of each packet waiting on its own
+ * misses. Deduplicated tables need one more round of this, since the row ids
+ * have to arrive before the rows can be requested. Rows of tiered tables come
+ * from their row cache, and cannot be prefetched until they are there. */
+void locate_rows(policy pol, const table_set * ts, const uint8_t * packets,
+                 uint64_t count, const uint8_t * rows[][count])
 {
-        for (uint64_t i = 0; i < size; ++i){
-                total[i] &= new[i];
+        uint64_t indices[ts->dims.even_d + ts->dims.odd_d][count];
+        section_indices(ts->dims, pol.pl, packets, count, indices);
+        locate_indexed_rows(ts, count, indices, rows);
+}
+
+/* Works out the section of each table for every packet in a group.
+ * indices[i][p] is set to the section of packet p for table i, with the odd
+ * tables numbered after the even ones. Any tables with the same sections
+ * share them, whatever their rows. */
+void section_indices(table_dims dim, uint64_t pl, const uint8_t * packets,
+                     uint64_t count, uint64_t indices[][count])
+{
+        /* precompute bit offset of odd sections  */
+        const uint64_t offset = dim.even_d * dim.even_s;
+        for(uint64_t p = 0; p < count; ++p){
+                const uint8_t * inpacket = packets + p * pl;
+                for(uint64_t i = 0; i < dim.even_d; ++i){
+                        indices[i][p] = extract_section(inpacket,
+                                                        i * dim.even_s,
+                                                        dim.even_s);
+                }
+                for(uint64_t i = 0; i < dim.odd_d; ++i){
+                        indices[dim.even_d + i][p] =
+                                extract_section(inpacket, offset + i * dim.odd_s,
+                                                dim.odd_s);
+                }
         }
 }
 
-/* Rounds up the result of integer division */
-static inline uint64_t ceil_div(uint64_t num, uint64_t denom)
+/* Finds the rows of a group of packets as locate_rows does, from the sections
+ * found by section_indices */
+void locate_indexed_rows(const table_set * ts, uint64_t count,
+                         const uint64_t indices[][count],
+                         const uint8_t * rows[][count])
 {
-        return (num + denom - 1) / denom;
+        const table_dims dim = ts->dims;
+        uint64_t slots[dim.even_d + dim.odd_d][count];
+        /* Lazy rows are built before they are prefetched, until all are */
+        lazy_tables * lazy = ts->lazy;
+        if(lazy != NULL && lazy_complete(lazy)) lazy = NULL;
+        const uint64_t even_slots = dim.even_h * dim.even_d;
+        tier_tables * tier = ts->tier;
+        if(tier != NULL) tier_next_group(tier);
+
+        for(uint64_t p = 0; p < count; ++p){
+                for(uint64_t i = 0; i < dim.even_d; ++i){
+                        const uint64_t index = indices[i][p];
+                        slots[i][p] = index * dim.even_d + i;
+                        if(tier != NULL){
+                                rows[i][p] = tier_row(tier, i, index);
+                        }else if(ts->pool != NULL){
+                                __builtin_prefetch(&ts->even_ids[slots[i][p]]);
+                        }else{
+                                rows[i][p] = ts->even_tables + 
+                                        slots[i][p] * dim.bytewidth;
+                                if(lazy != NULL){
+                                        lazy_ensure(lazy, slots[i][p]);
+                                }
+                                prefetch_row(rows[i][p], dim.bytewidth);
+                        }
+                }
+                for(uint64_t i = 0; i < dim.odd_d; ++i){
+                        const uint64_t k = dim.even_d + i;
+                        const uint64_t index = indices[k][p];
+                        slots[k][p] = index * dim.odd_d + i;
+                        if(tier != NULL){
+                                rows[k][p] = tier_row(tier, k, index);
+                        }else if(ts->pool != NULL){
+                                __builtin_prefetch(&ts->odd_ids[slots[k][p]]);
+                        }else{
+                                rows[k][p] = ts->odd_tables +
+                                        slots[k][p] * dim.bytewidth;
+                                if(lazy != NULL){
+                                        lazy_ensure(lazy, even_slots +
+                                                    slots[k][p]);
+                                }
+                                prefetch_row(rows[k][p], dim.bytewidth);
+                        }
+                }
+        }
+        if(ts->pool == NULL) return;
+
+        /* The row ids are on their way, now request the pool rows */
+        for(uint64_t p = 0; p < count; ++p){
+                for(uint64_t i = 0; i < dim.even_d + dim.odd_d; ++i){
+                        uint32_t id = i < dim.even_d ? ts->even_ids[slots[i][p]]
+                                                     : ts->odd_ids[slots[i][p]];
+                        rows[i][p] = ts->pool + id * dim.bytewidth;
+                        prefetch_row(rows[i][p], dim.bytewidth);
+                }
+        }
 }
 
-/* Starts timing a section of code */
-void start_timing(profile_t * time)
+/* Classifies a group of packets, prefetching all of their table rows before
+ * any of them are ANDed together */
+void classify_group(policy pol, const table_set * ts, const uint8_t * packets,
+                    uint64_t count, uint64_t matches[count])
 {
-        gettimeofday(time, NULL);
+        const table_dims dim = ts->dims;
+        const uint8_t * rows[dim.even_d + dim.odd_d][count];
+        locate_rows(pol, ts, packets, count, rows);
+        match_rows(dim, count, rows, matches);
 }
 
-/* Ends timing a section of code and returns the number of microseconds elapsed */
-long end_timing(profile_t * time)
+/* ANDs together the rows found for each packet in a group, setting its match
+ * to the first rule left */
+void match_rows(table_dims dim, uint64_t count, const uint8_t * rows[][count],
+                uint64_t matches[count])
 {
-        long mtime, seconds, useconds;
-        struct timeval end_time;
-        gettimeofday(&end_time, NULL);
-        
-        seconds = end_time.tv_sec - time->tv_sec;
-        useconds = end_time.tv_usec - time->tv_usec;
-        mtime = seconds * 1000000 + useconds;
-        return mtime;
+        /* AND the rows together. Note that we must have at least one even
+         * section, its the odd sections that may not exist. So it is ok to
+         * start the running total with the first row. */
+        uint8_t bit_total[dim.bytewidth];
+        for(uint64_t p = 0; p < count; ++p){
+                memcpy(bit_total, rows[0][p], dim.bytewidth);
+                for(uint64_t i = 1; i < dim.even_d + dim.odd_d; ++i){
+                        and_bitarray(rows[i][p], bit_total, dim.bytewidth);
+                }
+                matches[p] = first_match(bit_total, dim.bytewidth);
+        }
+}
+
+/* Returns the rule number of the first bit set in a row, or 0 if none is set */
+uint64_t first_match(const uint8_t * row, uint64_t bytewidth)
+{
+        for(uint64_t i = 0; i < bytewidth; ++i){
+                if(row[i] != 0){
+                        return i * BitsInByte + __builtin_ctz(row[i]) + 1;
+                }
+        }
+        return 0;
 }
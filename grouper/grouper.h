@@ -44,6 +44,55 @@ This file is part of Grouper.
 #define MIN_THREADS_PER_CORE 100 /* The minimum number of threads that should be
                                   * spawned per core  */
 #define min(A,B) (((A) < (B)) ? (A) : (B))
+#define max(A,B) (((A) > (B)) ? (A) : (B))
+#define DEFAULT_GROUP_SIZE 16 /* Packets classified together by
+                               * read_input_and_classify */
+#define MAX_GROUP_SIZE 1024   /* Group rows are tracked on the stack */
+#define BITSLICE_BLOCK 64     /* Packets classified together by the bitsliced
+                               * engine */
+#define BITSLICE_MAX_RULES 256 /* Largest policy the bitsliced engine takes */
+#define MAX_SHARDS 256        /* Most rule shards classified with */
+#define SHARD_BATCH 1024      /* Packets passed between shards at a time */
+#define FLOW_CACHE_WAYS 4     /* Entries of a flow cache set */
+#define MAX_LAZY_THREADS 64   /* Most threads building lazy rows in the
+                               * background */
+#define TIER_CACHE_WAYS 4     /* Rows of a tiered row cache set */
+#define TIER_FAULT_ROWS 1000  /* Cost of reading a tiered row from disk, in
+                               * rows ANDed from memory */
+#define TREE_LEAF_RULES 8     /* Most rules a decision tree leaf starts with */
+#define TREE_MAX_CUT_BITS 8   /* Most bits a decision tree node cuts on */
+#define TREE_SPACE_FACTOR 4   /* Most copies of its rules a decision tree node
+                               * makes, per rule */
+#define TREE_TRIAL_PACKETS 4096 /* Packets timed choosing between a decision
+                                 * tree and tables */
+#define HYBRID_MIN_RULES 16   /* Fewest rules sharing a mask worth hashing */
+#define HYBRID_MAX_MASKS 4    /* Most masks hashed, each a probe per packet */
+#define MAX_POLICIES 16       /* Most policies classified in one pass */
+#define ACTION_WINDOW 1024    /* Most rules before or after a rule compared
+                               * with it when merging rules by action */
+#define PERF_EVENTS 5         /* Hardware events counted, see perf.c */
+#define PERF_UNAVAILABLE UINT64_MAX /* Count of an event that can't be had */
+#define LATENCY_SUB_BITS 6    /* Latency buckets per power of two, as a power
+                               * of two, see latency.c */
+#define LATENCY_BUCKETS ((65 - LATENCY_SUB_BITS) << LATENCY_SUB_BITS)
+#define CACHE_LINE 64         /* Bytes per cache line */
+#define IO_BLOCK (256 * 1024) /* Bytes read or written at a time */
+#define IO_DEPTH 4            /* Blocks of input or output in flight */
+#define MMAP_WINDOW (64 * 1024 * 1024) /* Bytes of a mapped input file mapped
+                                        * at a time */
+#ifndef TIMELINE_ENABLED
+#define TIMELINE_ENABLED 1    /* Compile with this 0 to leave out timeline
+                               * recording altogether, see timeline.c */
+#endif
+#define PREFETCH_LINES 8      /* Maximum number of cache lines of a table row
+                               * to prefetch. Wider rows are left to the
+                               * hardware stream prefetcher */
+
+/* Rules looked up by hash instead of in the tables, see hybrid.c */
+typedef struct HYBRID_RULES hybrid_rules;
+
+/* Actions named by the rules of a policy file, see actions.c */
+typedef struct RULE_ACTIONS rule_actions;
 
 typedef struct {
         uint64_t pl;        /* Packet length */
@@ -54,9 +103,14 @@ typedef struct {
                              * to a multiple of 8 */             
         uint8_t ** q_masks; /* Masks representing ? in policy pattern */
         uint8_t ** b_masks; /* Masks representing 0,1 in policy pattern */
+        hybrid_rules * hybrid; /* Rules taken out into hash tables, or NULL.
+                                * Rules are then numbered among those left. */
+        rule_actions * actions; /* Action of each rule, or NULL if the policy
+                                 * file names none */
 } policy;
 #define POLICY_INIT {.pl = 0, .n = 0, .N = 0, .b = 0, .B = 0, \
-                        .q_masks = NULL, .b_masks = NULL}
+                        .q_masks = NULL, .b_masks = NULL, .hybrid = NULL, \
+                        .actions = NULL}
 
 /* Union to convert between uint64_t and uint8_t[8] */
 typedef union UNION64 union64;
@@ -78,6 +132,81 @@ typedef struct {
         uint64_t odd_s;         /* Width of odd section */
 } table_dims;
 
+/* Rules packed for classifying without tables, see linear.c */
+typedef struct LINEAR_RULES linear_rules;
+
+/* Bookkeeping for tables whose rows are built on demand, see lazy.c */
+typedef struct LAZY_TABLES lazy_tables;
+
+/* Tables kept in a file with a cache of rows in memory, see tier.c */
+typedef struct TIER_TABLES tier_tables;
+
+/* Rules arranged in a decision tree, see tree.c */
+typedef struct DECISION_TREE decision_tree;
+
+/* A set of filtering tables ready for classification. The rows are either
+ * stored in place in even_tables and odd_tables, or when the tables have been
+ * deduplicated, each table holds row ids indexing a pool of unique rows shared
+ * by all of them. Lazy tables store rows in place but only build them once
+ * they are needed. Tiered tables store rows in a file instead. Shared tables
+ * store rows in place, in a shared memory segment mapped at shared. With a
+ * decision tree there are no tables at all. */
+typedef struct {
+        table_dims dims;
+        uint8_t * even_tables;  /* even_h x even_d x bytewidth */
+        uint8_t * odd_tables;   /* odd_h x odd_d x bytewidth */
+        uint32_t * even_ids;    /* even_h x even_d row ids */
+        uint32_t * odd_ids;     /* odd_h x odd_d row ids */
+        uint8_t * pool;         /* unique_rows x bytewidth */
+        uint64_t unique_rows;   /* Number of rows in the pool */
+        uint64_t generation;    /* Distinguishes the tables from any built
+                                 * before, so caches can tell they changed */
+        lazy_tables * lazy;     /* Rows still to build, or NULL */
+        tier_tables * tier;     /* Rows kept in a file, or NULL */
+        uint8_t * shared;       /* Mapped shared memory segment, or NULL */
+        uint64_t shared_bytes;  /* Size of the segment */
+        decision_tree * tree;   /* Decision tree classified with instead of
+                                 * tables, or NULL */
+} table_set;
+#define TABLE_SET_INIT {.even_tables = NULL, .odd_tables = NULL, \
+                        .even_ids = NULL, .odd_ids = NULL, .pool = NULL, \
+                        .unique_rows = 0, .generation = 0, .lazy = NULL, \
+                        .tier = NULL, .shared = NULL, .shared_bytes = 0, \
+                        .tree = NULL}
+
+/* A contiguous range of a policy's rules with its own tables */
+typedef struct {
+        policy pol;             /* The shard's rules */
+        uint64_t first_rule;    /* Index of the shard's first rule in the
+                                 * whole policy */
+        table_set ts;           /* The shard's tables */
+} shard;
+
+/* Tables of several policies classified in one pass, see multi.c */
+typedef struct MULTI_POLICY multi_policy;
+
+/* Batches of packets passing through the shards, see shard.c */
+typedef struct SHARD_PIPELINE shard_pipeline;
+
+/* Classifies a group of packets with a set of tables */
+typedef void (*classifier)(policy pol, const table_set * ts,
+                           const uint8_t * packets, uint64_t count,
+                           uint64_t matches[count]);
+
+/* Rules matched by recently seen packets, see cache.c */
+typedef struct FLOW_CACHE flow_cache;
+
+/* Streams of input packets and output text, see io.c */
+typedef struct INPUT_STREAM input_stream;
+typedef struct OUTPUT_STREAM output_stream;
+
+/* One section of every rule's q and b masks, as integers */
+typedef struct {
+        uint64_t n;             /* Number of rules */
+        uint64_t * q;           /* Section of each q_mask */
+        uint64_t * b;           /* Section of each b_mask */
+} section_masks;
+
 /* Structure to hold args for passing to a fill_table thread */
 typedef struct {
         policy * pol;           /* pointer to policy */
@@ -88,12 +217,183 @@ typedef struct {
 
 typedef struct timeval profile_t; /* redefine to indicate purpose */
 
+/* Classification engines for the multiple table case */
+typedef enum {
+        ENGINE_AUTO,            /* Pick the fastest engine that fits */
+        ENGINE_GENERIC,         /* Prefetched groups, any number of rules */
+        ENGINE_BITSLICED,       /* Word sized rows, small policies only */
+        ENGINE_TREE             /* A decision tree instead of tables */
+} engine_t;
+
+/* Ways to read input and write output */
+typedef enum {
+        IO_AUTO,                /* io_uring if the kernel has it */
+        IO_URING,               /* Asynchronous with io_uring */
+        IO_PLAIN,               /* Plain read and write calls */
+        IO_MMAP                 /* Map input files, otherwise as auto */
+} io_mode;
+
+/* Forms of the table report */
+typedef enum {
+        REPORT_NONE,
+        REPORT_TEXT,            /* A table for people */
+        REPORT_JSON             /* One JSON object, for scripts */
+} report_format;
+
+/* Why tables cannot be had for a policy in a memory budget */
+typedef enum {
+        PLAN_OK,
+        PLAN_NO_MEMORY,         /* Not even the smallest tables fit */
+        PLAN_NO_SLICED_MEMORY,  /* Nor the smallest bitsliced tables */
+        PLAN_NOT_SLICEABLE,     /* Too many rules or shards to bitslice */
+        PLAN_NO_TREE_MEMORY     /* A decision tree does not fit */
+} plan_status;
+
+/* Options given on the command line */
+typedef struct {
+        uint64_t group_size;    /* Packets per prefetch group */
+        engine_t engine;        /* Engine to classify with */
+        bool dedup;             /* Deduplicate table rows */
+        uint64_t shards;        /* Number of rule shards */
+        bool shard_processes;   /* Run shards as processes, not threads */
+        io_mode io;             /* How to do input and output */
+        uint64_t cache_entries; /* Flow cache entries per thread, 0 for none */
+        bool counters;          /* Count hardware events of each phase */
+        uint64_t latency_every; /* Groups per one timed, 0 for none */
+        const char * stats_socket; /* Unix socket to report stats on, or
+                                    * NULL */
+        bool lazy;              /* Build table rows when first needed */
+        uint64_t lazy_threads;  /* Threads building lazy rows in the
+                                 * background */
+        bool build_behind;      /* Classify while the tables are built */
+        const char * tier_dir;  /* Directory to keep the tables in, or NULL
+                                 * to keep them in memory */
+        const char * shared_name; /* Shared memory segment to share the
+                                   * tables through, or NULL */
+        const char * timeline;  /* File to write a timeline to, or NULL */
+        report_format report;   /* How to report on the tables */
+        bool tree_trial;        /* Try a decision tree against the tables of
+                                 * the automatic engine */
+        bool try_tree;          /* Build a decision tree as well as the tables
+                                 * and keep whichever is faster */
+        bool hybrid;            /* Hash rules sharing a mask */
+        bool actions;           /* Output the action of the rule matched */
+} options;
+#define OPTIONS_INIT {.group_size = DEFAULT_GROUP_SIZE, .engine = ENGINE_AUTO, \
+                        .dedup = false, .shards = 1, .shard_processes = false, \
+                        .io = IO_AUTO, .cache_entries = 0, \
+                        .counters = false, .latency_every = 0, \
+                        .stats_socket = NULL, .lazy = false, \
+                        .lazy_threads = 0, .build_behind = false, \
+                        .tier_dir = NULL, .shared_name = NULL, \
+                        .timeline = NULL, .report = REPORT_NONE, \
+                        .tree_trial = false, .try_tree = false, \
+                        .hybrid = false, \
+                        .actions = false}
+
+extern options opts;
+
+/* Open hardware event counters, -1 for those not counted */
+typedef struct {
+        int fd[PERF_EVENTS];
+} perf_counters;
+#define PERF_COUNTERS_INIT {.fd = {-1, -1, -1, -1, -1}}
+
+/* Counts kept while classifying, for the timing record */
+typedef struct {
+        uint64_t cache_hits;    /* Packets found in a flow cache */
+        uint64_t cache_misses;  /* Packets looked up in the tables instead */
+        uint64_t lazy_built;    /* Lazy table rows built */
+        uint64_t lazy_rows;     /* Lazy table rows there are */
+        uint64_t linear_packets; /* Packets classified while building */
+        uint64_t table_packets; /* Packets classified with tables */
+        uint64_t tier_hits;     /* Tiered rows found in the row cache */
+        uint64_t tier_misses;   /* Tiered rows read from the file instead */
+        uint64_t tier_faults;   /* Major page faults while classifying with
+                                 * tiered tables */
+        uint64_t tier_file_bytes; /* Size of the tiered table file */
+        double tier_planned;    /* Hit rate the planner expected */
+        uint64_t shared_built;  /* Shared table sets built */
+        uint64_t shared_attached; /* Shared table sets built by another
+                                   * process */
+        uint64_t tree_nodes;    /* Nodes of decision trees */
+        uint64_t tree_leaf_rules; /* Rules listed in decision tree leaves */
+        double tree_trial_ns;   /* Nanoseconds per packet a decision tree */
+        double table_trial_ns;  /* and the tables took when tried */
+        uint64_t hybrid_rules;  /* Rules taken out into hash tables */
+        uint64_t hybrid_masks;  /* Hash tables they went in */
+        uint64_t hybrid_bytes;  /* Memory the hash tables take */
+        uint64_t hybrid_table_rules; /* Rules left for the tables */
+        uint64_t section_layouts; /* Distinct sections taken of each packet
+                                   * for several policies */
+        uint64_t action_rules_read; /* Rules of a policy with actions */
+        uint64_t action_rules_kept; /* and those left once merged */
+        uint64_t action_count;  /* Distinct actions they name */
+} run_counters;
+
+extern run_counters counters;
+
+/* Histogram of the latency of classification, see latency.c */
+typedef struct {
+        uint64_t counts[LATENCY_BUCKETS];
+        uint64_t total;         /* Packets recorded */
+        uint64_t max;           /* Highest latency recorded, in nanoseconds */
+        uint64_t every;         /* Groups per one timed, 0 for none */
+        uint64_t countdown;     /* Groups until the next one timed */
+} latency_histogram;
+
+extern latency_histogram latency;
+
+/* Statistics reported while running, see stats.c */
+typedef struct {
+        uint64_t packets;       /* Packets classified so far */
+        uint64_t no_match;      /* Of those, packets matching no rule */
+        uint64_t started;       /* now_ns() when classification started, 0
+                                 * while the tables are built */
+        uint64_t table_bytes;   /* Memory the tables take */
+        uint64_t build_time;    /* Microseconds taken to build them */
+        uint64_t pl;            /* Packet length */
+} live_stats;
+
+extern live_stats stats;
+
+/* Whether a timeline is being recorded, see timeline.c */
+extern bool timeline_on;
+
 /************************** Prototypes  *************************/
 
 /* Determine the minimum number of tables that will fit in a
    prescribed amount of memory */
 uint64_t min_tables(uint64_t m, uint64_t n, uint64_t b);
 
+/* Parses an option grouper and bench share, returning false if it is not one */
+bool parse_common_option(int opt, const char * arg);
+
+/* Works out the number of tables and their row width for a policy in m bits,
+ * settling the engine */
+uint64_t plan_tables(policy pol, uint64_t m, uint64_t * bitwidth);
+
+/* As plan_tables, returning TABLE_ERROR and why rather than exiting */
+uint64_t try_plan_tables(policy pol, uint64_t m, uint64_t * bitwidth,
+                         plan_status * status);
+
+/* Calculates the dimensions of t tables for a policy */
+table_dims make_dims(policy pol, uint64_t t, uint64_t bitwidth);
+
+/* Returns the total number of rows in all tables */
+uint64_t table_rows(table_dims dims);
+
+/* Returns the bytes of memory taken by a table set */
+uint64_t table_set_bytes(const table_set * ts);
+
+/* Builds the tables for a policy in at most m bits, returning how many */
+uint64_t build_tables(policy pol, uint64_t t, uint64_t bitwidth, uint64_t m,
+                      table_set * ts);
+
+/* As build_tables, returning TABLE_ERROR and why rather than exiting */
+uint64_t try_build_tables(policy pol, uint64_t t, uint64_t bitwidth,
+                          uint64_t m, table_set * ts, plan_status * status);
+
 /* Find the dimensions of a rule file, number of lines and max rule length */
 policy read_policy(FILE * file);
 
@@ -136,18 +436,332 @@ uint8_t * create_single_table(policy pol,uint64_t width);
 
 /* Classify packets with a single table */
 void read_input_and_classify_single(policy pol, uint64_t width,
-                                    uint8_t (*table)[width]);
-/* Filters incoming packets and classifies them to stdout */
-void read_input_and_classify(policy pol, table_dims dim, 
-                             uint8_t even_tables[dim.even_h][dim.even_d][dim.bytewidth], 
-                             uint8_t odd_tables[dim.odd_h][dim.odd_d][dim.bytewidth]);
+                                    uint8_t (*table)[width],
+                                    input_stream * in, output_stream * out);
+/* Filters incoming packets and classifies them to the output */
+void read_input_and_classify(policy pol, const table_set * ts,
+                             input_stream * in, output_stream * out);
+
+/* Finds the row of every table for each packet in a group */
+void locate_rows(policy pol, const table_set * ts, const uint8_t * packets,
+                 uint64_t count, const uint8_t * rows[][count]);
+
+/* Works out the section of each table for every packet in a group */
+void section_indices(table_dims dim, uint64_t pl, const uint8_t * packets,
+                     uint64_t count, uint64_t indices[][count]);
+
+/* Finds the row of every table for each packet in a group from its sections */
+void locate_indexed_rows(const table_set * ts, uint64_t count,
+                         const uint64_t indices[][count],
+                         const uint8_t * rows[][count]);
+
+/* Classifies a group of packets, prefetching all of their table rows before
+ * any of them are ANDed together */
+void classify_group(policy pol, const table_set * ts, const uint8_t * packets,
+                    uint64_t count, uint64_t matches[count]);
+
+/* ANDs together the rows of each packet in a group to find its match */
+void match_rows(table_dims dim, uint64_t count, const uint8_t * rows[][count],
+                uint64_t matches[count]);
+
+/* Returns the rule number of the first bit set in a row, or 0 if none is set */
+uint64_t first_match(const uint8_t * row, uint64_t bytewidth);
+
+/* Classifies a block of packets from rows found for them in bitsliced
+ * tables */
+void match_bitsliced_rows(table_dims dim, uint64_t count,
+                          const uint8_t * rows[][count],
+                          uint64_t matches[count]);
+
+/* Returns the row width in bits the bitsliced engine needs for n rules */
+uint64_t bitslice_width(uint64_t n);
+
+/* Classifies a block of up to BITSLICE_BLOCK packets with tables whose rows are
+ * bitslice_width bits wide */
+void classify_bitsliced(policy pol, const table_set * ts, const uint8_t * packets,
+                        uint64_t count, uint64_t matches[count]);
+
+/* Extracts one section of every rule's masks */
+section_masks get_section_masks(policy pol, uint64_t startbit, uint64_t size);
+
+/* Frees the masks returned by get_section_masks */
+void free_section_masks(section_masks * sm);
+
+/* Builds the table row for one value of a section */
+void build_row(const section_masks * sm, uint64_t index, uint8_t * row);
+
+/* Frees the tables of a table set */
+void free_table_set(table_set * ts);
+
+/* Sets up the zeroed tables of a table set to be built on demand */
+lazy_tables * lazy_new(policy pol, table_set * ts, uint64_t nthreads);
+
+/* Makes sure the row in a slot of lazy tables has been built */
+void lazy_ensure(lazy_tables * lt, uint64_t slot);
+
+/* Returns whether every row of lazy tables has been built */
+bool lazy_complete(const lazy_tables * lt);
+
+/* Frees the bookkeeping of lazy tables, counting the rows built */
+void lazy_free(lazy_tables * lt, uint64_t * built, uint64_t * rows);
+
+/* Builds the tables of one shard of a policy */
+void build_shard(policy pol, uint64_t k, uint64_t nshards, uint64_t m, shard * s);
+
+/* Splits the rules of a policy into shards and builds tables for each */
+shard * build_shards(policy pol, uint64_t nshards, uint64_t m);
+
+/* Frees shards returned by build_shards */
+void free_shards(shard * shards, uint64_t nshards);
+
+/* Starts a thread for each of the shards built by build_shards */
+shard_pipeline * start_shard_threads(policy pol, shard * shards, uint64_t nshards);
+
+/* Forks a process for each shard of a policy, which builds its own tables */
+shard_pipeline * start_shard_processes(policy pol, uint64_t nshards, uint64_t m);
+
+/* Works out how many tables to keep in a file in dir, with a row cache in m
+ * bits, setting *hit_rate to the share of rows expected to be cached */
+uint64_t plan_tiered(policy pol, uint64_t m, const char * dir,
+                     double * hit_rate);
+
+/* Writes tables for a policy to a file in dir, with a row cache in m bits */
+tier_tables * tier_build(policy pol, table_dims d, uint64_t m, const char * dir);
+
+/* Starts a new group of packets, whose rows may replace those of the last */
+void tier_next_group(tier_tables * tt);
+
+/* Returns a row of a tiered table, valid until the next group starts */
+const uint8_t * tier_row(tier_tables * tt, uint64_t k, uint64_t index);
+
+/* Returns a row of a tiered table from the file, without caching it */
+const uint8_t * tier_mapped_row(const tier_tables * tt, uint64_t k,
+                                uint64_t index);
+
+/* Returns the bytes of memory taken by the row cache of tiered tables */
+uint64_t tier_cache_bytes(const tier_tables * tt);
+
+/* Frees tiered tables, adding their hits, misses and faults to rc */
+void tier_free(tier_tables * tt, run_counters * rc);
+
+/* Sets up ts with a policy's tables in a shared memory segment, building them
+ * unless another process has, and returns whether they were built */
+bool shared_tables(policy pol, table_dims d, const char * name, table_set * ts);
+
+/* Unmaps shared tables, leaving the segment for other processes */
+void shared_detach(table_set * ts);
+
+/* Builds a decision tree for a policy in m bits, or returns NULL if it cannot
+ * fit */
+decision_tree * tree_build(policy pol, uint64_t m);
+
+/* Times a decision tree against the tables of ts on packets made from the
+ * rules, returning whether the tree was faster */
+bool tree_faster(policy pol, const table_set * ts, decision_tree * dt,
+                 double * tree_ns, double * table_ns);
+
+/* Returns the bytes of memory a decision tree takes */
+uint64_t tree_bytes(const decision_tree * dt);
+
+/* Frees a decision tree, adding its nodes and leaf rules to rc unless it is
+ * NULL */
+void tree_free(decision_tree * dt, run_counters * rc);
+
+/* Classifies a group of packets with the decision tree of ts */
+void classify_tree(policy pol, const table_set * ts, const uint8_t * packets,
+                   uint64_t count, uint64_t matches[count]);
+
+/* Takes groups of rules sharing a mask out of a policy into hash tables */
+void hybrid_split(policy * pol, run_counters * rc);
+
+/* Frees the hashed rules of a policy */
+void hybrid_free(hybrid_rules * h);
+
+/* Renumbers the matches of a group of packets to the whole policy, looking up
+ * the hashed rules too */
+void hybrid_resolve(policy pol, const uint8_t * packets, uint64_t count,
+                    uint64_t matches[count]);
+
+/* Gathers the action named by each of n rules, NULL for none */
+rule_actions * actions_new(char ** labels, uint64_t n);
+
+/* Frees the actions of a policy */
+void actions_free(rule_actions * a);
+
+/* Drops and merges rules of a policy where the action of the first match is
+ * unchanged */
+void actions_reduce(policy * pol, run_counters * rc);
+
+/* Returns the name of the action of a match, and its length in len */
+const char * action_name(const rule_actions * a, uint64_t match, size_t * len);
+
+/* Builds tables for several policies, sharing out m bits of memory */
+multi_policy * multi_build(policy * pols, uint64_t count, uint64_t m);
+
+/* Returns the bytes of memory taken by the tables of every policy */
+uint64_t multi_table_bytes(const multi_policy * mp);
+
+/* Frees the tables of every policy */
+void multi_free(multi_policy * mp);
+
+/* Classifies the input against every policy, writing a column of matches per
+ * policy */
+void read_input_and_classify_multi(multi_policy * mp, input_stream * in,
+                                   output_stream * out);
+
+/* Packs the masks of a policy for classify_linear */
+linear_rules * linear_new(policy pol);
+
+/* Frees rules returned by linear_new */
+void linear_free(linear_rules * lr);
+
+/* Returns the bytes packed rules take */
+uint64_t linear_bytes(const linear_rules * lr);
+
+/* Checks a packet against count of the packed rules, listed 0 based and in
+ * order, returning one more than the first that matches or 0 for none */
+uint64_t linear_first_match(const linear_rules * lr, const uint8_t * packet,
+                            const uint32_t * rules, uint64_t count);
+
+/* Classifies packets by checking each against every rule in order */
+void classify_linear(policy pol, const linear_rules * lr,
+                     const uint8_t * packets, uint64_t count,
+                     uint64_t matches[count]);
+
+/* Builds tables on another thread, classifying with classify_linear until they
+ * are ready and with the tables after */
+uint64_t read_input_and_classify_building(policy pol, uint64_t t,
+                                          uint64_t bitwidth, uint64_t m,
+                                          table_set * ts, long * build_time,
+                                          input_stream * in,
+                                          output_stream * out);
+
+/* Returns the bytes of memory taken by the tables of every shard */
+uint64_t shard_table_bytes(const shard_pipeline * pipe);
+
+/* Filters incoming packets through the shards and classifies them to the
+ * output */
+void read_input_and_classify_sharded(shard_pipeline * pipe, input_stream * in,
+                                     output_stream * out);
+
+/* Returns a generation no other set of tables has */
+uint64_t new_generation(void);
+
+/* Creates a flow cache of at least entries entries for the packets of pol */
+flow_cache * flow_cache_new(policy pol, uint64_t entries);
+
+/* Empties a flow cache */
+void flow_cache_clear(flow_cache * c);
+
+/* Frees a flow cache, adding its hits and misses to *hits and *misses */
+void flow_cache_free(flow_cache * c, uint64_t * hits, uint64_t * misses);
+
+/* Classifies a group of packets, looking each up in the flow cache first */
+void classify_cached(policy pol, const table_set * ts, flow_cache * c,
+                     classifier classify, const uint8_t * packets,
+                     uint64_t count, uint64_t matches[count]);
+
+/* Opens every hardware event counter available, false if there are none */
+bool perf_open(perf_counters * pc);
+
+/* Starts counting hardware events from zero */
+void perf_start(perf_counters * pc);
+
+/* Stops counting hardware events and reads their counts */
+void perf_stop(perf_counters * pc, uint64_t values[PERF_EVENTS]);
+
+/* Closes hardware event counters */
+void perf_close(perf_counters * pc);
+
+/* Adds the hardware event counts of a phase to the timing record */
+void perf_print(FILE * f, const char * phase, const uint64_t values[PERF_EVENTS]);
+
+/* Starts timing one group of packets in every every */
+void latency_init(uint64_t every);
+
+/* Returns the monotonic time in nanoseconds */
+uint64_t now_ns(void);
+
+/* Records a latency of ns nanoseconds for each of count packets */
+void latency_record(uint64_t ns, uint64_t count);
+
+/* Adds the latency percentiles to the timing record */
+void latency_print(FILE * f);
+
+/* Prints the latencies so far if they have been asked for */
+void latency_poll(void);
+
+/* Starts reporting statistics on SIGUSR1 and the stats socket, if any */
+void stats_start(const char * path);
+
+/* Records the size of the tables and how long they took for the statistics */
+void stats_built(uint64_t table_bytes, uint64_t build_time);
+
+/* Marks the start of classification for the statistics */
+void stats_classifying(uint64_t pl);
+
+/* Removes the stats socket */
+void stats_stop(void);
+
+/* Reports on the density, distinct rows and selectivity of every table */
+void report_tables(policy pol, const table_set * ts, bool json, FILE * f);
+
+/* Starts recording a timeline to write to path, unless it is NULL */
+void timeline_init(const char * path);
+
+/* Records an event that started at start and ends now */
+void timeline_event(const char * name, uint64_t start, const char * key,
+                    uint64_t value);
+
+/* Writes out the timeline, if one is being recorded */
+void timeline_write(void);
+
+/* Opens a stream of packets of pl bytes on fd */
+input_stream * input_open(int fd, uint64_t pl);
+
+/* Returns up to max contiguous packets of input, valid until the next call */
+uint64_t input_next(input_stream * in, const uint8_t ** packets, uint64_t max);
+
+/* Copies up to max packets of input to dst, returning how many */
+uint64_t input_read(input_stream * in, uint8_t * dst, uint64_t max);
+
+/* Closes an input stream, returning the microseconds spent waiting on it */
+long input_close(input_stream * in);
+
+/* Opens an output stream on fd */
+output_stream * output_open(int fd);
+
+/* Returns room for at least len bytes of output */
+char * output_space(output_stream * out, size_t len);
+
+/* Claims len bytes written to the room returned by output_space */
+void output_commit(output_stream * out, size_t len);
+
+/* Writes the rule matched by each of count packets, one per line */
+void output_matches(output_stream * out, const uint64_t * matches,
+                    uint64_t count);
+
+/* Writes the rules matched by each of count packets against several policies,
+ * one line per packet and one column per policy */
+void output_columns(output_stream * out, const uint64_t * matches,
+                    uint64_t count, uint64_t columns);
+
+/* Writes the action of each match instead of its rule */
+void output_actions(output_stream * out, const rule_actions * actions);
+
+/* Flushes and closes an output stream, returning the microseconds spent
+ * waiting on it */
+long output_close(output_stream * out);
+
+/* Returns the fewest tables whose row ids alone fit in m bits */
+uint64_t min_tables_dedup(uint64_t m, uint64_t b);
+
+/* Builds deduplicated tables in at most m bits of memory */
+int build_dedup_tables(policy pol, table_dims dims, uint64_t m, table_set * ts);
 
 /* AND two bit arrays together, the second argument is modified */
 static inline void and_bitarray(const uint8_t *new, uint8_t *total, uint64_t size);
 
-/* Rounds up the result of integer division */
-static inline uint64_t ceil_div(uint64_t num, uint64_t denom);
-
 /* Starts timing a section of code */
 static inline void start_timing(profile_t * time);
 
@@ -160,3 +774,93 @@ static inline long end_timing(profile_t * time);
 #define PackingIndex(bit) ((((bit)/BitsInByte)*BitsInByte)  \
                           + (BitsInByte - 1 - (bit)%BitsInByte))
 
+/* Rounds up the result of integer division */
+static inline uint64_t ceil_div(uint64_t num, uint64_t denom)
+{
+        return (num + denom - 1) / denom;
+}
+
+/* Returns the integer value of size bits of a packet starting at startbit. This
+ * is the value copy_section would leave in a zeroed union64, but it reads whole
+ * bytes instead of moving a bit at a time. It never reads past the last byte
+ * holding a bit of the section. */
+static inline uint64_t extract_section(const uint8_t * packet, uint64_t startbit,
+                                       uint64_t size)
+{
+        const uint8_t * src = packet + startbit / BitsInByte;
+        uint64_t shift = startbit % BitsInByte;
+        uint64_t nbytes = ceil_div(shift + size, BitsInByte);
+        if(nbytes > sizeof(uint64_t)){
+                /* Section straddles 9 bytes, do it the slow way */
+                union64 section = {.num = 0};
+                copy_section(packet, section.arr, startbit, size);
+                return section.num;
+        }
+        uint64_t value = 0;
+        for(uint64_t i = 0; i < nbytes; ++i){
+                value |= (uint64_t)src[i] << (i * BitsInByte);
+        }
+        value >>= shift;
+        if(size < 64) value &= (UINT64_C(1) << size) - 1;
+        return value;
+}
+
+/* Prefetches the first few cache lines of a table row */
+static inline void prefetch_row(const uint8_t * row, uint64_t bytewidth)
+{
+        uint64_t lines = min(ceil_div(bytewidth, CACHE_LINE), PREFETCH_LINES);
+        for(uint64_t i = 0; i < lines; ++i){
+                __builtin_prefetch(row + i * CACHE_LINE);
+        }
+}
+
+/* AND two bit arrays together, the second argument holds the results */
+static inline void and_bitarray(const uint8_t* new, uint8_t* total, uint64_t size)
+{
+        for (uint64_t i = 0; i < size; ++i){
+                total[i] &= new[i];
+        }
+}
+
+/* Starts timing a section of code */
+static inline void start_timing(profile_t * time)
+{
+        gettimeofday(time, NULL);
+}
+
+/* Ends timing a section of code and returns the number of microseconds elapsed */
+static inline long end_timing(profile_t * time)
+{
+        long mtime, seconds, useconds;
+        struct timeval end_time;
+        gettimeofday(&end_time, NULL);
+        
+        seconds = end_time.tv_sec - time->tv_sec;
+        useconds = end_time.tv_usec - time->tv_usec;
+        mtime = seconds * 1000000 + useconds;
+        return mtime;
+}
+
+/* Returns whether the latency of the next group of packets is to be timed */
+static inline bool latency_sampled(void)
+{
+        if(latency.every == 0 || --latency.countdown != 0) return false;
+        latency.countdown = latency.every;
+        return true;
+}
+
+/* Returns the start of an event for the timeline, or 0 if none is recorded */
+static inline uint64_t timeline_start(void)
+{
+        return TIMELINE_ENABLED && timeline_on ? now_ns() : 0;
+}
+
+/* Records an event named name that began at start, as returned by
+ * timeline_start, with an argument named key unless it is NULL */
+static inline void timeline_end(const char * name, uint64_t start,
+                                const char * key, uint64_t value)
+{
+        if(TIMELINE_ENABLED && start != 0){
+                timeline_event(name, start, key, value);
+        }
+}
@@ -0,0 +1,291 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Rules looked up by hash instead of in the tables. Every rule widens every
+ * row of the tables by a bit, yet many policies are mostly rules that fix all
+ * their bits, or the same bits as many other rules. Rules sharing a ? mask
+ * match a packet exactly when the packet's bits under the mask equal theirs,
+ * so they can go in a hash table keyed on those bits instead, and a packet
+ * takes one probe per mask however many rules there are.
+ *
+ * hybrid_split takes the largest groups of rules sharing a mask out of a
+ * policy, leaving the rest for the tables. A packet is then looked up both
+ * ways and matches whichever rule comes first in the whole policy, so rules
+ * can be split off in any order. Where rules of a group have the same bits,
+ * the later ones can never be the first match and are dropped. At least one
+ * rule is always left for the tables.
+ *
+ * As with the tables, only the first b bits of a packet count. */
+
+#include "grouper.h"
+
+/* The rules sharing one mask */
+typedef struct {
+        uint8_t * mask;         /* key_len bytes */
+        uint64_t slot_mask;     /* Number of slots - 1 */
+        uint32_t * rules;       /* Rule in each slot + 1, or 0 if empty */
+        uint8_t * keys;         /* Bits the rule in each slot fixes */
+} exact_table;
+
+struct HYBRID_RULES {
+        uint64_t key_len;       /* Bytes of a key */
+        uint8_t last_mask;      /* Bits of the last key byte that count */
+        uint64_t ntables;
+        exact_table tables[HYBRID_MAX_MASKS];
+        uint32_t * ids;         /* Rule in the whole policy of each rule left
+                                 * for the tables */
+        uint64_t bytes;         /* Memory the hash tables take */
+};
+
+/* Returns the 64 bit FNV-1a hash of a key */
+static inline uint64_t hash_key(const uint8_t * key, uint64_t len)
+{
+        uint64_t hash = UINT64_C(14695981039346656037);
+        for(uint64_t i = 0; i < len; ++i){
+                hash ^= key[i];
+                hash *= UINT64_C(1099511628211);
+        }
+        return hash;
+}
+
+/* Copies the bits of a packet under a mask to key */
+static inline void make_key(const hybrid_rules * h, const uint8_t * mask,
+                            const uint8_t * packet, uint8_t * key)
+{
+        for(uint64_t i = 0; i < h->key_len; ++i) key[i] = packet[i] & mask[i];
+}
+
+/* The masks of every rule, trimmed to the bits that count */
+typedef struct {
+        const uint8_t * masks;  /* n x len */
+        uint64_t len;
+} mask_list;
+
+/* Orders rules by their masks, and rules with the same mask by number */
+static int compare_masks(const void * a, const void * b, void * arg)
+{
+        const mask_list * l = arg;
+        const uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+        const int order = memcmp(l->masks + x * l->len, l->masks + y * l->len,
+                                 l->len);
+        if(order != 0) return order;
+        return x < y ? -1 : x > y;
+}
+
+/* A run of rules with the same mask */
+typedef struct {
+        uint64_t first;         /* Index of its first rule in the sorted list */
+        uint64_t count;
+} mask_group;
+
+static int compare_groups(const void * a, const void * b)
+{
+        const mask_group * x = a, * y = b;
+        if(x->count != y->count) return x->count > y->count ? -1 : 1;
+        return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/* Puts rule w, whose key is key, in a hash table unless a rule before it has
+ * the same key */
+static void insert_rule(const hybrid_rules * h, exact_table * et,
+                        const uint8_t * key, uint32_t w)
+{
+        uint64_t s = hash_key(key, h->key_len) & et->slot_mask;
+        while(et->rules[s] != 0){
+                if(memcmp(et->keys + s * h->key_len, key, h->key_len) == 0){
+                        return;
+                }
+                s = (s + 1) & et->slot_mask;
+        }
+        et->rules[s] = w + 1;
+        memcpy(et->keys + s * h->key_len, key, h->key_len);
+}
+
+/* Takes the largest groups of rules sharing a mask, of at least
+ * HYBRID_MIN_RULES rules and at most HYBRID_MAX_MASKS of them, out of *pol
+ * into hash tables, leaving the rest of its rules for the tables. Sets
+ * pol->hybrid, and adds the rules and bytes of the hash tables to rc. */
+void hybrid_split(policy * pol, run_counters * rc)
+{
+        hybrid_rules * h = calloc(1, sizeof(hybrid_rules));
+        if(h == NULL){
+                Error("Could not allocate memory for hashed rules!\n");
+                exit(EXIT_FAILURE);
+        }
+        h->key_len = min(ceil_div(pol->b, BitsInByte), pol->pl);
+        h->last_mask = pol->b % BitsInByte == 0 ? 0xff
+                : (1 << (pol->b % BitsInByte)) - 1;
+
+        /* Group the rules by mask */
+        const uint64_t n = pol->n;
+        const uint64_t len = h->key_len;
+        uint8_t * masks = malloc(n * len);
+        uint32_t * order = malloc(n * sizeof(uint32_t));
+        mask_group * groups = malloc(n * sizeof(mask_group));
+        bool * hashed = calloc(n, sizeof(bool));
+        if(masks == NULL || order == NULL || groups == NULL || hashed == NULL){
+                Error("Could not allocate memory for hashed rules!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t w = 0; w < n; ++w){
+                memcpy(masks + w * len, pol->q_masks[w], len);
+                masks[w * len + len - 1] &= h->last_mask;
+                order[w] = w;
+        }
+        mask_list list = {.masks = masks, .len = len};
+        qsort_r(order, n, sizeof(uint32_t), compare_masks, &list);
+        uint64_t ngroups = 0;
+        for(uint64_t i = 0; i < n; ++i){
+                if(i == 0 || memcmp(masks + order[i] * len,
+                                    masks + order[i - 1] * len, len) != 0){
+                        groups[ngroups++] = (mask_group) {.first = i,
+                                                          .count = 0};
+                }
+                groups[ngroups - 1].count++;
+        }
+        qsort(groups, ngroups, sizeof(mask_group), compare_groups);
+
+        /* Hash the largest groups */
+        uint8_t key[len];
+        uint64_t taken = 0;
+        for(uint64_t g = 0; g < min(ngroups, HYBRID_MAX_MASKS); ++g){
+                if(groups[g].count < HYBRID_MIN_RULES) break;
+                exact_table * et = &h->tables[h->ntables++];
+                uint64_t slots = 1;
+                while(slots < 2 * groups[g].count) slots *= 2;
+                et->slot_mask = slots - 1;
+                et->mask = malloc(len);
+                et->rules = calloc(slots, sizeof(uint32_t));
+                et->keys = malloc(slots * len);
+                if(et->mask == NULL || et->rules == NULL || et->keys == NULL){
+                        Error("Could not allocate memory for hashed rules!\n");
+                        exit(EXIT_FAILURE);
+                }
+                memcpy(et->mask, masks + order[groups[g].first] * len, len);
+                h->bytes += len + slots * (sizeof(uint32_t) + len);
+                for(uint64_t i = 0; i < groups[g].count; ++i){
+                        hashed[order[groups[g].first + i]] = true;
+                }
+                taken += groups[g].count;
+        }
+        /* The tables need a rule. Any will do, as the order of the rules
+         * decides between the two lookups. */
+        if(taken == n){
+                hashed[n - 1] = false;
+                taken--;
+        }
+        for(uint64_t t = 0; t < h->ntables; ++t){
+                exact_table * et = &h->tables[t];
+                for(uint64_t w = 0; w < n; ++w){
+                        if(!hashed[w] ||
+                           memcmp(masks + w * len, et->mask, len) != 0){
+                                continue;
+                        }
+                        make_key(h, et->mask, pol->b_masks[w], key);
+                        insert_rule(h, et, key, w);
+                }
+        }
+
+        /* Leave the rest of the rules in the policy */
+        const uint64_t left = n - taken;
+        h->ids = malloc(left * sizeof(uint32_t));
+        uint8_t ** q_masks = array2d_alloc(left, pol->B / BitsInByte);
+        uint8_t ** b_masks = array2d_alloc(left, pol->B / BitsInByte);
+        if(h->ids == NULL){
+                Error("Could not allocate memory for hashed rules!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t w = 0, k = 0; w < n; ++w){
+                if(hashed[w]) continue;
+                h->ids[k] = w;
+                memcpy(q_masks[k], pol->q_masks[w], pol->B / BitsInByte);
+                memcpy(b_masks[k], pol->b_masks[w], pol->B / BitsInByte);
+                k++;
+        }
+        array2d_free(pol->q_masks);
+        array2d_free(pol->b_masks);
+        pol->q_masks = q_masks;
+        pol->b_masks = b_masks;
+        pol->n = left;
+        pol->N = 8 * ceil_div(left, 8);
+        pol->hybrid = h;
+        Trace("Hashed %"PRIu64" rules under %"PRIu64" masks in %"PRIu64
+              " bytes, leaving %"PRIu64" for the tables\n", taken, h->ntables,
+              h->bytes, left);
+        rc->hybrid_rules += taken;
+        rc->hybrid_masks += h->ntables;
+        rc->hybrid_bytes += h->bytes;
+        rc->hybrid_table_rules += left;
+
+        free(masks);
+        free(order);
+        free(groups);
+        free(hashed);
+}
+
+/* Frees the hashed rules of a policy */
+void hybrid_free(hybrid_rules * h)
+{
+        for(uint64_t t = 0; t < h->ntables; ++t){
+                free(h->tables[t].mask);
+                free(h->tables[t].rules);
+                free(h->tables[t].keys);
+        }
+        free(h->ids);
+        free(h);
+}
+
+/* Turns the matches of a group of packets among the rules left for the tables
+ * into matches among the rules of the whole policy, with the hashed rules
+ * looked up too. As with the tables, the slots of the whole group are worked
+ * out and prefetched before any is probed. */
+void hybrid_resolve(policy pol, const uint8_t * packets, uint64_t count,
+                    uint64_t matches[count])
+{
+        const hybrid_rules * h = pol.hybrid;
+        for(uint64_t p = 0; p < count; ++p){
+                if(matches[p] != 0) matches[p] = h->ids[matches[p] - 1] + 1;
+        }
+        uint8_t key[h->key_len];
+        uint64_t slots[count];
+        for(uint64_t t = 0; t < h->ntables; ++t){
+                const exact_table * et = &h->tables[t];
+                for(uint64_t p = 0; p < count; ++p){
+                        make_key(h, et->mask, packets + p * pol.pl, key);
+                        slots[p] = hash_key(key, h->key_len) & et->slot_mask;
+                        __builtin_prefetch(&et->rules[slots[p]]);
+                }
+                for(uint64_t p = 0; p < count; ++p){
+                        make_key(h, et->mask, packets + p * pol.pl, key);
+                        for(uint64_t s = slots[p]; et->rules[s] != 0;
+                            s = (s + 1) & et->slot_mask){
+                                if(memcmp(et->keys + s * h->key_len, key,
+                                          h->key_len) != 0){
+                                        continue;
+                                }
+                                if(matches[p] == 0 || et->rules[s] < matches[p]){
+                                        matches[p] = et->rules[s];
+                                }
+                                break;
+                        }
+                }
+        }
+}
@@ -0,0 +1,813 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Packet input and classification output. Both streams move data in blocks of
+ * IO_BLOCK bytes through a ring of IO_DEPTH buffers. With io_uring the reads of
+ * the next few input blocks and the writes of finished output blocks are in
+ * flight while the engines classify the current one, and the buffers are
+ * registered with the kernel up front so it doesn't have to map them for every
+ * request. Without io_uring each block is read or written with a plain system
+ * call when it is needed.
+ *
+ * Regular files are read and written at explicit offsets, so several requests
+ * can be outstanding at once. Pipes and other streams have no offsets and
+ * requests on them could complete out of order, so only one request at a time
+ * is in flight on them.
+ *
+ * liburing is not needed, the rings are driven with the raw system calls.
+ *
+ * With -I mmap an input file is mapped into memory instead, MMAP_WINDOW bytes
+ * at a time, and the engines read packets straight from the page cache. Each
+ * window starts at the page holding the first packet not yet taken, so a
+ * packet split across windows is simply mapped again whole. Input that isn't
+ * a regular file is read as usual. */
+
+#include "grouper.h"
+#include <linux/io_uring.h>     /* For the io_uring interface */
+#include <sys/syscall.h>        /* For syscall() */
+#include <sys/mman.h>           /* For mmap() */
+#include <sys/stat.h>           /* For fstat() */
+#include <sys/uio.h>            /* For struct iovec */
+#include <fcntl.h>              /* For posix_fadvise() */
+
+#define IO_ENTRIES (2 * IO_DEPTH) /* Submission queue entries of a ring */
+#define NO_OFFSET ((uint64_t) -1) /* Offset of requests on streams */
+#define MATCH_TEXT 21             /* Longest line of output: 20 digits of a
+                                   * uint64_t and a newline */
+
+/* An io_uring instance */
+typedef struct {
+        int fd;
+        unsigned * sq_tail;
+        unsigned * sq_mask;
+        unsigned * sq_array;
+        unsigned * cq_head;
+        unsigned * cq_tail;
+        unsigned * cq_mask;
+        struct io_uring_sqe * sqes;
+        struct io_uring_cqe * cqes;
+        void * sq_ring;
+        void * cq_ring;
+        size_t sq_size;
+        size_t cq_size;
+        size_t sqes_size;
+        unsigned queued;        /* Requests not yet submitted */
+        bool fixed;             /* Whether the buffers are registered */
+} uring;
+
+/* States of a buffer */
+typedef enum {
+        BUF_FREE,               /* Not in use */
+        BUF_QUEUED,             /* Holds output waiting to be written */
+        BUF_BUSY,               /* A request on it is in flight */
+        BUF_READY               /* Holds input read in */
+} buf_state;
+
+/* One block sized buffer of a stream */
+typedef struct {
+        uint8_t * data;
+        size_t len;             /* Bytes read into it or to be written */
+        size_t done;            /* Bytes of a write already written */
+        uint64_t offset;        /* File offset of its data */
+        buf_state state;
+} io_buffer;
+
+/* What the streams have in common */
+typedef struct {
+        int fd;
+        bool seekable;          /* Whether it is a regular file */
+        uint64_t offset;        /* File offset of the next request */
+        uint64_t inflight;      /* Requests in flight */
+        bool use_uring;
+        uring ring;
+        uint8_t * region;       /* Memory of all of the buffers */
+        size_t region_size;
+        io_buffer bufs[IO_DEPTH];
+        long wait;              /* Microseconds spent waiting on I/O */
+} io_stream;
+
+struct INPUT_STREAM {
+        io_stream s;
+        uint64_t pl;            /* Packet length */
+        uint64_t next;          /* Buffer to be read into next */
+        uint64_t cur;           /* Buffer packets are taken from */
+        bool started;           /* Whether cur holds any input yet */
+        bool eof;               /* Whether the end of input was read */
+        const uint8_t * pos;    /* Next packet in cur */
+        uint64_t avail;         /* Whole packets left in cur */
+        uint64_t tail;          /* Bytes of a partial packet after them */
+        uint8_t * carry;        /* Partial packet carried to the next block */
+        bool mapped;            /* Whether the file is mapped instead */
+        uint8_t * map;          /* Window of the file mapped, or NULL */
+        size_t map_len;
+        uint64_t map_start;     /* File offset of the window */
+        uint64_t size;          /* Size of the file when it was opened */
+};
+
+struct OUTPUT_STREAM {
+        io_stream s;
+        uint64_t cur;           /* Buffer being filled */
+        uint64_t next;          /* Oldest buffer queued for writing */
+        const rule_actions * actions; /* Actions to write instead of rules,
+                                       * or NULL */
+};
+
+/************************** io_uring  *************************/
+
+/* Sets up a ring, returning false if io_uring is unavailable */
+static bool uring_init(uring * r)
+{
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        memset(r, 0, sizeof(*r));
+        r->fd = syscall(__NR_io_uring_setup, IO_ENTRIES, &p);
+        if(r->fd < 0) return false;
+
+        r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single){
+                r->sq_size = r->cq_size = r->sq_size > r->cq_size ? r->sq_size
+                                                                 : r->cq_size;
+        }
+        r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+        r->cq_ring = single ? r->sq_ring :
+                mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+           r->sqes == MAP_FAILED){
+                close(r->fd);
+                return false;
+        }
+
+        uint8_t * sq = r->sq_ring;
+        uint8_t * cq = r->cq_ring;
+        r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+        r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+        r->sq_array = (unsigned *) (sq + p.sq_off.array);
+        r->cq_head = (unsigned *) (cq + p.cq_off.head);
+        r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+        r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+        return true;
+}
+
+/* Tears down a ring */
+static void uring_exit(uring * r)
+{
+        munmap(r->sqes, r->sqes_size);
+        if(r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_size);
+        munmap(r->sq_ring, r->sq_size);
+        close(r->fd);
+}
+
+/* Registers the buffers of a stream, so requests can use them without the
+ * kernel mapping them each time. Plain requests are used if this fails. */
+static void uring_register(uring * r, io_buffer bufs[IO_DEPTH])
+{
+        struct iovec iov[IO_DEPTH];
+        for(uint64_t i = 0; i < IO_DEPTH; ++i){
+                iov[i].iov_base = bufs[i].data;
+                iov[i].iov_len = IO_BLOCK;
+        }
+        r->fixed = syscall(__NR_io_uring_register, r->fd,
+                           IORING_REGISTER_BUFFERS, iov, IO_DEPTH) == 0;
+}
+
+/* Queues a read or write of len bytes at addr, which lies in buffer i */
+static void uring_queue(uring * r, bool writing, int fd, uint64_t i,
+                        uint8_t * addr, size_t len, uint64_t offset)
+{
+        unsigned tail = *r->sq_tail;
+        unsigned idx = tail & *r->sq_mask;
+        struct io_uring_sqe * sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        if(r->fixed){
+                sqe->opcode = writing ? IORING_OP_WRITE_FIXED
+                                      : IORING_OP_READ_FIXED;
+                sqe->buf_index = i;
+        }else{
+                sqe->opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) addr;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+        __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        r->queued++;
+}
+
+/* Submits queued requests, waiting for at least one completion if wait is
+ * set */
+static void uring_enter(uring * r, bool wait)
+{
+        for(;;){
+                int ret = syscall(__NR_io_uring_enter, r->fd, r->queued,
+                                  wait ? 1 : 0,
+                                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+                if(ret >= 0){
+                        r->queued -= ret;
+                        return;
+                }
+                if(errno != EINTR){
+                        Error("io_uring_enter failed! errno = %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+/* Takes a completion off the ring if there is one, giving the buffer it was for
+ * and its result */
+static bool uring_reap(uring * r, uint64_t * i, int64_t * res)
+{
+        unsigned head = *r->cq_head;
+        if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return false;
+        struct io_uring_cqe * cqe = &r->cqes[head & *r->cq_mask];
+        *i = cqe->user_data;
+        *res = cqe->res;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+}
+
+/************************** Streams  *************************/
+
+/* Sets up the buffers and backend of a stream on fd. pad bytes are left free
+ * in front of every buffer. */
+static void stream_init(io_stream * s, int fd, size_t pad)
+{
+        struct stat st;
+        memset(s, 0, sizeof(*s));
+        s->fd = fd;
+        s->seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if(s->seekable){
+                off_t pos = lseek(fd, 0, SEEK_CUR);
+                s->offset = pos < 0 ? 0 : pos;
+        }
+
+        pad = CACHE_LINE * ceil_div(pad, CACHE_LINE);
+        s->region_size = IO_DEPTH * (pad + IO_BLOCK);
+        s->region = mmap(NULL, s->region_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(s->region == MAP_FAILED){
+                Error("Could not map memory for I/O buffers! errno = %d\n",
+                      errno);
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t i = 0; i < IO_DEPTH; ++i){
+                s->bufs[i].data = s->region + i * (pad + IO_BLOCK) + pad;
+                s->bufs[i].state = BUF_FREE;
+        }
+
+        if(opts.io != IO_PLAIN){
+                s->use_uring = uring_init(&s->ring);
+                if(!s->use_uring && opts.io == IO_URING){
+                        Error("io_uring is not available. Falling back to "
+                              "read and write.\n");
+                }
+        }
+        if(s->use_uring) uring_register(&s->ring, s->bufs);
+}
+
+/* Frees a stream, returning the microseconds spent waiting on it */
+static long stream_free(io_stream * s)
+{
+        if(s->use_uring) uring_exit(&s->ring);
+        munmap(s->region, s->region_size);
+        return s->wait;
+}
+
+/* Waits for a request on a stream to complete */
+static void stream_wait(io_stream * s, uint64_t * i, int64_t * res)
+{
+        profile_t waited;
+        start_timing(&waited);
+        const uint64_t started = timeline_start();
+        while(!uring_reap(&s->ring, i, res)){
+                uring_enter(&s->ring, true);
+        }
+        s->inflight--;
+        timeline_end("io wait", started, NULL, 0);
+        s->wait += end_timing(&waited);
+}
+
+/* Reads or writes the rest of a request that came up short, the plain way */
+static size_t stream_finish(io_stream * s, bool writing, uint8_t * data,
+                            size_t done, size_t len, uint64_t offset)
+{
+        while(done < len){
+                ssize_t ret;
+                if(s->seekable){
+                        ret = writing ? pwrite(s->fd, data + done, len - done,
+                                               offset + done)
+                                      : pread(s->fd, data + done, len - done,
+                                              offset + done);
+                }else{
+                        ret = writing ? write(s->fd, data + done, len - done)
+                                      : read(s->fd, data + done, len - done);
+                }
+                if(ret < 0 && errno == EINTR) continue;
+                if(ret < 0){
+                        Error("Could not %s! errno = %d\n",
+                              writing ? "write output" : "read input", errno);
+                        exit(EXIT_FAILURE);
+                }
+                if(ret == 0) break;
+                done += ret;
+                /* Streams give what they have, that's enough for input */
+                if(!writing && !s->seekable) break;
+        }
+        return done;
+}
+
+/************************** Input  *************************/
+
+/* Opens a stream of packets of pl bytes on fd */
+input_stream * input_open(int fd, uint64_t pl)
+{
+        input_stream * in = calloc(1, sizeof(input_stream));
+        uint8_t * carry = malloc(pl);
+        if(in == NULL || carry == NULL){
+                Error("Could not allocate memory for input stream!\n");
+                exit(EXIT_FAILURE);
+        }
+        /* Files that report no size, like those in /proc, are read instead */
+        struct stat st;
+        if(opts.io == IO_MMAP && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+           st.st_size > 0){
+                off_t pos = lseek(fd, 0, SEEK_CUR);
+                in->s.fd = fd;
+                in->s.seekable = true;
+                in->s.offset = pos < 0 ? 0 : pos;
+                in->mapped = true;
+                in->size = st.st_size;
+                in->pl = pl;
+                in->carry = carry;
+                posix_fadvise(fd, in->s.offset, 0, POSIX_FADV_SEQUENTIAL);
+                return in;
+        }
+        /* Room for a partial packet in front of each block */
+        stream_init(&in->s, fd, pl);
+        in->pl = pl;
+        in->carry = carry;
+        return in;
+}
+
+/* Queues reads into as many free buffers as there can be requests in flight */
+static void input_submit(input_stream * in)
+{
+        io_stream * s = &in->s;
+        bool queued = false;
+        while(!in->eof && s->bufs[in->next].state == BUF_FREE &&
+              (s->seekable || s->inflight == 0)){
+                io_buffer * buf = &s->bufs[in->next];
+                buf->offset = s->seekable ? s->offset : NO_OFFSET;
+                uring_queue(&s->ring, false, s->fd, in->next, buf->data,
+                            IO_BLOCK, buf->offset);
+                if(s->seekable) s->offset += IO_BLOCK;
+                buf->state = BUF_BUSY;
+                s->inflight++;
+                in->next = (in->next + 1) % IO_DEPTH;
+                queued = true;
+        }
+        if(queued) uring_enter(&s->ring, false);
+}
+
+/* Waits for the read into buffer i and leaves its length in the buffer */
+static void input_fill(input_stream * in, uint64_t i)
+{
+        io_stream * s = &in->s;
+        io_buffer * buf = &s->bufs[i];
+        if(!s->use_uring){
+                profile_t waited;
+                start_timing(&waited);
+                const uint64_t started = timeline_start();
+                buf->len = stream_finish(s, false, buf->data, 0, IO_BLOCK,
+                                         s->offset);
+                s->offset += buf->len;
+                timeline_end("read", started, "bytes", buf->len);
+                s->wait += end_timing(&waited);
+                buf->state = BUF_READY;
+                return;
+        }
+        while(buf->state != BUF_READY){
+                uint64_t j;
+                int64_t res;
+                input_submit(in);
+                stream_wait(s, &j, &res);
+                if(res < 0 && res != -EINTR && res != -EAGAIN){
+                        Error("Could not read input! errno = %d\n", (int) -res);
+                        exit(EXIT_FAILURE);
+                }
+                io_buffer * done = &s->bufs[j];
+                if(res < 0){
+                        /* Try again */
+                        uring_queue(&s->ring, false, s->fd, j, done->data,
+                                    IO_BLOCK, done->offset);
+                        uring_enter(&s->ring, false);
+                        s->inflight++;
+                        continue;
+                }
+                done->len = res;
+                /* Blocks of a file must be whole for the next one to follow on,
+                 * a short one is only expected at the end */
+                if(s->seekable && res > 0 && res < IO_BLOCK){
+                        done->len = stream_finish(s, false, done->data, res,
+                                                  IO_BLOCK, done->offset);
+                }
+                done->state = BUF_READY;
+        }
+}
+
+/* Maps the window of the file starting at the first packet not yet taken,
+ * returning false at the end of the file */
+static bool map_advance(input_stream * in)
+{
+        io_stream * s = &in->s;
+        if(in->map != NULL){
+                s->offset = in->map_start + (in->pos - in->map);
+                munmap(in->map, in->map_len);
+                in->map = NULL;
+        }
+        in->avail = 0;
+        /* A trailing partial packet is dropped */
+        if(in->eof || in->size < s->offset + in->pl){
+                in->eof = true;
+                return false;
+        }
+
+        profile_t time;
+        start_timing(&time);
+        const uint64_t started = timeline_start();
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        in->map_start = s->offset - s->offset % page;
+        in->map_len = min(in->size - in->map_start,
+                          max(MMAP_WINDOW, s->offset - in->map_start + in->pl));
+        in->map = mmap(NULL, in->map_len, PROT_READ, MAP_PRIVATE, s->fd,
+                       in->map_start);
+        if(in->map == MAP_FAILED){
+                Error("Could not map input file! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        /* Start reading the whole window in, in order */
+        madvise(in->map, in->map_len, MADV_SEQUENTIAL);
+        madvise(in->map, in->map_len, MADV_WILLNEED);
+        timeline_end("map input", started, "bytes", in->map_len);
+        s->wait += end_timing(&time);
+
+        in->pos = in->map + (s->offset - in->map_start);
+        in->avail = (in->map_len - (s->offset - in->map_start)) / in->pl;
+        return true;
+}
+
+/* Moves on to the next block of input, carrying over any partial packet at
+ * the end of the current one. Returns false at the end of input. */
+static bool input_advance(input_stream * in)
+{
+        io_stream * s = &in->s;
+        if(in->mapped) return map_advance(in);
+        if(in->started){
+                memcpy(in->carry, in->pos, in->tail);
+                s->bufs[in->cur].state = BUF_FREE;
+                in->cur = (in->cur + 1) % IO_DEPTH;
+        }
+        if(in->eof) return false;
+        if(!s->use_uring) in->next = in->cur;
+
+        input_fill(in, in->cur);
+        io_buffer * buf = &s->bufs[in->cur];
+        in->started = true;
+        if(buf->len == 0){
+                /* A trailing partial packet is dropped */
+                in->eof = true;
+                in->avail = in->tail = 0;
+                return false;
+        }
+        uint8_t * start = buf->data - in->tail;
+        memcpy(start, in->carry, in->tail);
+        uint64_t total = in->tail + buf->len;
+        in->pos = start;
+        in->avail = total / in->pl;
+        in->tail = total % in->pl;
+        return true;
+}
+
+/* Returns up to max packets of input in *packets, contiguous in memory. They
+ * stay valid until the next call. Returns 0 at the end of input. */
+uint64_t input_next(input_stream * in, const uint8_t ** packets, uint64_t max)
+{
+        while(in->avail == 0){
+                if(!input_advance(in)) return 0;
+        }
+        uint64_t count = min(in->avail, max);
+        *packets = in->pos;
+        in->pos += count * in->pl;
+        in->avail -= count;
+        return count;
+}
+
+/* Copies up to max packets of input to dst, returning how many, like fread */
+uint64_t input_read(input_stream * in, uint8_t * dst, uint64_t max)
+{
+        uint64_t count = 0;
+        const uint8_t * packets;
+        uint64_t got;
+        while(count < max && (got = input_next(in, &packets, max - count)) > 0){
+                memcpy(dst + count * in->pl, packets, got * in->pl);
+                count += got;
+        }
+        return count;
+}
+
+/* Closes an input stream, returning the microseconds spent waiting on it */
+long input_close(input_stream * in)
+{
+        io_stream * s = &in->s;
+        if(in->mapped){
+                if(in->map != NULL) munmap(in->map, in->map_len);
+                long wait = s->wait;
+                free(in->carry);
+                free(in);
+                return wait;
+        }
+        /* Reads past the end may still be in flight */
+        while(s->use_uring && s->inflight > 0){
+                uint64_t i;
+                int64_t res;
+                stream_wait(s, &i, &res);
+        }
+        long wait = stream_free(s);
+        free(in->carry);
+        free(in);
+        return wait;
+}
+
+/************************** Output  *************************/
+
+/* Opens an output stream on fd */
+output_stream * output_open(int fd)
+{
+        output_stream * out = calloc(1, sizeof(output_stream));
+        if(out == NULL){
+                Error("Could not allocate memory for output stream!\n");
+                exit(EXIT_FAILURE);
+        }
+        stream_init(&out->s, fd, 0);
+        return out;
+}
+
+/* Submits writes of the queued buffers in order, as many as may be in flight */
+static void output_submit(output_stream * out)
+{
+        io_stream * s = &out->s;
+        bool queued = false;
+        while(s->bufs[out->next].state == BUF_QUEUED &&
+              (s->seekable || s->inflight == 0)){
+                io_buffer * buf = &s->bufs[out->next];
+                buf->done = 0;
+                buf->offset = s->seekable ? s->offset : NO_OFFSET;
+                if(s->seekable) s->offset += buf->len;
+                uring_queue(&s->ring, true, s->fd, out->next, buf->data,
+                            buf->len, buf->offset);
+                buf->state = BUF_BUSY;
+                s->inflight++;
+                out->next = (out->next + 1) % IO_DEPTH;
+                queued = true;
+        }
+        if(queued) uring_enter(&s->ring, false);
+}
+
+/* Waits for a write to complete, resubmitting the rest of it if it came up
+ * short */
+static void output_complete(output_stream * out)
+{
+        io_stream * s = &out->s;
+        uint64_t i;
+        int64_t res;
+        stream_wait(s, &i, &res);
+        io_buffer * buf = &s->bufs[i];
+        if(res < 0 && res != -EINTR && res != -EAGAIN){
+                Error("Could not write output! errno = %d\n", (int) -res);
+                exit(EXIT_FAILURE);
+        }
+        if(res > 0) buf->done += res;
+        if(buf->done < buf->len){
+                /* Nothing else was written to a stream in the meantime, so
+                 * the rest can simply follow */
+                uring_queue(&s->ring, true, s->fd, i, buf->data + buf->done,
+                            buf->len - buf->done,
+                            s->seekable ? buf->offset + buf->done : NO_OFFSET);
+                uring_enter(&s->ring, false);
+                s->inflight++;
+                return;
+        }
+        buf->state = BUF_FREE;
+        output_submit(out);
+}
+
+/* Writes out the buffer being filled and moves on to the next one */
+static void output_flush(output_stream * out)
+{
+        io_stream * s = &out->s;
+        io_buffer * buf = &s->bufs[out->cur];
+        if(buf->len == 0) return;
+        if(!s->use_uring){
+                profile_t waited;
+                start_timing(&waited);
+                const uint64_t started = timeline_start();
+                stream_finish(s, true, buf->data, 0, buf->len, s->offset);
+                s->offset += buf->len;
+                timeline_end("write", started, "bytes", buf->len);
+                s->wait += end_timing(&waited);
+                buf->len = 0;
+                return;
+        }
+        buf->state = BUF_QUEUED;
+        output_submit(out);
+        out->cur = (out->cur + 1) % IO_DEPTH;
+        while(s->bufs[out->cur].state != BUF_FREE){
+                output_complete(out);
+        }
+        s->bufs[out->cur].len = 0;
+}
+
+/* Returns room for at least len bytes of output, to be claimed with
+ * output_commit */
+char * output_space(output_stream * out, size_t len)
+{
+        io_buffer * buf = &out->s.bufs[out->cur];
+        if(buf->len + len > IO_BLOCK){
+                output_flush(out);
+                buf = &out->s.bufs[out->cur];
+        }
+        return (char *) buf->data + buf->len;
+}
+
+/* Claims len bytes written to the room returned by output_space */
+void output_commit(output_stream * out, size_t len)
+{
+        out->s.bufs[out->cur].len += len;
+}
+
+/* The two digits of every number below 100 */
+static const char digit_pairs[200] =
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+
+/* Writes value in decimal followed by after, returning the length. Digits
+ * are produced two at a time from digit_pairs, from the right. */
+static inline size_t format_value(char * text, uint64_t value, char after)
+{
+        char digits[MATCH_TEXT];
+        char * end = digits + sizeof(digits);
+        char * p = end;
+        *--p = after;
+        while(value >= 100){
+                uint64_t pair = value % 100;
+                value /= 100;
+                p -= 2;
+                memcpy(p, &digit_pairs[2 * pair], 2);
+        }
+        if(value >= 10){
+                p -= 2;
+                memcpy(p, &digit_pairs[2 * value], 2);
+        }else{
+                *--p = '0' + value;
+        }
+        size_t len = end - p;
+        memcpy(text, p, len);
+        return len;
+}
+
+/* Writes the action of each match instead of its rule */
+void output_actions(output_stream * out, const rule_actions * actions)
+{
+        out->actions = actions;
+}
+
+/* Writes the action of the rule matched by each of count packets, one per
+ * line. Names differ in length, so room is claimed a line at a time. */
+static uint64_t output_action_lines(output_stream * out,
+                                    const uint64_t * matches, uint64_t count)
+{
+        uint64_t no_match = 0;
+        for(uint64_t p = 0; p < count; ++p){
+                size_t len;
+                const char * name = action_name(out->actions, matches[p],
+                                                &len);
+                if(len + 1 > IO_BLOCK){
+                        Error("Action name too long to output!\n");
+                        exit(EXIT_FAILURE);
+                }
+                char * text = output_space(out, len + 1);
+                memcpy(text, name, len);
+                text[len] = '\n';
+                output_commit(out, len + 1);
+                no_match += matches[p] == 0;
+        }
+        return no_match;
+}
+
+/* Writes the rule matched by each of count packets, one per line, or its
+ * action if the stream has actions. Room is claimed for as many lines at a
+ * time as fit in a block. */
+void output_matches(output_stream * out, const uint64_t * matches,
+                    uint64_t count)
+{
+        const uint64_t per_block = IO_BLOCK / MATCH_TEXT;
+        uint64_t no_match = 0;
+        if(out->actions != NULL){
+                no_match = output_action_lines(out, matches, count);
+        }else{
+                for(uint64_t p = 0; p < count; ){
+                        uint64_t lines = min(count - p, per_block);
+                        char * text = output_space(out, lines * MATCH_TEXT);
+                        size_t len = 0;
+                        for(uint64_t end = p + lines; p < end; ++p){
+                                len += format_value(text + len,
+                                                    matches[p], '\n');
+                                no_match += matches[p] == 0;
+                        }
+                        output_commit(out, len);
+                }
+        }
+        /* Only the thread writing output changes the counts */
+        __atomic_store_n(&stats.packets, stats.packets + count,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.no_match, stats.no_match + no_match,
+                         __ATOMIC_RELAXED);
+}
+
+/* Writes the rules matched by each of count packets against several
+ * policies, a line per packet with the rule matched under each policy
+ * separated by spaces. matches[k * count + p] is the match of packet p under
+ * policy k. A packet counts as matching no rule if it matches none under any
+ * policy. */
+void output_columns(output_stream * out, const uint64_t * matches,
+                    uint64_t count, uint64_t columns)
+{
+        const uint64_t per_block = IO_BLOCK / (MATCH_TEXT * columns);
+        uint64_t no_match = 0;
+        for(uint64_t p = 0; p < count; ){
+                uint64_t lines = min(count - p, per_block);
+                char * text = output_space(out, lines * MATCH_TEXT * columns);
+                size_t len = 0;
+                for(uint64_t end = p + lines; p < end; ++p){
+                        bool matched = false;
+                        for(uint64_t k = 0; k < columns; ++k){
+                                const uint64_t match = matches[k * count + p];
+                                len += format_value(text + len, match,
+                                                    k + 1 < columns ? ' '
+                                                                    : '\n');
+                                matched = matched || match != 0;
+                        }
+                        no_match += !matched;
+                }
+                output_commit(out, len);
+        }
+        __atomic_store_n(&stats.packets, stats.packets + count,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.no_match, stats.no_match + no_match,
+                         __ATOMIC_RELAXED);
+}
+
+/* Flushes and closes an output stream, returning the microseconds spent
+ * waiting on it */
+long output_close(output_stream * out)
+{
+        io_stream * s = &out->s;
+        output_flush(out);
+        while(s->use_uring && s->inflight > 0){
+                output_complete(out);
+        }
+        /* Leave the file where stdio would have */
+        if(s->seekable) lseek(s->fd, s->offset, SEEK_SET);
+        long wait = stream_free(s);
+        free(out);
+        return wait;
+}
@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Latency of classification. Every so many groups of packets, the time taken to
+ * classify the group is recorded once for each packet in it, since each of them
+ * waited for the whole group. With shards, the time from reading a batch to
+ * writing its matches is recorded instead.
+ *
+ * Latencies go into a log-linear histogram, as in HdrHistogram: values below
+ * 2 * LATENCY_SUB are counted exactly, and above that every power of two is
+ * split into LATENCY_SUB equal buckets, so a value is always known to within
+ * 1 / LATENCY_SUB of itself while the whole range of a uint64_t takes only a
+ * few thousand counters. */
+
+#include "grouper.h"
+#include <signal.h>             /* For sigaction() */
+#include <time.h>               /* For clock_gettime() */
+
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+
+latency_histogram latency;
+
+/* Set by SIGUSR2 to ask for the latencies so far */
+static volatile sig_atomic_t report_requested = 0;
+
+static void request_report(int sig)
+{
+        (void) sig;
+        report_requested = 1;
+}
+
+/* Starts recording the latency of one group in every every, and reporting it
+ * when SIGUSR2 is received */
+void latency_init(uint64_t every)
+{
+        memset(&latency, 0, sizeof(latency));
+        latency.every = every;
+        latency.countdown = every;
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = request_report;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR2, &sa, NULL);
+}
+
+/* Returns the monotonic time in nanoseconds */
+uint64_t now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Returns the bucket a value is counted in */
+static uint64_t bucket_of(uint64_t value)
+{
+        if(value < 2 * LATENCY_SUB) return value;
+        uint64_t shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+        return shift * LATENCY_SUB + (value >> shift);
+}
+
+/* Returns the highest value counted in a bucket */
+static uint64_t bucket_value(uint64_t bucket)
+{
+        if(bucket < 2 * LATENCY_SUB) return bucket;
+        uint64_t shift = bucket / LATENCY_SUB - 1;
+        uint64_t sub = bucket % LATENCY_SUB + LATENCY_SUB;
+        return (sub << shift) + ((UINT64_C(1) << shift) - 1);
+}
+
+/* Records a latency of ns nanoseconds for each of count packets */
+void latency_record(uint64_t ns, uint64_t count)
+{
+        latency.counts[bucket_of(ns)] += count;
+        latency.total += count;
+        if(ns > latency.max) latency.max = ns;
+}
+
+/* Returns the latency below which p percent of the packets recorded fall */
+static uint64_t percentile(double p)
+{
+        uint64_t rank = ceil(p / 100 * latency.total);
+        if(rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for(uint64_t b = 0; b < LATENCY_BUCKETS; ++b){
+                seen += latency.counts[b];
+                if(seen >= rank) return min(bucket_value(b), latency.max);
+        }
+        return latency.max;
+}
+
+/* Adds the latency percentiles to a timing record */
+void latency_print(FILE * f)
+{
+        if(latency.total == 0) return;
+        fprintf(f, ", 'latency_samples' : %"PRIu64", 'latency_p50' : %"PRIu64
+                ", 'latency_p99' : %"PRIu64", 'latency_p999' : %"PRIu64
+                ", 'latency_max' : %"PRIu64, latency.total, percentile(50),
+                percentile(99), percentile(99.9), latency.max);
+}
+
+/* Prints the latencies so far if SIGUSR2 has asked for them */
+void latency_poll(void)
+{
+        if(!report_requested) return;
+        report_requested = 0;
+        fprintf(stderr, "{ 'latency_every' : %"PRIu64, latency.every);
+        latency_print(stderr);
+        fprintf(stderr, " }\n");
+}
@@ -0,0 +1,190 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Lazy tables are allocated but not filled when they are built; a row is only
+ * built the first time a packet needs it. The tables come from calloc, which
+ * maps large blocks fresh from the kernel, so pages holding rows no packet
+ * needs are never touched.
+ *
+ * Every row slot (numbered as in locate_rows, even tables first) has a claimed
+ * bit and a ready bit. The first thread to set a slot's claimed bit builds the
+ * row and then sets its ready bit; any other thread wanting the row waits for
+ * the ready bit, which only takes as long as one row takes to build. Optional
+ * background threads build rows no packet has asked for yet, and once every
+ * row is built the bits are no longer checked at all. */
+
+#include "grouper.h"
+
+struct LAZY_TABLES {
+        table_dims dims;
+        uint8_t * even_tables;
+        uint8_t * odd_tables;
+        section_masks * masks;  /* Masks of every section, even ones first */
+        uint64_t rows;          /* Number of row slots */
+        uint64_t * claimed;     /* Bit per slot, set once a row is started */
+        uint64_t * ready;       /* Bit per slot, set once a row is built */
+        uint64_t built;         /* Rows built so far */
+        bool complete;          /* Whether every row is built */
+        bool stop;              /* Tells the background threads to finish */
+        uint64_t nthreads;
+        pthread_t threads[MAX_LAZY_THREADS];
+        uint64_t first[MAX_LAZY_THREADS]; /* Slot each thread starts at */
+};
+
+/* Arguments to a background thread */
+typedef struct {
+        lazy_tables * lt;
+        uint64_t k;             /* Which thread it is */
+} lazy_args;
+
+/* Builds the row in slot, unless another thread already has */
+static void build_slot(lazy_tables * lt, uint64_t slot)
+{
+        const uint64_t word = slot / 64;
+        const uint64_t bit = UINT64_C(1) << (slot % 64);
+        if(__atomic_fetch_or(&lt->claimed[word], bit, __ATOMIC_ACQ_REL) & bit){
+                while(!(__atomic_load_n(&lt->ready[word], __ATOMIC_ACQUIRE)
+                        & bit)){
+                        /* Spin, the row is nearly done */
+                }
+                return;
+        }
+
+        const table_dims d = lt->dims;
+        const uint64_t even_slots = d.even_h * d.even_d;
+        uint8_t * row;
+        uint64_t section, index;
+        if(slot < even_slots){
+                row = lt->even_tables + slot * d.bytewidth;
+                section = slot % d.even_d;
+                index = slot / d.even_d;
+        }else{
+                row = lt->odd_tables + (slot - even_slots) * d.bytewidth;
+                section = d.even_d + (slot - even_slots) % d.odd_d;
+                index = (slot - even_slots) / d.odd_d;
+        }
+        build_row(&lt->masks[section], index, row);
+
+        __atomic_fetch_or(&lt->ready[word], bit, __ATOMIC_RELEASE);
+        if(__atomic_add_fetch(&lt->built, 1, __ATOMIC_RELAXED) == lt->rows){
+                __atomic_store_n(&lt->complete, true, __ATOMIC_RELEASE);
+        }
+}
+
+/* Makes sure the row in a slot has been built */
+void lazy_ensure(lazy_tables * lt, uint64_t slot)
+{
+        if(__atomic_load_n(&lt->ready[slot / 64], __ATOMIC_ACQUIRE)
+           & (UINT64_C(1) << (slot % 64))){
+                return;
+        }
+        build_slot(lt, slot);
+}
+
+/* Returns whether every row has been built, so no more need checking */
+bool lazy_complete(const lazy_tables * lt)
+{
+        return __atomic_load_n(&lt->complete, __ATOMIC_ACQUIRE);
+}
+
+/* Background thread building every row not yet built, from its own starting
+ * point so the threads don't all contend for the same rows */
+static void * fill_thread(void * args)
+{
+        lazy_tables * lt = ((lazy_args *) args)->lt;
+        const uint64_t first = lt->first[((lazy_args *) args)->k];
+        free(args);
+        for(uint64_t i = 0; i < lt->rows; ++i){
+                if(__atomic_load_n(&lt->stop, __ATOMIC_RELAXED)) break;
+                uint64_t slot = (first + i) % lt->rows;
+                if(__atomic_load_n(&lt->claimed[slot / 64], __ATOMIC_RELAXED)
+                   & (UINT64_C(1) << (slot % 64))){
+                        continue;
+                }
+                build_slot(lt, slot);
+        }
+        return NULL;
+}
+
+/* Sets up lazy filling of the zeroed tables of ts, with nthreads threads
+ * building rows in the background */
+lazy_tables * lazy_new(policy pol, table_set * ts, uint64_t nthreads)
+{
+        const table_dims d = ts->dims;
+        lazy_tables * lt = calloc(1, sizeof(lazy_tables));
+        if(lt == NULL){
+                Error("Could not allocate memory for lazy tables!\n");
+                exit(EXIT_FAILURE);
+        }
+        lt->dims = d;
+        lt->even_tables = ts->even_tables;
+        lt->odd_tables = ts->odd_tables;
+        lt->rows = table_rows(d);
+        lt->claimed = calloc(ceil_div(lt->rows, 64), sizeof(uint64_t));
+        lt->ready = calloc(ceil_div(lt->rows, 64), sizeof(uint64_t));
+        lt->masks = malloc((d.even_d + d.odd_d) * sizeof(section_masks));
+        if(lt->claimed == NULL || lt->ready == NULL || lt->masks == NULL){
+                Error("Could not allocate memory for lazy tables!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t i = 0; i < d.even_d; ++i){
+                lt->masks[i] = get_section_masks(pol, i * d.even_s, d.even_s);
+        }
+        const uint64_t offset = d.even_d * d.even_s;
+        for(uint64_t i = 0; i < d.odd_d; ++i){
+                lt->masks[d.even_d + i] = get_section_masks(pol,
+                                                            offset + i * d.odd_s,
+                                                            d.odd_s);
+        }
+
+        lt->nthreads = min(nthreads, MAX_LAZY_THREADS);
+        for(uint64_t k = 0; k < lt->nthreads; ++k){
+                lazy_args * args = malloc(sizeof(lazy_args));
+                if(args == NULL){
+                        Error("Could not allocate memory for lazy tables!\n");
+                        exit(EXIT_FAILURE);
+                }
+                args->lt = lt;
+                args->k = k;
+                lt->first[k] = k * lt->rows / lt->nthreads;
+                pthread_create(&lt->threads[k], NULL, fill_thread, args);
+        }
+        return lt;
+}
+
+/* Stops the background threads and frees the bookkeeping, but not the tables,
+ * adding the rows built and the rows there are to *built and *rows */
+void lazy_free(lazy_tables * lt, uint64_t * built, uint64_t * rows)
+{
+        __atomic_store_n(&lt->stop, true, __ATOMIC_RELAXED);
+        for(uint64_t k = 0; k < lt->nthreads; ++k){
+                pthread_join(lt->threads[k], NULL);
+        }
+        *built += lt->built;
+        *rows += lt->rows;
+        for(uint64_t i = 0; i < lt->dims.even_d + lt->dims.odd_d; ++i){
+                free_section_masks(&lt->masks[i]);
+        }
+        free(lt->masks);
+        free(lt->claimed);
+        free(lt->ready);
+        free(lt);
+}
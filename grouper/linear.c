@@ -0,0 +1,206 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Classification while the tables are built. The tables are built on a
+ * thread of their own, and in the meantime packets are classified by checking
+ * them against every rule in turn, a 64 bit word at a time. That is far
+ * slower per packet than the tables, but it starts at once, so input doesn't
+ * back up behind a long build. As soon as the tables are done the rest of the
+ * input goes to read_input_and_classify. */
+
+#include "grouper.h"
+
+/* The masks of every rule as words, for the linear scan */
+struct LINEAR_RULES {
+        uint64_t n;             /* Number of rules */
+        uint64_t words;         /* Words per rule */
+        uint64_t bytes;         /* Bytes of a packet compared */
+        uint64_t * q;           /* n x words q masks */
+        uint64_t * b;           /* n x words b masks */
+};
+
+/* Arguments to the thread building the tables */
+typedef struct {
+        policy pol;
+        uint64_t t;             /* As for build_tables */
+        uint64_t bitwidth;
+        uint64_t m;
+        table_set * ts;
+        long build_time;        /* Microseconds the build took */
+        bool done;              /* Set once the tables are ready */
+} build_job;
+
+/* Packs the masks of a policy into words */
+linear_rules * linear_new(policy pol)
+{
+        linear_rules * lr = malloc(sizeof(linear_rules));
+        if(lr == NULL){
+                Error("Could not allocate memory for linear rules!\n");
+                exit(EXIT_FAILURE);
+        }
+        lr->n = pol.n;
+        lr->bytes = min(pol.B / BitsInByte, pol.pl);
+        lr->words = ceil_div(lr->bytes, sizeof(uint64_t));
+        lr->q = calloc(pol.n * lr->words, sizeof(uint64_t));
+        lr->b = calloc(pol.n * lr->words, sizeof(uint64_t));
+        if(lr->q == NULL || lr->b == NULL){
+                Error("Could not allocate memory for linear rules!\n");
+                exit(EXIT_FAILURE);
+        }
+        /* The masks are laid out like packets, so comparing them a word at a
+         * time is the same as comparing them a byte at a time. Like the
+         * tables, only the first b bits count, in the order extract_section
+         * takes them, which is from the least significant bit of each byte. */
+        const uint8_t last_mask = pol.b % BitsInByte == 0 ? 0xff
+                : (1 << (pol.b % BitsInByte)) - 1;
+        for(uint64_t w = 0; w < pol.n; ++w){
+                uint8_t * q = (uint8_t *) (lr->q + w * lr->words);
+                uint8_t * b = (uint8_t *) (lr->b + w * lr->words);
+                memcpy(q, pol.q_masks[w], lr->bytes);
+                memcpy(b, pol.b_masks[w], lr->bytes);
+                if(lr->bytes == pol.B / BitsInByte){
+                        q[lr->bytes - 1] &= last_mask;
+                        b[lr->bytes - 1] &= last_mask;
+                }
+        }
+        return lr;
+}
+
+/* Frees rules returned by linear_new */
+void linear_free(linear_rules * lr)
+{
+        free(lr->q);
+        free(lr->b);
+        free(lr);
+}
+
+/* Returns the bytes the packed rules take */
+uint64_t linear_bytes(const linear_rules * lr)
+{
+        return sizeof(linear_rules) + 2 * lr->n * lr->words * sizeof(uint64_t);
+}
+
+/* Returns whether a packet, as words, matches rule w */
+static inline bool linear_matches(const linear_rules * lr,
+                                  const uint64_t * packet,
+                                  uint64_t w)
+{
+        const uint64_t * q = lr->q + w * lr->words;
+        const uint64_t * b = lr->b + w * lr->words;
+        uint64_t i = 0;
+        while(i < lr->words && (packet[i] & q[i]) == b[i]) ++i;
+        return i == lr->words;
+}
+
+/* Checks a packet against count rules, listed 0 based and in order, returning
+ * one more than the first that matches or 0 if none does */
+uint64_t linear_first_match(const linear_rules * lr, const uint8_t * packet,
+                            const uint32_t * rules, uint64_t count)
+{
+        uint64_t words[lr->words];
+        words[lr->words - 1] = 0;
+        memcpy(words, packet, lr->bytes);
+        for(uint64_t i = 0; i < count; ++i){
+                if(linear_matches(lr, words, rules[i])) return rules[i] + 1;
+        }
+        return 0;
+}
+
+/* Classifies packets by checking each against every rule in order */
+void classify_linear(policy pol, const linear_rules * lr,
+                     const uint8_t * packets, uint64_t count,
+                     uint64_t matches[count])
+{
+        uint64_t packet[lr->words];
+        for(uint64_t p = 0; p < count; ++p){
+                packet[lr->words - 1] = 0;
+                memcpy(packet, packets + p * pol.pl, lr->bytes);
+                matches[p] = 0;
+                for(uint64_t w = 0; w < lr->n; ++w){
+                        if(linear_matches(lr, packet, w)){
+                                matches[p] = w + 1;
+                                break;
+                        }
+                }
+        }
+}
+
+/* Thread building the tables */
+static void * build_thread(void * args)
+{
+        build_job * job = args;
+        profile_t time;
+        start_timing(&time);
+        job->t = build_tables(job->pol, job->t, job->bitwidth, job->m, job->ts);
+        job->build_time = end_timing(&time);
+        stats_built(table_set_bytes(job->ts), job->build_time);
+        __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+/* Builds t tables for a policy into ts as build_tables does, classifying the
+ * input with a linear scan of the rules until they are ready and with the
+ * tables after. Returns the number of tables built and sets *build_time to the
+ * microseconds the build took. */
+uint64_t read_input_and_classify_building(policy pol, uint64_t t,
+                                          uint64_t bitwidth, uint64_t m,
+                                          table_set * ts, long * build_time,
+                                          input_stream * in,
+                                          output_stream * out)
+{
+        build_job job = {.pol = pol, .t = t, .bitwidth = bitwidth, .m = m,
+                         .ts = ts, .build_time = 0, .done = false};
+        pthread_t builder;
+        if(pthread_create(&builder, NULL, build_thread, &job) != 0){
+                Error("Could not start thread to build tables!\n");
+                exit(EXIT_FAILURE);
+        }
+
+        linear_rules * lr = linear_new(pol);
+        uint64_t * matches = malloc(opts.group_size * sizeof(uint64_t));
+        if(matches == NULL){
+                Error("Could not allocate memory for packet group!\n");
+                exit(EXIT_FAILURE);
+        }
+        const uint8_t * packets;
+        uint64_t count = 1;
+        while(!__atomic_load_n(&job.done, __ATOMIC_ACQUIRE) &&
+              (count = input_next(in, &packets, opts.group_size)) > 0){
+                const uint64_t started = timeline_start();
+                classify_linear(pol, lr, packets, count, matches);
+                if(pol.hybrid != NULL){
+                        hybrid_resolve(pol, packets, count, matches);
+                }
+                timeline_end("classify linear", started, "packets", count);
+                output_matches(out, matches, count);
+                counters.linear_packets += count;
+        }
+        free(matches);
+        linear_free(lr);
+
+        pthread_join(builder, NULL);
+        *build_time = job.build_time;
+        Trace("Classified %"PRIu64" packets while building tables.\n",
+              counters.linear_packets);
+        /* The rest of the input, if any, goes through the tables */
+        if(count > 0) read_input_and_classify(pol, ts, in, out);
+        return job.t;
+}
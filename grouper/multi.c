@@ -0,0 +1,208 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Several policies classified in one pass over the input, for instance a
+ * firewall and a QoS policy over the same packets. Each policy gets tables of
+ * its own, planned and built as for a policy on its own in a share of the
+ * memory, and each packet is read once and classified against all of them,
+ * writing a line with a column per policy.
+ *
+ * The memory is shared out in proportion to the rules times the bits of each
+ * policy, which is what the smallest tables of each take. Tables of different
+ * policies with the same sections, as policies of the same length with the
+ * same number of tables have, take the same section of each packet, so those
+ * are extracted once per packet and used for all of them. */
+
+#include "grouper.h"
+
+struct MULTI_POLICY {
+        uint64_t count;                 /* Number of policies */
+        policy pols[MAX_POLICIES];
+        table_set sets[MAX_POLICIES];
+        engine_t engines[MAX_POLICIES]; /* Engine each policy's tables took */
+        uint64_t layouts[MAX_POLICIES]; /* First policy whose tables have the
+                                         * same sections */
+};
+
+/* Returns whether two sets of tables take the same sections of a packet */
+static bool same_sections(table_dims a, table_dims b)
+{
+        return a.even_s == b.even_s && a.odd_s == b.odd_s &&
+                a.even_d == b.even_d && a.odd_d == b.odd_d;
+}
+
+/* Builds tables for count policies in m bits of memory in all. The policies'
+ * masks are freed once their tables are built. */
+multi_policy * multi_build(policy * pols, uint64_t count, uint64_t m)
+{
+        multi_policy * mp = calloc(1, sizeof(multi_policy));
+        if(mp == NULL){
+                Error("Could not allocate memory for policies!\n");
+                exit(EXIT_FAILURE);
+        }
+        mp->count = count;
+        double weight = 0;
+        for(uint64_t k = 0; k < count; ++k){
+                weight += (double) pols[k].N * pols[k].b;
+        }
+
+        const engine_t requested = opts.engine;
+        for(uint64_t k = 0; k < count; ++k){
+                policy pol = pols[k];
+                const uint64_t share = m * (pol.N * pol.b / weight);
+                opts.engine = requested;
+                uint64_t bitwidth;
+                uint64_t t = plan_tables(pol, share, &bitwidth);
+                /* A single table is classified on a path of its own, and two
+                 * fit wherever one does */
+                if(t == 1) t = 2;
+                t = build_tables(pol, t, bitwidth, share, &mp->sets[k]);
+                mp->engines[k] = opts.engine;
+                Trace("Policy %"PRIu64": %"PRIu64" rules in %"PRIu64" tables "
+                      "of %"PRIu64" bits\n", k, pol.n, t, share);
+                array2d_free(pol.q_masks);
+                array2d_free(pol.b_masks);
+                pol.q_masks = NULL;
+                pol.b_masks = NULL;
+                mp->pols[k] = pol;
+        }
+        opts.engine = requested;
+
+        counters.section_layouts = 0;
+        for(uint64_t k = 0; k < count; ++k){
+                mp->layouts[k] = k;
+                if(mp->sets[k].tree != NULL) continue;
+                for(uint64_t j = 0; j < k; ++j){
+                        if(mp->sets[j].tree == NULL &&
+                           same_sections(mp->sets[j].dims, mp->sets[k].dims)){
+                                mp->layouts[k] = j;
+                                break;
+                        }
+                }
+                counters.section_layouts += mp->layouts[k] == k;
+        }
+        return mp;
+}
+
+/* Returns the bytes of memory taken by the tables of every policy */
+uint64_t multi_table_bytes(const multi_policy * mp)
+{
+        uint64_t bytes = 0;
+        for(uint64_t k = 0; k < mp->count; ++k){
+                bytes += table_set_bytes(&mp->sets[k]);
+        }
+        return bytes;
+}
+
+/* Frees the tables of every policy */
+void multi_free(multi_policy * mp)
+{
+        for(uint64_t k = 0; k < mp->count; ++k){
+                free_table_set(&mp->sets[k]);
+                if(mp->pols[k].hybrid != NULL){
+                        hybrid_free(mp->pols[k].hybrid);
+                }
+        }
+        free(mp);
+}
+
+/* Classifies a group of packets against every policy, setting
+ * matches[k * count + p] to the match of packet p under policy k. sections
+ * holds room for the sections of each layout. */
+static void classify_policies(const multi_policy * mp, uint64_t * sections[],
+                              const uint8_t * packets, uint64_t count,
+                              uint64_t * matches)
+{
+        for(uint64_t k = 0; k < mp->count; ++k){
+                const policy pol = mp->pols[k];
+                const table_set * ts = &mp->sets[k];
+                uint64_t * m = matches + k * count;
+                if(ts->tree != NULL){
+                        classify_tree(pol, ts, packets, count, m);
+                }else{
+                        const table_dims dim = ts->dims;
+                        uint64_t (*indices)[count] =
+                                (uint64_t (*)[count]) sections[mp->layouts[k]];
+                        if(mp->layouts[k] == k){
+                                section_indices(dim, pol.pl, packets, count,
+                                                indices);
+                        }
+                        const uint8_t * rows[dim.even_d + dim.odd_d][count];
+                        locate_indexed_rows(ts, count,
+                                            (const uint64_t (*)[count]) indices,
+                                            rows);
+                        if(mp->engines[k] == ENGINE_BITSLICED){
+                                match_bitsliced_rows(dim, count, rows, m);
+                        }else{
+                                match_rows(dim, count, rows, m);
+                        }
+                }
+                if(pol.hybrid != NULL) hybrid_resolve(pol, packets, count, m);
+        }
+}
+
+/* Classifies the input against every policy, writing a column of matches per
+ * policy */
+void read_input_and_classify_multi(multi_policy * mp, input_stream * in,
+                                   output_stream * out)
+{
+        /* Bitsliced tables take packets a block at a time */
+        uint64_t group = opts.group_size;
+        for(uint64_t k = 0; k < mp->count; ++k){
+                if(mp->engines[k] == ENGINE_BITSLICED) group = BITSLICE_BLOCK;
+        }
+        uint64_t * matches = malloc(mp->count * group * sizeof(uint64_t));
+        uint64_t * sections[MAX_POLICIES] = {NULL};
+        if(matches == NULL){
+                Error("Could not allocate memory for packet group!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t k = 0; k < mp->count; ++k){
+                if(mp->layouts[k] != k || mp->sets[k].tree != NULL) continue;
+                const table_dims dim = mp->sets[k].dims;
+                sections[k] = malloc((dim.even_d + dim.odd_d) * group *
+                                     sizeof(uint64_t));
+                if(sections[k] == NULL){
+                        Error("Could not allocate memory for packet group!\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        uint64_t packets_read = 0;
+        const uint8_t * packets;
+        uint64_t count;
+        while((count = input_next(in, &packets, group)) > 0){
+                packets_read += count;
+                const uint64_t started = latency_sampled() ? now_ns() : 0;
+                const uint64_t group_started = timeline_start();
+                classify_policies(mp, sections, packets, count, matches);
+                timeline_end("classify group", group_started, "packets",
+                             count);
+                if(started != 0) latency_record(now_ns() - started, count);
+                latency_poll();
+                output_columns(out, matches, count, mp->count);
+        }
+
+        for(uint64_t k = 0; k < mp->count; ++k) free(sections[k]);
+        free(matches);
+        counters.table_packets += packets_read;
+        Trace("Packets read in: %"PRIu64"\n", packets_read);
+}
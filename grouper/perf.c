@@ -0,0 +1,126 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hardware performance counters, read with perf_event_open around each phase
+ * of a run. The counters follow the threads grouper starts, and processes once
+ * they exit. Each event is opened on its own, so any the machine lacks (virtual
+ * machines and containers often have none) are simply left out. Counts are
+ * scaled up when the kernel had to multiplex the counters. */
+
+#include "grouper.h"
+#include <linux/perf_event.h>   /* For the perf_event interface */
+#include <sys/syscall.h>        /* For syscall() */
+#include <sys/ioctl.h>          /* For ioctl() */
+
+/* The events counted, in the order of perf_counters.fd */
+static const struct {
+        const char * name;      /* Name in the timing record */
+        uint32_t type;
+        uint64_t config;
+} events[PERF_EVENTS] = {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"llc_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"dtlb_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+/* Opens every event the machine has, returning false if it has none */
+bool perf_open(perf_counters * pc)
+{
+        bool any = false;
+        for(uint64_t e = 0; e < PERF_EVENTS; ++e){
+                struct perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = events[e].type;
+                attr.config = events[e].config;
+                attr.disabled = 1;
+                attr.inherit = 1;
+                /* Unprivileged users may only count their own code */
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                        PERF_FORMAT_TOTAL_TIME_RUNNING;
+                pc->fd[e] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+                if(pc->fd[e] < 0){
+                        Trace("Counter %s is unavailable, errno = %d\n",
+                              events[e].name, errno);
+                }else{
+                        any = true;
+                }
+        }
+        return any;
+}
+
+/* Starts counting from zero */
+void perf_start(perf_counters * pc)
+{
+        for(uint64_t e = 0; e < PERF_EVENTS; ++e){
+                if(pc->fd[e] < 0) continue;
+                ioctl(pc->fd[e], PERF_EVENT_IOC_RESET, 0);
+                ioctl(pc->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+/* Stops counting and reads the counts into values, PERF_UNAVAILABLE for those
+ * that could not be counted */
+void perf_stop(perf_counters * pc, uint64_t values[PERF_EVENTS])
+{
+        for(uint64_t e = 0; e < PERF_EVENTS; ++e){
+                values[e] = PERF_UNAVAILABLE;
+                if(pc->fd[e] < 0) continue;
+                ioctl(pc->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+                /* The count, then the time enabled and time running */
+                uint64_t data[3];
+                if(read(pc->fd[e], data, sizeof(data)) != sizeof(data) ||
+                   data[2] == 0){
+                        continue;
+                }
+                values[e] = data[0];
+                if(data[2] < data[1]){
+                        values[e] = (double) data[0] * data[1] / data[2];
+                }
+        }
+}
+
+/* Closes the events */
+void perf_close(perf_counters * pc)
+{
+        for(uint64_t e = 0; e < PERF_EVENTS; ++e){
+                if(pc->fd[e] >= 0) close(pc->fd[e]);
+                pc->fd[e] = -1;
+        }
+}
+
+/* Adds the counts of a phase to the timing record, named after the phase */
+void perf_print(FILE * f, const char * phase, const uint64_t values[PERF_EVENTS])
+{
+        for(uint64_t e = 0; e < PERF_EVENTS; ++e){
+                if(values[e] == PERF_UNAVAILABLE) continue;
+                fprintf(f, ", '%s_%s' : %"PRIu64, phase, events[e].name,
+                        values[e]);
+        }
+}
@@ -19,20 +19,198 @@ This file is part of Grouper.
     along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* Generates random policies. By default every bit of every rule is drawn
+ * independently, which gives policies nothing like real access control lists,
+ * so rules can instead be prefixes or made of fields, and be derived from
+ * earlier rules to duplicate, shadow or overlap them. */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <string.h>
 
+#define MAX_FIELDS 64
+
+/* Ways to generate a rule from scratch */
+typedef enum {
+        MODE_UNIFORM,           /* Every bit 0, 1 or ? */
+        MODE_PREFIX,            /* Some fixed bits, then all don't-cares */
+        MODE_FIELDS             /* Fields given by -f */
+} gen_mode;
+
+/* A field of a rule, as given by -f */
+typedef struct {
+        long bits;
+        double wildcard;        /* Chance the whole field is don't-cares */
+        int prefix;             /* Whether a field that isn't is a prefix */
+} field;
+
+/* splitmix64, so a seed gives the same policy everywhere */
+static uint64_t state;
+static uint64_t next_random(void)
+{
+        uint64_t z = (state += UINT64_C(0x9e3779b97f4a7c15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        return z ^ (z >> 31);
+}
+
+/* Returns a random number in [0, 1) */
+static double uniform(void)
+{
+        return (next_random() >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+/* Returns a random number in [0, n) */
+static long below(long n)
+{
+        return next_random() % n;
+}
+
+/* Returns a random '0' or '1' */
+static char random_bit(void)
+{
+        return '0' + (next_random() >> 63);
+}
+
+/* Parses a field list such as "32:0.1:p,32:0.3:p,16:0.8,16:0.2,8:0.1" into
+ * fields, returning how many there are */
+static int parse_fields(char * spec, field fields[MAX_FIELDS])
+{
+        int n = 0;
+        for(char * f = strtok(spec, ","); f != NULL; f = strtok(NULL, ",")){
+                if(n == MAX_FIELDS){
+                        fprintf(stderr, "ERROR. At most %d fields.\n", MAX_FIELDS);
+                        exit(EXIT_FAILURE);
+                }
+                char * rest;
+                fields[n].bits = strtol(f, &rest, 10);
+                fields[n].wildcard = 0;
+                fields[n].prefix = 0;
+                if(*rest == ':') fields[n].wildcard = strtod(rest + 1, &rest);
+                if(*rest == ':' && rest[1] == 'p'){
+                        fields[n].prefix = 1;
+                        rest += 2;
+                }
+                if(fields[n].bits <= 0 || *rest != '\0' ||
+                   fields[n].wildcard < 0 || fields[n].wildcard > 1){
+                        fprintf(stderr, "ERROR. Bad field \"%s\", expected "
+                                "BITS[:WILDCARD[:p]]\n", f);
+                        exit(EXIT_FAILURE);
+                }
+                n++;
+        }
+        return n;
+}
+
+/* Sorts prefix lengths longest first */
+static int longer_first(const void * a, const void * b)
+{
+        long x = *(const long *) a, y = *(const long *) b;
+        return (x < y) - (x > y);
+}
+
+/* Fills a rule from scratch. A prefix rule has prefix_len fixed bits. */
+static void fresh_rule(char * rule, long bits, gen_mode mode, double wildcard,
+                       long prefix_len, const field * fields, int nfields)
+{
+        long j = 0, len;
+        switch(mode){
+        case MODE_UNIFORM:
+                for(j = 0; j < bits; j++){
+                        rule[j] = uniform() < wildcard ? '?' : random_bit();
+                }
+                break;
+        case MODE_PREFIX:
+                for(j = 0; j < bits; j++){
+                        rule[j] = j < prefix_len ? random_bit() : '?';
+                }
+                break;
+        case MODE_FIELDS:
+                for(int f = 0; f < nfields; f++){
+                        len = fields[f].bits;
+                        if(uniform() < fields[f].wildcard){
+                                len = 0;
+                        }else if(fields[f].prefix){
+                                len = 1 + below(fields[f].bits);
+                        }
+                        for(long k = 0; k < fields[f].bits; k++, j++){
+                                rule[j] = k < len ? random_bit() : '?';
+                        }
+                }
+                /* Bits after the last field are don't-cares */
+                for(; j < bits; j++){
+                        rule[j] = '?';
+                }
+                break;
+        }
+}
+
+static void usage(const char * name)
+{
+        fprintf(stderr, "Usage: %s [-m uniform|prefix] [-w WILDCARD] "
+                "[-f FIELDS] [-D DUPLICATE] [-s SHADOW] [-o OVERLAP] "
+                "[-S SEED] BITS RULES FILENAME\n", name);
+        exit(EXIT_FAILURE);
+}
+
 int main(int argc, char ** argv)
 {
-        if(argc != 4){
+        gen_mode mode = MODE_UNIFORM;
+        double wildcard = 1.0 / 3;
+        double duplicate = 0, shadow = 0, overlap = 0;
+        field fields[MAX_FIELDS];
+        int nfields = 0;
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        uint64_t seed = now.tv_sec * now.tv_usec;
+
+        int opt;
+        while((opt = getopt(argc, argv, "m:w:f:D:s:o:S:")) != -1){
+                switch(opt){
+                case 'm':
+                        if(strcmp(optarg, "uniform") == 0){
+                                mode = MODE_UNIFORM;
+                        }else if(strcmp(optarg, "prefix") == 0){
+                                mode = MODE_PREFIX;
+                        }else{
+                                fprintf(stderr, "ERROR. Unknown mode %s\n",
+                                        optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'w':
+                        wildcard = atof(optarg);
+                        break;
+                case 'f':
+                        mode = MODE_FIELDS;
+                        nfields = parse_fields(optarg, fields);
+                        break;
+                case 'D':
+                        duplicate = atof(optarg);
+                        break;
+                case 's':
+                        shadow = atof(optarg);
+                        break;
+                case 'o':
+                        overlap = atof(optarg);
+                        break;
+                case 'S':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if(argc - optind != 3){
                 fprintf(stderr, "ERROR. Takes 3 arguments: bits, rules, filename\n");
-                exit(EXIT_FAILURE);
+                usage(argv[0]);
         }
-        long bits = atol(argv[1]);
-        long rules = atol(argv[2]);
-        char * filename = argv[3];
+        long bits = atol(argv[optind]);
+        long rules = atol(argv[optind + 1]);
+        char * filename = argv[optind + 2];
         if(bits <= 0){
                 fprintf(stderr, "ERROR. bits must be > 0, got %ld\n", bits);
                 exit(EXIT_FAILURE);
@@ -45,34 +223,85 @@ int main(int argc, char ** argv)
                 fprintf(stderr, "ERROR. filename must be nonzero length.\n");
                 exit(EXIT_FAILURE);
         }
-        struct timeval seed;
-        gettimeofday(&seed, NULL);
-        srand(seed.tv_sec * seed.tv_usec);
-        
-        FILE * outfile = fopen(filename, "w");
-        fprintf(outfile, "%d\n", bits);
-        int i,j;
-        int random_rule;
-        for(i = 0; i < rules; i ++){
-                for(j = 0; j < bits; j++){
-                        random_rule = (int)((3.0 * rand()) / (RAND_MAX + 1.0));
-                        switch(random_rule){
-                        case 0:
-                                fputc('0', outfile);
-                                break;
-                        case 1:
-                                fputc('1', outfile);
-                                break;
-                        case 2:
-                                fputc('?', outfile);
-                                break;
-                        default:
-                                fputc((char)48 + random_rule, outfile);
+        long field_bits = 0;
+        for(int f = 0; f < nfields; f++){
+                field_bits += fields[f].bits;
+        }
+        if(field_bits > bits){
+                fprintf(stderr, "ERROR. Fields take %ld bits, more than %ld\n",
+                        field_bits, bits);
+                exit(EXIT_FAILURE);
+        }
+        if(wildcard < 0 || wildcard > 1 || duplicate < 0 || shadow < 0 ||
+           overlap < 0 || duplicate + shadow + overlap > 1){
+                fprintf(stderr, "ERROR. Probabilities must be between 0 and 1, "
+                        "and -D, -s and -o must add up to at most 1.\n");
+                exit(EXIT_FAILURE);
+        }
+        state = seed;
+
+        /* Prefixes go longest first, as a router matches them, or an early
+         * short one would shadow most of those after it. Every rule gets a
+         * length by position, so the fresh ones are not biased. */
+        long * prefix_lens = NULL;
+        if(mode == MODE_PREFIX){
+                prefix_lens = malloc(rules * sizeof(long));
+                if(prefix_lens == NULL){
+                        fprintf(stderr, "ERROR. Could not allocate memory for "
+                                "prefixes.\n");
+                        exit(EXIT_FAILURE);
+                }
+                for(long i = 0; i < rules; i++){
+                        prefix_lens[i] = 1 + below(bits);
+                }
+                qsort(prefix_lens, rules, sizeof(long), longer_first);
+        }
+
+        /* Earlier rules are kept to derive later ones from */
+        char * policy = malloc(rules * bits);
+        if(policy == NULL){
+                fprintf(stderr, "ERROR. Could not allocate memory for rules.\n");
+                exit(EXIT_FAILURE);
+        }
+        for(long i = 0; i < rules; i++){
+                char * rule = policy + i * bits;
+                double r = uniform();
+                if(i == 0 || r >= duplicate + shadow + overlap){
+                        fresh_rule(rule, bits, mode, wildcard,
+                                   prefix_lens == NULL ? 0 : prefix_lens[i],
+                                   fields, nfields);
+                        continue;
+                }
+                memcpy(rule, policy + below(i) * bits, bits);
+                if(r < duplicate) continue;
+                for(long j = 0; j < bits; j++){
+                        if(r < duplicate + shadow){
+                                /* Narrower than the earlier rule, so it is
+                                 * shadowed and never matches */
+                                if(rule[j] == '?' && uniform() < 0.5){
+                                        rule[j] = random_bit();
+                                }
+                        }else if(rule[j] != '?' && uniform() < 0.25){
+                                /* Wider, so it overlaps the earlier rule */
+                                rule[j] = '?';
                         }
                 }
+        }
+
+        FILE * outfile = fopen(filename, "w");
+        if(outfile == NULL){
+                fprintf(stderr, "ERROR. Could not open %s for writing.\n",
+                        filename);
+                exit(EXIT_FAILURE);
+        }
+        fprintf(outfile, "%ld\n", bits);
+        for(long i = 0; i < rules; i++){
+                fwrite(policy + i * bits, 1, bits, outfile);
                 /* Add the newline */
                 fputc('\n', outfile);
         }
         fclose(outfile);
+        free(policy);
+        free(prefix_lens);
         return EXIT_SUCCESS;
 }
@@ -0,0 +1,313 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A report on the tables once they are built, to help pick the memory size
+ * and options for a policy. Every row of every table is read once, by a pool
+ * of threads taking a table at a time. For each table the report gives:
+ *
+ * - its density, the fraction of rule bits set across its rows;
+ * - its distinct rows, counted by 64 bit hash, which is what -d would store;
+ * - its selectivity, the rules expected to survive ANDing with its row alone;
+ * - the rules expected to survive ANDing it and every table before it;
+ * - the bytes of cache lines a lookup in it touches.
+ *
+ * Expectations are over packets whose bits are uniformly random. The sections
+ * of different tables are then independent, so the chance a rule survives a
+ * run of tables is the product of the fraction of rows of each with its bit
+ * set. The summary adds what deduplication would store, the table order that
+ * narrows the rules down fastest, and the memory one table more or fewer would
+ * take. */
+
+#include "grouper.h"
+
+/* What is found out about one table */
+typedef struct {
+        uint64_t start;         /* First bit of its section */
+        uint64_t size;          /* Bits in its section */
+        uint64_t rows;
+        uint64_t set_bits;      /* Rule bits set across all rows */
+        uint64_t distinct;      /* Distinct rows */
+        uint64_t * columns;     /* Rows with each rule's bit set */
+} table_report;
+
+/* State shared by the threads reading the tables */
+typedef struct {
+        policy pol;
+        const table_set * ts;
+        table_report * reports;
+        uint64_t next_table;    /* Next table to hand out */
+} report_job;
+
+/* Returns row index of table k, wherever the set keeps it */
+static const uint8_t * stored_row(const table_set * ts, uint64_t k,
+                                  uint64_t index)
+{
+        const table_dims d = ts->dims;
+        const bool even = k < d.even_d;
+        const uint64_t i = even ? k : k - d.even_d;
+        const uint64_t slot = index * (even ? d.even_d : d.odd_d) + i;
+        if(ts->tier != NULL) return tier_mapped_row(ts->tier, k, index);
+        if(ts->pool != NULL){
+                const uint32_t id = even ? ts->even_ids[slot]
+                                         : ts->odd_ids[slot];
+                return ts->pool + id * d.bytewidth;
+        }
+        return (even ? ts->even_tables : ts->odd_tables) + slot * d.bytewidth;
+}
+
+/* 64 bit FNV-1a hash of a row */
+static uint64_t hash_row(const uint8_t * row, uint64_t bytewidth)
+{
+        uint64_t hash = UINT64_C(14695981039346656037);
+        for(uint64_t i = 0; i < bytewidth; ++i){
+                hash ^= row[i];
+                hash *= UINT64_C(1099511628211);
+        }
+        return hash;
+}
+
+/* Orders hashes for qsort */
+static int compare_hashes(const void * a, const void * b)
+{
+        const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+        return (x > y) - (x < y);
+}
+
+/* Thread reading tables until none are left */
+static void * report_thread(void * args)
+{
+        report_job * job = args;
+        const table_dims d = job->ts->dims;
+        const uint64_t tables = d.even_d + d.odd_d;
+        uint64_t k;
+        while((k = __sync_fetch_and_add(&job->next_table, 1)) < tables){
+                const uint64_t started = timeline_start();
+                table_report * r = &job->reports[k];
+                const bool even = k < d.even_d;
+                r->size = even ? d.even_s : d.odd_s;
+                r->start = even ? k * d.even_s :
+                        d.even_d * d.even_s + (k - d.even_d) * d.odd_s;
+                r->rows = even ? d.even_h : d.odd_h;
+                r->columns = calloc(job->pol.n, sizeof(uint64_t));
+                uint64_t * hashes = malloc(r->rows * sizeof(uint64_t));
+                if(r->columns == NULL || hashes == NULL){
+                        Error("Could not allocate memory for the table "
+                              "report!\n");
+                        exit(EXIT_FAILURE);
+                }
+                for(uint64_t h = 0; h < r->rows; ++h){
+                        const uint8_t * row = stored_row(job->ts, k, h);
+                        hashes[h] = hash_row(row, d.bytewidth);
+                        for(uint64_t i = 0; i < d.bytewidth; ++i){
+                                /* Rule w is bit w % 8 of byte w / 8 */
+                                for(uint8_t bits = row[i]; bits != 0;
+                                    bits &= bits - 1){
+                                        r->columns[i * BitsInByte +
+                                                   __builtin_ctz(bits)]++;
+                                        r->set_bits++;
+                                }
+                        }
+                }
+                qsort(hashes, r->rows, sizeof(uint64_t), compare_hashes);
+                r->distinct = r->rows != 0;
+                for(uint64_t h = 1; h < r->rows; ++h){
+                        r->distinct += hashes[h] != hashes[h - 1];
+                }
+                free(hashes);
+                timeline_end("report table", started, "table", k);
+        }
+        return NULL;
+}
+
+/* Returns the bytes of whole cache lines a row of bytewidth bytes touches, on
+ * average over where rows fall within lines */
+static double row_line_bytes(uint64_t bytewidth)
+{
+        uint64_t lines = 0;
+        for(uint64_t i = 0; i < CACHE_LINE; ++i){
+                lines += ceil_div(i * bytewidth % CACHE_LINE + bytewidth,
+                                  CACHE_LINE);
+        }
+        return (double) lines / CACHE_LINE * CACHE_LINE;
+}
+
+/* Returns the rules expected to survive ANDing rows of the tables in order,
+ * given the survival of each rule so far in alive */
+static double survive(const table_report * r, uint64_t n, double * alive)
+{
+        double total = 0;
+        for(uint64_t w = 0; w < n; ++w){
+                alive[w] *= (double) r->columns[w] / r->rows;
+                total += alive[w];
+        }
+        return total;
+}
+
+/* Returns the bytes of t full tables for a policy, or 0 if there can't be t */
+static double full_bytes(policy pol, uint64_t t, uint64_t bytewidth)
+{
+        if(t < 1 || t > pol.b) return 0;
+        /* A single table holds rule numbers, as create_single_table makes */
+        if(t == 1) return exp2(pol.b) * ceil_div(ceil(log2(pol.n + 1)), 8);
+        return ((t - pol.b % t) * exp2(pol.b / t) +
+                (pol.b % t) * exp2(pol.b / t + 1)) * bytewidth;
+}
+
+/* Reports on the tables of ts, built for pol, to f as text or, if json is
+ * set, as a JSON object on one line */
+void report_tables(policy pol, const table_set * ts, bool json, FILE * f)
+{
+        if(ts->tree != NULL){
+                fprintf(f, json ? "{\"rules\":%"PRIu64",\"tables\":[]}\n"
+                        : "%"PRIu64" rules in a decision tree, no tables\n",
+                        pol.n);
+                return;
+        }
+        const table_dims d = ts->dims;
+        const uint64_t tables = d.even_d + d.odd_d;
+        report_job job = {.pol = pol, .ts = ts, .next_table = 0,
+                          .reports = calloc(tables, sizeof(table_report))};
+        double * alive = malloc(pol.n * sizeof(double));
+        double * best_alive = malloc(pol.n * sizeof(double));
+        double * trial = malloc(pol.n * sizeof(double));
+        uint64_t * order = malloc(tables * sizeof(uint64_t));
+        bool * used = calloc(tables, sizeof(bool));
+        if(job.reports == NULL || alive == NULL || best_alive == NULL ||
+           trial == NULL || order == NULL || used == NULL){
+                Error("Could not allocate memory for the table report!\n");
+                exit(EXIT_FAILURE);
+        }
+        uint64_t nthreads = min((uint64_t) sysconf(_SC_NPROCESSORS_ONLN), tables);
+        pthread_t threads[nthreads];
+        for(uint64_t i = 0; i < nthreads; ++i){
+                pthread_create(&threads[i], NULL, report_thread, &job);
+        }
+        for(uint64_t i = 0; i < nthreads; ++i){
+                pthread_join(threads[i], NULL);
+        }
+
+        /* A lookup reads a row of every table, and with -d its row id too */
+        const double line_bytes = row_line_bytes(d.bytewidth) +
+                (ts->pool != NULL ? CACHE_LINE : 0);
+        uint64_t rows = 0, set_bits = 0, distinct = 0;
+        for(uint64_t w = 0; w < pol.n; ++w) alive[w] = 1;
+        if(json){
+                fprintf(f, "{\"rules\":%"PRIu64",\"row_bytes\":%"PRIu64","
+                        "\"tables\":[", pol.n, d.bytewidth);
+        }else{
+                fprintf(f, "%"PRIu64" tables of %"PRIu64" rules, rows of "
+                        "%"PRIu64" bytes\n", tables, pol.n, d.bytewidth);
+                fprintf(f, "%5s %9s %10s %8s %10s %11s %10s %6s\n", "table",
+                        "bits", "rows", "density", "distinct", "selectivity",
+                        "surviving", "bytes");
+        }
+        for(uint64_t k = 0; k < tables; ++k){
+                const table_report * r = &job.reports[k];
+                const double density = (double) r->set_bits /
+                        (r->rows * pol.n);
+                const double selectivity = (double) r->set_bits / r->rows;
+                const double surviving = survive(r, pol.n, alive);
+                rows += r->rows;
+                set_bits += r->set_bits;
+                distinct += r->distinct;
+                if(json){
+                        fprintf(f, "%s{\"start\":%"PRIu64",\"bits\":%"PRIu64
+                                ",\"rows\":%"PRIu64",\"density\":%.6f,"
+                                "\"distinct\":%"PRIu64",\"selectivity\":%.4f,"
+                                "\"surviving\":%.4f,\"bytes_per_lookup\":%.1f}",
+                                k == 0 ? "" : ",", r->start, r->size, r->rows,
+                                density, r->distinct, selectivity, surviving,
+                                line_bytes);
+                }else{
+                        fprintf(f, "%5"PRIu64" %4"PRIu64"-%-4"PRIu64" %10"PRIu64
+                                " %8.4f %10"PRIu64" %11.2f %10.2f %6.0f\n", k,
+                                r->start, r->start + r->size - 1, r->rows,
+                                density, r->distinct, selectivity, surviving,
+                                line_bytes);
+                }
+        }
+
+        /* Greedily order the tables so each narrows down the rules most */
+        for(uint64_t w = 0; w < pol.n; ++w) alive[w] = 1;
+        double ordered_surviving = pol.n;
+        for(uint64_t i = 0; i < tables; ++i){
+                double best = INFINITY;
+                for(uint64_t k = 0; k < tables; ++k){
+                        if(used[k]) continue;
+                        memcpy(trial, alive, pol.n * sizeof(double));
+                        const double s = survive(&job.reports[k], pol.n, trial);
+                        if(s < best){
+                                best = s;
+                                order[i] = k;
+                                memcpy(best_alive, trial, pol.n * sizeof(double));
+                        }
+                }
+                used[order[i]] = true;
+                memcpy(alive, best_alive, pol.n * sizeof(double));
+                /* Rules left after the first half of the tables */
+                if(i == (tables - 1) / 2) ordered_surviving = best;
+        }
+
+        const double dedup_bytes = (double) rows * sizeof(uint32_t) +
+                (double) distinct * d.bytewidth;
+        const uint64_t t = tables;
+        if(json){
+                fprintf(f, "],\"rows\":%"PRIu64",\"density\":%.6f,"
+                        "\"distinct\":%"PRIu64",\"table_bytes\":%"PRIu64","
+                        "\"dedup_bytes\":%.0f,\"bytes_per_lookup\":%.1f,"
+                        "\"best_order\":[", rows,
+                        (double) set_bits / (rows * pol.n), distinct,
+                        table_set_bytes(ts), dedup_bytes, line_bytes * tables);
+                for(uint64_t i = 0; i < tables; ++i){
+                        fprintf(f, "%s%"PRIu64, i == 0 ? "" : ",", order[i]);
+                }
+                fprintf(f, "],\"best_order_half_surviving\":%.4f,"
+                        "\"fewer_tables_bytes\":%.0f,\"more_tables_bytes\":"
+                        "%.0f}\n", ordered_surviving,
+                        full_bytes(pol, t - 1, d.bytewidth),
+                        full_bytes(pol, t + 1, d.bytewidth));
+        }else{
+                fprintf(f, "All tables: %"PRIu64" rows, density %.4f, %"PRIu64
+                        " distinct rows, %.0f bytes touched per lookup\n",
+                        rows, (double) set_bits / (rows * pol.n), distinct,
+                        line_bytes * tables);
+                fprintf(f, "Tables take %"PRIu64" bytes, deduplicated at most "
+                        "%.0f\n", table_set_bytes(ts), dedup_bytes);
+                fprintf(f, "Best order:");
+                for(uint64_t i = 0; i < tables; ++i){
+                        fprintf(f, " %"PRIu64, order[i]);
+                }
+                fprintf(f, ", leaving %.2f rules after the first %"PRIu64
+                        " tables\n", ordered_surviving, (tables + 1) / 2);
+                fprintf(f, "%"PRIu64" tables would take %.0f bytes, %"PRIu64
+                        " tables %.0f bytes\n", t - 1,
+                        full_bytes(pol, t - 1, d.bytewidth), t + 1,
+                        full_bytes(pol, t + 1, d.bytewidth));
+        }
+
+        for(uint64_t k = 0; k < tables; ++k) free(job.reports[k].columns);
+        free(job.reports);
+        free(alive);
+        free(best_alive);
+        free(trial);
+        free(order);
+        free(used);
+}
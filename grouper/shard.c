@@ -0,0 +1,490 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Sharded classification splits the rules of a policy into contiguous
+ * priority ranges, each with its own set of tables. The shards form a
+ * pipeline: every batch of packets goes through the shards in priority order,
+ * each shard running on its own thread or process, so that all shards are
+ * busy on different batches at once. Because a shard only sees a batch after
+ * all higher priority shards are done with it, packets already matched by an
+ * earlier shard are skipped, and the first match found is the lowest matching
+ * rule overall.
+ *
+ * When the shards are separate processes the pipeline lives in an anonymous
+ * shared mapping created before they are forked, and its mutex is process
+ * shared and robust, so a shard process killed while holding it cannot hang
+ * the rest. Waiting for a batch to move is a futex on a count of moves rather
+ * than a condition variable, as a process shared condition variable hangs its
+ * next broadcast if a waiter is killed. Each shard process builds its tables
+ * in its own address space after the fork. */
+
+#include "grouper.h"
+#include <sys/mman.h>           /* For mmap() */
+#include <sys/wait.h>           /* For waitpid() */
+#include <sys/prctl.h>          /* For prctl() */
+#include <signal.h>             /* For kill() */
+#include <limits.h>             /* For INT_MAX */
+#include <linux/futex.h>        /* For FUTEX_WAIT and FUTEX_WAKE */
+#include <sys/syscall.h>        /* For SYS_futex */
+
+/* A batch of packets moving through the pipeline */
+typedef struct {
+        uint8_t * packets;      /* SHARD_BATCH packets */
+        uint64_t * matches;     /* Global rule matched by each packet, or 0 */
+        uint64_t count;         /* Packets in the batch, 0 ends the input */
+        uint64_t stage;         /* Number of shards done with the batch */
+        uint64_t started;       /* When it was read, if timed, otherwise 0 */
+} shard_batch;
+
+/* Arguments to a shard thread */
+typedef struct {
+        shard_pipeline * pipe;
+        const shard * s;        /* The shard this thread runs */
+        uint64_t k;             /* Which shard it is */
+} shard_args;
+
+/* State shared between the reading thread and the shards */
+struct SHARD_PIPELINE {
+        uint64_t pl;            /* Packet length */
+        uint64_t nshards;
+        uint64_t nbatches;
+        size_t size;            /* Bytes mapped for the pipeline */
+        bool processes;         /* Whether shards are processes or threads */
+        pid_t parent;           /* Process reading the input */
+        pid_t pids[MAX_SHARDS];         /* Shard processes */
+        pthread_t threads[MAX_SHARDS];  /* Shard threads */
+        shard_args args[MAX_SHARDS];    /* Arguments to shard threads */
+        uint64_t skipped[MAX_SHARDS];   /* Packets each shard skipped as
+                                         * already matched */
+        uint64_t cache_hits[MAX_SHARDS];   /* Flow cache counts of each */
+        uint64_t cache_misses[MAX_SHARDS]; /* shard */
+        uint64_t ready;         /* Shard processes done building tables */
+        bool finished[MAX_SHARDS];      /* Shard processes done classifying */
+        bool reaped[MAX_SHARDS];        /* Shard processes waited for */
+        uint64_t table_bytes;   /* Memory taken by the tables of every shard */
+        pthread_mutex_t lock;   /* Protects the stage of every batch */
+        uint32_t moves;         /* Futex bumped when a batch changes stage */
+        uint32_t waiters;       /* Threads or processes waiting on moves */
+        shard_batch batches[];  /* Ring of nshards + 2 batches */
+};
+
+/* Builds the tables of shard k of nshards, which gets an equal share of m bits
+ * of memory */
+void build_shard(policy pol, uint64_t k, uint64_t nshards, uint64_t m, shard * s)
+{
+        const uint64_t per_shard = ceil_div(pol.n, nshards);
+        const uint64_t share = m / nshards;
+        s->first_rule = min(k * per_shard, pol.n);
+        /* The shard's policy points into the full policy's masks */
+        s->pol = pol;
+        s->pol.n = min(per_shard, pol.n - s->first_rule);
+        s->pol.N = 8 * ceil_div(s->pol.n, 8);
+        s->pol.q_masks = pol.q_masks + s->first_rule;
+        s->pol.b_masks = pol.b_masks + s->first_rule;
+        if(s->pol.n == 0){
+                Error("Error: %"PRIu64" rules cannot be split into "
+                      "%"PRIu64" shards.\n", pol.n, nshards);
+                exit(EXIT_FAILURE);
+        }
+
+        uint64_t t = min_tables(share, s->pol.n, s->pol.b);
+        if(t == TABLE_ERROR){
+                Error("Error: not enough memory to build tables for "
+                      "%"PRIu64" shards. Needs at least %"PRIu64
+                      " bytes.\n", nshards, nshards * 
+                      ceil_div(2*s->pol.N*s->pol.b, 8));
+                exit(EXIT_FAILURE);
+        }
+        /* A shard always uses the multiple table engine */
+        if(t == 1) t = 2;
+        Trace("Shard %"PRIu64" has rules %"PRIu64" to %"PRIu64"\n", k,
+              s->first_rule + 1, s->first_rule + s->pol.n);
+        build_tables(s->pol, t, s->pol.N, share, &s->ts);
+}
+
+/* Splits the rules of pol into nshards contiguous ranges and builds tables for
+ * each, giving every shard an equal share of m bits of memory */
+shard * build_shards(policy pol, uint64_t nshards, uint64_t m)
+{
+        shard * shards = calloc(nshards, sizeof(shard));
+        if(shards == NULL){
+                Error("Could not allocate memory for shards!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t k = 0; k < nshards; ++k){
+                build_shard(pol, k, nshards, m, &shards[k]);
+        }
+        return shards;
+}
+
+/* Frees shards returned by build_shards */
+void free_shards(shard * shards, uint64_t nshards)
+{
+        for(uint64_t k = 0; k < nshards; ++k){
+                free_table_set(&shards[k].ts);
+        }
+        free(shards);
+}
+
+/* Maps the pipeline and its batches in one block, shared with child processes
+ * if processes is set */
+static shard_pipeline * create_pipeline(uint64_t pl, uint64_t nshards,
+                                        bool processes)
+{
+        const uint64_t nbatches = nshards + 2;
+        const size_t header = sizeof(shard_pipeline) + 
+                nbatches * sizeof(shard_batch);
+        const size_t batch_bytes = SHARD_BATCH * (sizeof(uint64_t) + pl);
+        const size_t size = header + nbatches * batch_bytes;
+        shard_pipeline * pipe = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                     (processes ? MAP_SHARED : MAP_PRIVATE) |
+                                     MAP_ANONYMOUS, -1, 0);
+        if(pipe == MAP_FAILED){
+                Error("Could not map memory for shard pipeline! errno = %d\n",
+                      errno);
+                exit(EXIT_FAILURE);
+        }
+        pipe->pl = pl;
+        pipe->nshards = nshards;
+        pipe->nbatches = nbatches;
+        pipe->size = size;
+        pipe->processes = processes;
+        pipe->parent = getpid();
+        pipe->ready = 0;
+        pipe->table_bytes = 0;
+
+        pipe->moves = 0;
+        pipe->waiters = 0;
+
+        pthread_mutexattr_t lock_attr;
+        pthread_mutexattr_init(&lock_attr);
+        if(processes){
+                pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+                /* A shard process killed while holding the lock must not
+                 * leave the others waiting on it forever */
+                pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST);
+        }
+        pthread_mutex_init(&pipe->lock, &lock_attr);
+        pthread_mutexattr_destroy(&lock_attr);
+
+        /* The matches come first to keep them aligned */
+        uint8_t * data = (uint8_t *) pipe + header;
+        for(uint64_t b = 0; b < nbatches; ++b){
+                pipe->batches[b].matches = (uint64_t *) (data + b * batch_bytes);
+                pipe->batches[b].packets = data + b * batch_bytes + 
+                        SHARD_BATCH * sizeof(uint64_t);
+                pipe->batches[b].count = 0;
+                /* Every batch starts out free */
+                pipe->batches[b].stage = nshards;
+        }
+        return pipe;
+}
+
+/* Exits if any shard process has died before finishing. A shard that
+ * finished cleanly may exit while slower ones are still working. Only the
+ * parent can check, and the pipeline lock must be held. */
+static void check_shard_processes(shard_pipeline * pipe)
+{
+        if(!pipe->processes || getpid() != pipe->parent) return;
+        for(uint64_t k = 0; k < pipe->nshards; ++k){
+                int status;
+                if(pipe->reaped[k] ||
+                   waitpid(pipe->pids[k], &status, WNOHANG) != pipe->pids[k]){
+                        continue;
+                }
+                pipe->reaped[k] = true;
+                if(!pipe->finished[k] || !WIFEXITED(status) ||
+                   WEXITSTATUS(status) != EXIT_SUCCESS){
+                        Error("Shard process %"PRIu64" exited unexpectedly.\n", k);
+                        for(uint64_t j = 0; j < pipe->nshards; ++j){
+                                if(j != k) kill(pipe->pids[j], SIGKILL);
+                        }
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+/* Called with the pipeline lock just taken from a shard process that died
+ * holding it. The lock is made usable again, and the parent exits if it can
+ * already see the shard is gone; otherwise its next timed wait finds out. */
+static void recover_lock(shard_pipeline * pipe)
+{
+        pthread_mutex_consistent(&pipe->lock);
+        check_shard_processes(pipe);
+}
+
+/* Takes the pipeline lock */
+static void lock_pipeline(shard_pipeline * pipe)
+{
+        if(pthread_mutex_lock(&pipe->lock) == EOWNERDEAD) recover_lock(pipe);
+}
+
+/* Wakes everything waiting for a batch to move. The pipeline lock must be
+ * held. */
+static void signal_moved(shard_pipeline * pipe)
+{
+        pipe->moves++;
+        if(pipe->waiters != 0){
+                syscall(SYS_futex, &pipe->moves, FUTEX_WAKE, INT_MAX, NULL,
+                        NULL, 0);
+        }
+}
+
+/* Waits until *value reaches target. The pipeline lock must be held, and is
+ * let go while waiting. Waits time out every second so the parent can notice
+ * a shard process dying. */
+static void wait_locked(shard_pipeline * pipe, volatile uint64_t * value,
+                        uint64_t target)
+{
+        static const struct timespec second = {.tv_sec = 1, .tv_nsec = 0};
+        while(*value != target){
+                /* A move after the lock is let go changes moves, so the
+                 * futex does not sleep through it */
+                const uint32_t seen = pipe->moves;
+                pipe->waiters++;
+                pthread_mutex_unlock(&pipe->lock);
+                const bool timed_out = syscall(SYS_futex, &pipe->moves,
+                                               FUTEX_WAIT, seen, &second, NULL,
+                                               0) != 0 && errno == ETIMEDOUT;
+                lock_pipeline(pipe);
+                pipe->waiters--;
+                if(timed_out) check_shard_processes(pipe);
+        }
+}
+
+/* Waits until a batch reaches a stage */
+static void wait_for_stage(shard_pipeline * pipe, shard_batch * batch,
+                           uint64_t stage)
+{
+        lock_pipeline(pipe);
+        wait_locked(pipe, &batch->stage, stage);
+        pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Moves a batch to a stage */
+static void set_stage(shard_pipeline * pipe, shard_batch * batch, uint64_t stage)
+{
+        lock_pipeline(pipe);
+        batch->stage = stage;
+        signal_moved(pipe);
+        pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Runs shard k of the pipeline until the input ends. Packets not yet matched
+ * by a higher priority shard are packed together and classified a group at a
+ * time. */
+static void run_shard(shard_pipeline * pipe, const shard * s, uint64_t k)
+{
+        const uint64_t pl = pipe->pl;
+        uint8_t * pending = malloc(SHARD_BATCH * pl);
+        uint64_t * which = malloc(SHARD_BATCH * sizeof(uint64_t));
+        uint64_t * local = malloc(SHARD_BATCH * sizeof(uint64_t));
+        if(pending == NULL || which == NULL || local == NULL){
+                Error("Could not allocate memory for shard batch!\n");
+                exit(EXIT_FAILURE);
+        }
+        /* Every shard has a cache of its own matches */
+        flow_cache * cache = NULL;
+        if(opts.cache_entries != 0){
+                cache = flow_cache_new(s->pol, opts.cache_entries);
+        }
+
+        for(uint64_t b = 0; ; b = (b + 1) % pipe->nbatches){
+                shard_batch * batch = &pipe->batches[b];
+                const uint64_t waited = timeline_start();
+                wait_for_stage(pipe, batch, k);
+                timeline_end("shard wait", waited, "shard", k);
+                if(batch->count == 0){
+                        /* End of input, pass it on */
+                        set_stage(pipe, batch, k + 1);
+                        break;
+                }
+
+                const uint64_t started = timeline_start();
+                uint64_t npending = 0;
+                for(uint64_t p = 0; p < batch->count; ++p){
+                        if(batch->matches[p] != 0) continue;
+                        memcpy(pending + npending * pl, batch->packets + p * pl, pl);
+                        which[npending++] = p;
+                }
+                pipe->skipped[k] += batch->count - npending;
+
+                for(uint64_t g = 0; g < npending; g += opts.group_size){
+                        uint64_t count = min(opts.group_size, npending - g);
+                        if(cache != NULL){
+                                classify_cached(s->pol, &s->ts, cache,
+                                                classify_group, pending + g * pl,
+                                                count, local + g);
+                        }else{
+                                classify_group(s->pol, &s->ts, pending + g * pl,
+                                               count, local + g);
+                        }
+                }
+                for(uint64_t i = 0; i < npending; ++i){
+                        if(local[i] != 0){
+                                batch->matches[which[i]] = s->first_rule + local[i];
+                        }
+                }
+                timeline_end("shard batch", started, "packets", npending);
+                set_stage(pipe, batch, k + 1);
+        }
+
+        free(pending);
+        free(which);
+        free(local);
+        if(cache != NULL){
+                flow_cache_free(cache, &pipe->cache_hits[k],
+                                &pipe->cache_misses[k]);
+        }
+}
+
+/* Thread function running one shard */
+static void * shard_thread(void * args)
+{
+        shard_args * sa = args;
+        run_shard(sa->pipe, sa->s, sa->k);
+        return NULL;
+}
+
+/* Starts a thread for each of the shards built by build_shards */
+shard_pipeline * start_shard_threads(policy pol, shard * shards, uint64_t nshards)
+{
+        shard_pipeline * pipe = create_pipeline(pol.pl, nshards, false);
+        for(uint64_t k = 0; k < nshards; ++k){
+                pipe->args[k].pipe = pipe;
+                pipe->args[k].s = &shards[k];
+                pipe->args[k].k = k;
+                pipe->table_bytes += table_set_bytes(&shards[k].ts);
+                pthread_create(&pipe->threads[k], NULL, shard_thread,
+                               &pipe->args[k]);
+        }
+        return pipe;
+}
+
+/* Forks a process for each shard of a policy. Every process builds its own
+ * shard's tables from an equal share of m bits of memory. Returns once all of
+ * them are ready to classify. */
+shard_pipeline * start_shard_processes(policy pol, uint64_t nshards, uint64_t m)
+{
+        shard_pipeline * pipe = create_pipeline(pol.pl, nshards, true);
+        /* Anything buffered would otherwise be written by every child */
+        fflush(stdout);
+        fflush(stderr);
+        for(uint64_t k = 0; k < nshards; ++k){
+                pid_t pid = fork();
+                if(pid < 0){
+                        Error("Could not fork shard process! errno = %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+                if(pid == 0){
+                        /* Don't outlive the front end */
+                        prctl(PR_SET_PDEATHSIG, SIGKILL);
+                        /* Nothing would write out this process's timeline */
+                        timeline_on = false;
+                        if(getppid() != pipe->parent) _exit(EXIT_FAILURE);
+
+                        shard s;
+                        build_shard(pol, k, nshards, m, &s);
+                        lock_pipeline(pipe);
+                        pipe->ready++;
+                        pipe->table_bytes += table_set_bytes(&s.ts);
+                        signal_moved(pipe);
+                        pthread_mutex_unlock(&pipe->lock);
+
+                        run_shard(pipe, &s, k);
+                        lock_pipeline(pipe);
+                        pipe->finished[k] = true;
+                        pthread_mutex_unlock(&pipe->lock);
+                        _exit(EXIT_SUCCESS);
+                }
+                pipe->pids[k] = pid;
+        }
+
+        lock_pipeline(pipe);
+        wait_locked(pipe, &pipe->ready, nshards);
+        pthread_mutex_unlock(&pipe->lock);
+        return pipe;
+}
+
+/* Returns the bytes of memory taken by the tables of every shard */
+uint64_t shard_table_bytes(const shard_pipeline * pipe)
+{
+        return pipe->table_bytes;
+}
+
+/* Prints the matches of a batch that has been through every shard */
+static void print_batch(shard_batch * batch, output_stream * out)
+{
+        if(batch->started != 0){
+                latency_record(now_ns() - batch->started, batch->count);
+                batch->started = 0;
+        }
+        latency_poll();
+        output_matches(out, batch->matches, batch->count);
+        batch->count = 0;
+}
+
+/* Filters incoming packets through the shards and classifies them to the
+ * output. The shards are stopped and the pipeline unmapped once the input
+ * ends. */
+void read_input_and_classify_sharded(shard_pipeline * pipe, input_stream * in,
+                                     output_stream * out)
+{
+        uint64_t packets_read = 0;
+
+        /* Fill the batches in ring order, printing each batch's results before
+         * it is reused. An empty batch tells the shards to finish. */
+        uint64_t b = 0;
+        for(;; b = (b + 1) % pipe->nbatches){
+                shard_batch * batch = &pipe->batches[b];
+                wait_for_stage(pipe, batch, pipe->nshards);
+                print_batch(batch, out);
+                batch->count = input_read(in, batch->packets, SHARD_BATCH);
+                memset(batch->matches, 0, batch->count * sizeof(uint64_t));
+                packets_read += batch->count;
+                batch->started = latency_sampled() ? now_ns() : 0;
+                bool done = batch->count == 0;
+                set_stage(pipe, batch, 0);
+                if(done) break;
+        }
+
+        /* The empty batch reaches the last shard after every other batch */
+        wait_for_stage(pipe, &pipe->batches[b], pipe->nshards);
+        for(uint64_t k = 0; k < pipe->nshards; ++k){
+                if(pipe->processes){
+                        if(!pipe->reaped[k]) waitpid(pipe->pids[k], NULL, 0);
+                }else{
+                        pthread_join(pipe->threads[k], NULL);
+                }
+                Trace("Shard %"PRIu64" skipped %"PRIu64" matched packets\n",
+                      k, pipe->skipped[k]);
+                counters.cache_hits += pipe->cache_hits[k];
+                counters.cache_misses += pipe->cache_misses[k];
+        }
+        /* Print the rest in order */
+        for(uint64_t i = 1; i < pipe->nbatches; ++i){
+                print_batch(&pipe->batches[(b + i) % pipe->nbatches], out);
+        }
+
+        pthread_mutex_destroy(&pipe->lock);
+        munmap(pipe, pipe->size);
+        Trace("Packets read in: %"PRIu64"\n", packets_read);
+}
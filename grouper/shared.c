@@ -0,0 +1,254 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Tables shared between grouper processes through a named POSIX shared memory
+ * segment. The first process to create the segment builds the tables into it;
+ * any other finds it already there, waits until it is ready and maps it read
+ * only, so a host running several groupers on one policy holds one copy of the
+ * tables and only the first has to build them.
+ *
+ * The segment starts with a page holding a header, and the even and odd tables
+ * follow it, laid out as build_tables lays them out. The header records the
+ * dimensions of the tables and a hash of the policy and dimensions, so a
+ * process never uses tables built for another policy or memory size. The
+ * builder holds an exclusive flock on the segment until the tables are ready,
+ * so a process waiting on them can tell if it died. The segment outlives the
+ * processes using it; it is removed with shm_unlink, or by deleting it from
+ * /dev/shm. */
+
+#include "grouper.h"
+#include <fcntl.h>              /* For O_* constants */
+#include <sys/file.h>           /* For flock() */
+#include <sys/mman.h>           /* For shm_open() and mmap() */
+#include <sys/stat.h>           /* For fstat() */
+#include <time.h>               /* For nanosleep() */
+
+#define SHARED_MAGIC UINT64_C(0x5350555247524550) /* "PERGRUPS" */
+#define SHARED_VERSION 2
+#define SHARED_GRACE_MS 1000    /* Longest a segment may go unlocked before
+                                   its header is written */
+
+/* The first page of a segment */
+typedef struct {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t hash;          /* Of the policy and the dimensions */
+        table_dims dims;
+        uint64_t even_offset;   /* Bytes from the start of the segment to the */
+        uint64_t odd_offset;    /* even and odd tables */
+        uint64_t size;          /* Bytes of the whole segment */
+        uint32_t ready;         /* Set once the tables are built */
+} shared_header;
+
+/* Continues a 64 bit FNV-1a hash over len bytes */
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t len)
+{
+        const uint8_t * bytes = data;
+        for(size_t i = 0; i < len; ++i){
+                hash ^= bytes[i];
+                hash *= UINT64_C(1099511628211);
+        }
+        return hash;
+}
+
+/* Hashes everything the contents of the tables depend on */
+static uint64_t hash_tables(policy pol, table_dims d)
+{
+        uint64_t hash = UINT64_C(14695981039346656037);
+        const uint64_t sizes[] = {pol.pl, pol.n, pol.b, d.even_h, d.odd_h,
+                                  d.even_d, d.odd_d, d.bitwidth, d.even_s,
+                                  d.odd_s};
+        hash = fnv1a(hash, sizes, sizeof(sizes));
+        for(uint64_t w = 0; w < pol.n; ++w){
+                hash = fnv1a(hash, pol.q_masks[w], pol.B / BitsInByte);
+                hash = fnv1a(hash, pol.b_masks[w], pol.B / BitsInByte);
+        }
+        return hash;
+}
+
+/* Maps len bytes of a segment read only, exiting if it cannot */
+static void * map_segment(int fd, size_t len)
+{
+        void * map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED){
+                Error("Could not map shared tables! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        return map;
+}
+
+/* Removes a segment the builder could not finish and exits, so that later
+ * processes build it afresh rather than wait on it */
+static void abandon_segment(const char * name)
+{
+        shm_unlink(name);
+        exit(EXIT_FAILURE);
+}
+
+/* Sleeps for a millisecond while another process builds the tables, exiting
+ * if it has died without finishing. Once the header is written, ready points
+ * at its flag, and an unlocked segment that is not ready means the builder is
+ * gone. Before then the builder may not have taken the lock yet, so an
+ * unlocked segment is only given up on once it has stayed unlocked for
+ * SHARED_GRACE_MS; unlocked_ms counts how long it has. */
+static void wait_for(const char * name, int fd, const uint32_t * ready,
+                     uint64_t * unlocked_ms)
+{
+        if(flock(fd, LOCK_SH | LOCK_NB) == 0){
+                /* The builder may have finished since ready was looked at */
+                const bool done = ready != NULL &&
+                        __atomic_load_n(ready, __ATOMIC_ACQUIRE);
+                flock(fd, LOCK_UN);
+                if(done) return;
+                if(ready != NULL || ++*unlocked_ms > SHARED_GRACE_MS){
+                        Error("Error: the process building shared tables '%s' "
+                              "died. Remove /dev/shm%s and try again.\n",
+                              name, name);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        const struct timespec ms = {.tv_sec = 0, .tv_nsec = 1000000};
+        nanosleep(&ms, NULL);
+}
+
+/* Builds the tables of a policy in a segment just created and locked */
+static void build_segment(const char * name, policy pol, table_dims d,
+                          uint64_t hash, int fd, table_set * ts)
+{
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        const uint64_t even_bytes = d.even_h * d.even_d * d.bytewidth;
+        const uint64_t odd_bytes = d.odd_h * d.odd_d * d.bytewidth;
+        shared_header h = {
+                .magic = SHARED_MAGIC,
+                .version = SHARED_VERSION,
+                .hash = hash,
+                .dims = d,
+                .even_offset = ceil_div(sizeof(shared_header), page) * page,
+                .ready = 0
+        };
+        h.odd_offset = h.even_offset + ceil_div(even_bytes, page) * page;
+        h.size = h.odd_offset + ceil_div(odd_bytes, page) * page;
+        if(ftruncate(fd, h.size) != 0){
+                Error("Could not size shared tables to %"PRIu64" bytes! "
+                      "errno = %d\n", h.size, errno);
+                abandon_segment(name);
+        }
+        uint8_t * map = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             fd, 0);
+        if(map == MAP_FAILED){
+                Error("Could not map shared tables! errno = %d\n", errno);
+                abandon_segment(name);
+        }
+        /* The magic number goes in last, marking the header complete */
+        const uint64_t magic = h.magic;
+        h.magic = 0;
+        memcpy(map, &h, sizeof(h));
+        __atomic_store_n((uint64_t *) map, magic, __ATOMIC_RELEASE);
+
+        /* The segment comes zeroed, as fill_tables wants */
+        ts->even_tables = map + h.even_offset;
+        ts->odd_tables = map + h.odd_offset;
+        fill_tables(pol, d, (void *) ts->even_tables, (void *) ts->odd_tables);
+        __atomic_store_n(&((shared_header *) map)->ready, 1, __ATOMIC_RELEASE);
+        flock(fd, LOCK_UN);
+        ts->shared = map;
+        ts->shared_bytes = h.size;
+}
+
+/* Maps the tables another process built into the segment */
+static void attach_segment(const char * name, table_dims d, uint64_t hash,
+                           int fd, table_set * ts)
+{
+        /* The segment may not have been sized yet */
+        uint64_t unlocked_ms = 0;
+        struct stat st;
+        while(fstat(fd, &st) == 0 && (size_t) st.st_size < sizeof(shared_header)){
+                wait_for(name, fd, NULL, &unlocked_ms);
+        }
+        shared_header * h = map_segment(fd, sizeof(shared_header));
+        /* Nor had its header written */
+        while(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == 0){
+                wait_for(name, fd, NULL, &unlocked_ms);
+        }
+        if(h->magic != SHARED_MAGIC || h->version != SHARED_VERSION){
+                Error("Error: '%s' does not hold grouper tables.\n", name);
+                exit(EXIT_FAILURE);
+        }
+        if(h->hash != hash || memcmp(&h->dims, &d, sizeof(d)) != 0){
+                Error("Error: shared tables '%s' were built for another policy "
+                      "or memory size.\n", name);
+                exit(EXIT_FAILURE);
+        }
+        while(!__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE)){
+                wait_for(name, fd, &h->ready, &unlocked_ms);
+        }
+        const uint64_t size = h->size;
+        const uint64_t even_offset = h->even_offset;
+        const uint64_t odd_offset = h->odd_offset;
+        munmap(h, sizeof(shared_header));
+
+        uint8_t * map = map_segment(fd, size);
+        ts->even_tables = map + even_offset;
+        ts->odd_tables = map + odd_offset;
+        ts->shared = map;
+        ts->shared_bytes = size;
+}
+
+/* Sets up ts with the tables of a policy in the shared memory segment
+ * /grouper-NAME, building them there unless another process already has.
+ * Returns whether they were built. */
+bool shared_tables(policy pol, table_dims d, const char * tag, table_set * ts)
+{
+        char name[strlen(tag) + sizeof("/grouper-")];
+        sprintf(name, "/grouper-%s", tag);
+        const uint64_t hash = hash_tables(pol, d);
+        ts->dims = d;
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        const bool building = fd >= 0;
+        if(!building && errno == EEXIST) fd = shm_open(name, O_RDONLY, 0);
+        if(fd < 0){
+                Error("Could not open shared tables '%s'! errno = %d\n", name,
+                      errno);
+                exit(EXIT_FAILURE);
+        }
+        if(building){
+                Trace("Building shared tables '%s'\n", name);
+                if(flock(fd, LOCK_EX) != 0){
+                        Error("Could not lock shared tables '%s'! errno = %d\n",
+                              name, errno);
+                        abandon_segment(name);
+                }
+                build_segment(name, pol, d, hash, fd, ts);
+        }else{
+                Trace("Attaching to shared tables '%s'\n", name);
+                attach_segment(name, d, hash, fd, ts);
+        }
+        /* The mapping keeps the segment open */
+        close(fd);
+        return building;
+}
+
+/* Unmaps shared tables, leaving the segment for other processes */
+void shared_detach(table_set * ts)
+{
+        munmap(ts->shared, ts->shared_bytes);
+        ts->even_tables = ts->odd_tables = NULL;
+}
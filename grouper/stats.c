@@ -0,0 +1,182 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Live statistics, for watching a long running grouper. The thread writing
+ * output counts packets as it writes their matches; nothing else writes the
+ * counts, so plain atomic stores suffice and classification never waits on a
+ * lock. A thread of its own reports the counts whenever SIGUSR1 arrives,
+ * to stderr, or whenever something connects to the stats socket, to it.
+ *
+ * SIGUSR1 is blocked before any other thread starts, so every thread inherits
+ * the block and the signal is only ever taken from the signalfd. */
+
+#include "grouper.h"
+#include <signal.h>             /* For sigprocmask() */
+#include <poll.h>               /* For poll() */
+#include <sys/signalfd.h>       /* For signalfd() */
+#include <sys/socket.h>         /* For socket() */
+#include <sys/stat.h>           /* For lstat() */
+#include <sys/un.h>             /* For sockaddr_un */
+
+live_stats stats;
+
+static int signal_fd = -1;
+static int socket_fd = -1;
+static const char * socket_path = NULL;
+
+/* Counts at the last report, for the current rates */
+static uint64_t last_packets = 0;
+static uint64_t last_time = 0;
+
+/* Writes a report of the counts so far to fd */
+static void report(int fd)
+{
+        const uint64_t now = now_ns();
+        const uint64_t started = __atomic_load_n(&stats.started,
+                                                 __ATOMIC_ACQUIRE);
+        const uint64_t packets = __atomic_load_n(&stats.packets,
+                                                 __ATOMIC_RELAXED);
+        const uint64_t no_match = __atomic_load_n(&stats.no_match,
+                                                  __ATOMIC_RELAXED);
+        double pps = 0, avg_pps = 0;
+        if(started != 0){
+                const uint64_t since = max(last_time, started);
+                if(now > since){
+                        pps = (packets - last_packets) * 1e9 / (now - since);
+                }
+                if(now > started) avg_pps = packets * 1e9 / (now - started);
+        }
+        last_packets = packets;
+        last_time = now;
+        dprintf(fd, "{ 'phase' : '%s', 'packets' : %"PRIu64", 'bytes' : "
+                "%"PRIu64", 'pps' : %.0f, 'avg_pps' : %.0f, 'bytes_per_sec' : "
+                "%.0f, 'avg_bytes_per_sec' : %.0f, 'table_bytes' : %"PRIu64
+                ", 'build' : %"PRIu64", 'no_match_rate' : %.4f }\n",
+                started != 0 ? "classify" : "build", packets,
+                packets * stats.pl, pps, avg_pps, pps * stats.pl,
+                avg_pps * stats.pl,
+                __atomic_load_n(&stats.table_bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&stats.build_time, __ATOMIC_RELAXED),
+                packets != 0 ? (double) no_match / packets : 0.0);
+}
+
+/* Thread reporting the counts on request */
+static void * stats_thread(void * args)
+{
+        (void) args;
+        struct pollfd fds[2] = {{.fd = signal_fd, .events = POLLIN},
+                                {.fd = socket_fd, .events = POLLIN}};
+        const nfds_t nfds = socket_fd >= 0 ? 2 : 1;
+        for(;;){
+                if(poll(fds, nfds, -1) < 0){
+                        if(errno == EINTR) continue;
+                        Trace("Stats poll failed, errno = %d\n", errno);
+                        return NULL;
+                }
+                if(fds[0].revents & POLLIN){
+                        struct signalfd_siginfo info;
+                        if(read(signal_fd, &info, sizeof(info)) == sizeof(info)){
+                                report(fileno(stderr));
+                        }
+                }
+                if(nfds > 1 && (fds[1].revents & POLLIN)){
+                        int client = accept(socket_fd, NULL, NULL);
+                        if(client >= 0){
+                                report(client);
+                                close(client);
+                        }
+                }
+        }
+        return NULL;
+}
+
+/* Listens on a unix socket at path, exiting if it cannot */
+static void listen_at(const char * path)
+{
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if(strlen(path) >= sizeof(addr.sun_path)){
+                Error("Stats socket path %s is too long.\n", path);
+                exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, path);
+        /* A socket left behind by an earlier run is replaced, anything else
+         * at the path is not touched */
+        struct stat st;
+        if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+        socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(socket_fd < 0 ||
+           bind(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+           listen(socket_fd, 8) != 0){
+                Error("Could not listen on stats socket %s! errno = %d\n",
+                      path, errno);
+                exit(EXIT_FAILURE);
+        }
+        socket_path = path;
+}
+
+/* Starts reporting statistics on SIGUSR1, and to connections on a unix socket
+ * at path unless it is NULL. Must be called before any other thread starts. */
+void stats_start(const char * path)
+{
+        memset(&stats, 0, sizeof(stats));
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+        signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+        if(signal_fd < 0){
+                Error("Could not create signalfd! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        if(path != NULL) listen_at(path);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, stats_thread, NULL) != 0){
+                Error("Could not start stats thread!\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+}
+
+/* Records that the tables take table_bytes bytes and took build_time
+ * microseconds to build. With -B this happens after classification starts. */
+void stats_built(uint64_t table_bytes, uint64_t build_time)
+{
+        __atomic_store_n(&stats.table_bytes, table_bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.build_time, build_time, __ATOMIC_RELAXED);
+}
+
+/* Marks the start of classification of packets of pl bytes */
+void stats_classifying(uint64_t pl)
+{
+        stats.pl = pl;
+        __atomic_store_n(&stats.started, now_ns(), __ATOMIC_RELEASE);
+}
+
+/* Removes the stats socket */
+void stats_stop(void)
+{
+        if(socket_path != NULL) unlink(socket_path);
+        socket_path = NULL;
+}
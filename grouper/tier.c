@@ -0,0 +1,356 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Tiered tables live in a file, normally on a fast local disk, and only a
+ * cache of their rows is kept in memory. That lets a policy use fewer, larger
+ * tables than would fit in memory, at the cost of reading a row from disk
+ * whenever it isn't cached.
+ *
+ * In memory the rows of all tables for one section value sit side by side, so
+ * a page holds rows of every table that are rarely wanted together. In the
+ * file each table is stored whole, starting on a page of its own, so a page
+ * holds rows for neighbouring values of one section. Packets of the same
+ * flows keep coming back to the same few values of each section, and their
+ * rows then share pages instead of dragging in rows of the other tables.
+ *
+ * The file is mapped read only once it is written. A row is looked up in the
+ * cache, a set associative array of rows sized by MAX_MEMORY, and on a miss is
+ * copied in from the mapping, faulting in its page if need be. Rows handed out
+ * for one group of packets stay put until the next group, so a set whose ways
+ * are all in use hands out the mapped row instead of replacing one. */
+
+#include "grouper.h"
+#include <fcntl.h>              /* For posix_fadvise() */
+#include <sys/mman.h>           /* For mmap() */
+#include <sys/resource.h>       /* For getrusage() */
+#include <sys/statvfs.h>        /* For statvfs() */
+
+struct TIER_TABLES {
+        int fd;
+        uint8_t * map;          /* The whole file, read only */
+        uint64_t map_len;
+        uint64_t bytewidth;
+        uint64_t * offsets;     /* Byte offset of each table in the file */
+        uint64_t set_mask;      /* Number of cache sets - 1 */
+        uint64_t * tags;        /* File offset of each cached row + 1, 0 if
+                                 * empty */
+        uint32_t * uses;        /* Group each cached row was last used in */
+        uint32_t * victims;     /* Way of each set to replace next */
+        uint8_t * rows;         /* The cached rows */
+        uint32_t group;         /* Group being classified */
+        uint64_t hits;
+        uint64_t misses;
+        long faults;            /* Major page faults when the tables were
+                                 * built */
+};
+
+/* Arguments to the threads writing the file */
+typedef struct {
+        policy * pol;
+        const table_dims * dims;
+        const tier_tables * tt;
+        uint64_t next_table;    /* Next table for a thread to take */
+} tier_job;
+
+/* Returns the rows of a table */
+static inline uint64_t table_height(table_dims d, uint64_t k)
+{
+        return k < d.even_d ? d.even_h : d.odd_h;
+}
+
+/* Returns the most cache sets that fit in m bits, tags and all, as a power of
+ * two, or 0 if not even one does */
+static uint64_t cache_sets(uint64_t m, uint64_t bytewidth)
+{
+        const uint64_t rows = m / 8 /
+                (bytewidth + sizeof(uint64_t) + sizeof(uint32_t));
+        if(rows < TIER_CACHE_WAYS) return 0;
+        uint64_t sets = 1;
+        while(sets * 2 * TIER_CACHE_WAYS <= rows) sets *= 2;
+        return sets;
+}
+
+/* Returns the space free for the table file in dir, in bits */
+static uint64_t free_bits(const char * dir)
+{
+        struct statvfs st;
+        if(statvfs(dir, &st) != 0){
+                Error("Cannot use table directory '%s'! errno = %d\n", dir,
+                      errno);
+                exit(EXIT_FAILURE);
+        }
+        return (uint64_t) st.f_bavail * st.f_frsize * 8;
+}
+
+/* Works out how many tiered tables to build for a policy, with a row cache in
+ * m bits of memory and the file in the space free in dir. Sets *hit_rate to
+ * the share of row lookups expected to hit the cache.
+ *
+ * Fewer tables mean fewer rows to AND per packet, but more rows in all, so
+ * less of them cached. Every number of tables from the fewest that fit on
+ * disk up is costed as its rows per packet, with each row expected to miss
+ * costing TIER_FAULT_ROWS more. Rows are taken to be wanted equally often,
+ * which is the worst case: traffic with any locality hits the cache more. */
+uint64_t plan_tiered(policy pol, uint64_t m, const char * dir,
+                     double * hit_rate)
+{
+        const uint64_t cached = cache_sets(m, pol.N / 8) * TIER_CACHE_WAYS;
+        if(cached == 0){
+                Error("Error: not enough memory for the row cache. Needs at "
+                      "least %"PRIu64" bytes.\n", TIER_CACHE_WAYS *
+                      (pol.N / 8 + sizeof(uint64_t) + sizeof(uint32_t)));
+                exit(EXIT_FAILURE);
+        }
+        uint64_t first = min_tables(free_bits(dir), pol.n, pol.b);
+        if(first == TABLE_ERROR || pol.b < 2){
+                Error("Error: not enough space in '%s' for the tables.\n", dir);
+                exit(EXIT_FAILURE);
+        }
+        /* A single table holds rule numbers rather than rows, which is not
+         * worth reading from disk */
+        first = max(first, 2);
+
+        uint64_t best = 0;
+        double best_cost = INFINITY;
+        for(uint64_t t = first; t <= pol.b; ++t){
+                const double rows = (t - pol.b % t) * exp2(pol.b / t) +
+                        (pol.b % t) * exp2(pol.b / t + 1);
+                const double hits = min(1.0, cached / rows);
+                const double cost = t * (1 + (1 - hits) * TIER_FAULT_ROWS);
+                Trace("%"PRIu64" tiered tables: %.0f rows, expected hit rate "
+                      "%.4f, cost %.1f\n", t, rows, hits, cost);
+                if(cost < best_cost){
+                        best = t;
+                        best_cost = cost;
+                        *hit_rate = hits;
+                }
+                /* More tables only cost more once every row is cached */
+                if(hits == 1.0) break;
+        }
+        return best;
+}
+
+/* Thread writing tables to the file until none are left */
+static void * write_tables_thread(void * args)
+{
+        tier_job * job = args;
+        const table_dims d = *job->dims;
+        const tier_tables * tt = job->tt;
+        const uint64_t tables = d.even_d + d.odd_d;
+        const uint64_t chunk = max(IO_BLOCK / d.bytewidth, 1);
+        uint8_t * rows = malloc(chunk * d.bytewidth);
+        if(rows == NULL){
+                Error("Could not allocate memory for table rows!\n");
+                exit(EXIT_FAILURE);
+        }
+
+        uint64_t k;
+        while((k = __sync_fetch_and_add(&job->next_table, 1)) < tables){
+                const uint64_t started = timeline_start();
+                const bool even = k < d.even_d;
+                const uint64_t start = even ? k * d.even_s :
+                        d.even_d * d.even_s + (k - d.even_d) * d.odd_s;
+                section_masks sm = get_section_masks(*job->pol, start,
+                                                     even ? d.even_s : d.odd_s);
+                const uint64_t height = table_height(d, k);
+                for(uint64_t h = 0; h < height; h += chunk){
+                        const uint64_t n = min(chunk, height - h);
+                        memset(rows, 0, n * d.bytewidth);
+                        for(uint64_t i = 0; i < n; ++i){
+                                build_row(&sm, h + i, rows + i * d.bytewidth);
+                        }
+                        const uint64_t off = tt->offsets[k] + h * d.bytewidth;
+                        for(uint64_t done = 0; done < n * d.bytewidth;){
+                                ssize_t w = pwrite(tt->fd, rows + done,
+                                                   n * d.bytewidth - done,
+                                                   off + done);
+                                if(w < 0 && errno == EINTR) continue;
+                                if(w <= 0){
+                                        Error("Could not write tables to "
+                                              "disk! errno = %d\n", errno);
+                                        exit(EXIT_FAILURE);
+                                }
+                                done += w;
+                        }
+                }
+                free_section_masks(&sm);
+                timeline_end("write table", started, "table", k);
+        }
+        free(rows);
+        return NULL;
+}
+
+/* Returns the major page faults taken so far */
+static long major_faults(void)
+{
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_majflt;
+}
+
+/* Writes the tables for a policy to a file in dir and sets up a cache of their
+ * rows in m bits of memory */
+tier_tables * tier_build(policy pol, table_dims d, uint64_t m, const char * dir)
+{
+        tier_tables * tt = calloc(1, sizeof(tier_tables));
+        const uint64_t tables = d.even_d + d.odd_d;
+        if(tt == NULL ||
+           (tt->offsets = malloc(tables * sizeof(uint64_t))) == NULL){
+                Error("Could not allocate memory for tiered tables!\n");
+                exit(EXIT_FAILURE);
+        }
+        tt->bytewidth = d.bytewidth;
+
+        /* The file has no name, it goes away with grouper */
+        char path[strlen(dir) + sizeof("/grouper-tables-XXXXXX")];
+        sprintf(path, "%s/grouper-tables-XXXXXX", dir);
+        tt->fd = mkstemp(path);
+        if(tt->fd < 0){
+                Error("Could not create table file in '%s'! errno = %d\n", dir,
+                      errno);
+                exit(EXIT_FAILURE);
+        }
+        unlink(path);
+
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        for(uint64_t k = 0; k < tables; ++k){
+                tt->offsets[k] = tt->map_len;
+                tt->map_len += ceil_div(table_height(d, k) * d.bytewidth,
+                                        page) * page;
+        }
+        if(ftruncate(tt->fd, tt->map_len) != 0){
+                Error("Could not size table file to %"PRIu64" bytes! "
+                      "errno = %d\n", tt->map_len, errno);
+                exit(EXIT_FAILURE);
+        }
+        Trace("Writing %"PRIu64" tables, %"PRIu64" bytes, to '%s'\n", tables,
+              tt->map_len, dir);
+
+        tier_job job = {.pol = &pol, .dims = &d, .tt = tt, .next_table = 0};
+        uint64_t nthreads = min((uint64_t) sysconf(_SC_NPROCESSORS_ONLN), tables);
+        pthread_t threads[nthreads];
+        for(uint64_t i = 0; i < nthreads; ++i){
+                pthread_create(&threads[i], NULL, write_tables_thread, &job);
+        }
+        for(uint64_t i = 0; i < nthreads; ++i){
+                pthread_join(threads[i], NULL);
+        }
+
+        /* Flush the tables out and drop them from the page cache, so the rows
+         * in memory are the ones the cache holds */
+        if(fdatasync(tt->fd) != 0){
+                Error("Could not write tables to disk! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        posix_fadvise(tt->fd, 0, 0, POSIX_FADV_DONTNEED);
+        tt->map = mmap(NULL, tt->map_len, PROT_READ, MAP_SHARED, tt->fd, 0);
+        if(tt->map == MAP_FAILED){
+                Error("Could not map table file! errno = %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        /* A miss wants one row, reading ahead would only evict others */
+        madvise(tt->map, tt->map_len, MADV_RANDOM);
+
+        const uint64_t sets = cache_sets(m, d.bytewidth);
+        tt->set_mask = sets - 1;
+        tt->tags = calloc(sets * TIER_CACHE_WAYS, sizeof(uint64_t));
+        tt->uses = calloc(sets * TIER_CACHE_WAYS, sizeof(uint32_t));
+        tt->victims = calloc(sets, sizeof(uint32_t));
+        tt->rows = malloc(sets * TIER_CACHE_WAYS * d.bytewidth);
+        if(tt->tags == NULL || tt->uses == NULL || tt->victims == NULL ||
+           tt->rows == NULL){
+                Error("Could not allocate memory for the row cache!\n");
+                exit(EXIT_FAILURE);
+        }
+        Trace("Row cache holds %"PRIu64" of %"PRIu64" rows\n",
+              sets * TIER_CACHE_WAYS, table_rows(d));
+        tt->faults = major_faults();
+        return tt;
+}
+
+/* Starts a new group of packets, whose rows may replace those of the last */
+void tier_next_group(tier_tables * tt)
+{
+        /* Group 0 would match empty ways */
+        if(++tt->group == 0) tt->group = 1;
+}
+
+/* Returns row index of table k, from the cache if it can */
+const uint8_t * tier_row(tier_tables * tt, uint64_t k, uint64_t index)
+{
+        const uint64_t off = tt->offsets[k] + index * tt->bytewidth;
+        uint64_t hash = (off + 1) * UINT64_C(0x9e3779b97f4a7c15);
+        const uint64_t set = (hash ^ (hash >> 32)) & tt->set_mask;
+        uint64_t * tags = tt->tags + set * TIER_CACHE_WAYS;
+        uint32_t * uses = tt->uses + set * TIER_CACHE_WAYS;
+        uint8_t * rows = tt->rows + set * TIER_CACHE_WAYS * tt->bytewidth;
+        for(uint64_t w = 0; w < TIER_CACHE_WAYS; ++w){
+                if(tags[w] == off + 1){
+                        tt->hits++;
+                        uses[w] = tt->group;
+                        return rows + w * tt->bytewidth;
+                }
+        }
+        tt->misses++;
+        for(uint64_t i = 0; i < TIER_CACHE_WAYS; ++i){
+                const uint64_t w = tt->victims[set];
+                tt->victims[set] = (w + 1) % TIER_CACHE_WAYS;
+                if(uses[w] == tt->group) continue;
+                tags[w] = off + 1;
+                uses[w] = tt->group;
+                memcpy(rows + w * tt->bytewidth, tt->map + off, tt->bytewidth);
+                return rows + w * tt->bytewidth;
+        }
+        /* Every way holds a row of this group */
+        return tt->map + off;
+}
+
+/* Returns row index of table k straight from the file, leaving the cache be */
+const uint8_t * tier_mapped_row(const tier_tables * tt, uint64_t k,
+                                uint64_t index)
+{
+        return tt->map + tt->offsets[k] + index * tt->bytewidth;
+}
+
+/* Returns the bytes of memory taken by the row cache */
+uint64_t tier_cache_bytes(const tier_tables * tt)
+{
+        return (tt->set_mask + 1) * TIER_CACHE_WAYS *
+                (tt->bytewidth + sizeof(uint64_t) + sizeof(uint32_t));
+}
+
+/* Unmaps and closes the table file and frees the cache, adding its hits and
+ * misses and the major page faults since the build to the counters */
+void tier_free(tier_tables * tt, run_counters * rc)
+{
+        rc->tier_hits += tt->hits;
+        rc->tier_misses += tt->misses;
+        rc->tier_faults += major_faults() - tt->faults;
+        rc->tier_file_bytes += tt->map_len;
+        munmap(tt->map, tt->map_len);
+        close(tt->fd);
+        free(tt->offsets);
+        free(tt->tags);
+        free(tt->uses);
+        free(tt->victims);
+        free(tt->rows);
+        free(tt);
+}
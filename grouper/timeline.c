@@ -0,0 +1,149 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A timeline of what every thread was doing, written out at exit in the Chrome
+ * trace event format, which chrome://tracing and Perfetto display. Each thread
+ * records its events in a buffer of its own, so recording takes no locks
+ * except when a thread records its first event. The buffers are only read
+ * once every thread recording into them has been joined.
+ *
+ * Code records an event with timeline_start and timeline_end (see grouper.h).
+ * With no timeline asked for, those only test timeline_on, and when grouper is
+ * compiled with TIMELINE_ENABLED defined as 0 they compile to nothing. */
+
+#include "grouper.h"
+#include <sys/syscall.h>        /* For SYS_gettid */
+
+bool timeline_on = false;
+
+/* One event, from start to end */
+typedef struct {
+        const char * name;
+        const char * key;       /* Name of the argument, or NULL */
+        uint64_t value;         /* The argument */
+        uint64_t start;         /* now_ns() at the start and end */
+        uint64_t end;
+} timeline_record;
+
+/* The events of one thread */
+typedef struct TIMELINE_BUFFER timeline_buffer;
+struct TIMELINE_BUFFER {
+        timeline_buffer * next;
+        pid_t tid;
+        uint64_t count;
+        uint64_t capacity;
+        timeline_record * records;
+};
+
+static const char * timeline_path = NULL;
+static uint64_t timeline_started = 0;
+static timeline_buffer * buffers = NULL;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread timeline_buffer * mine = NULL;
+
+/* Starts recording a timeline, to be written to path by timeline_write */
+void timeline_init(const char * path)
+{
+        timeline_path = path;
+        timeline_started = now_ns();
+        timeline_on = path != NULL;
+}
+
+/* Returns the calling thread's buffer, creating it the first time */
+static timeline_buffer * thread_buffer(void)
+{
+        if(mine != NULL) return mine;
+        mine = calloc(1, sizeof(timeline_buffer));
+        if(mine == NULL){
+                Error("Could not allocate memory for the timeline!\n");
+                exit(EXIT_FAILURE);
+        }
+        mine->tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&buffers_lock);
+        mine->next = buffers;
+        buffers = mine;
+        pthread_mutex_unlock(&buffers_lock);
+        return mine;
+}
+
+/* Records an event named name that started at start and ends now, with an
+ * argument named key unless it is NULL */
+void timeline_event(const char * name, uint64_t start, const char * key,
+                    uint64_t value)
+{
+        const uint64_t end = now_ns();
+        timeline_buffer * b = thread_buffer();
+        if(b->count == b->capacity){
+                b->capacity = max(2 * b->capacity, 1024);
+                b->records = realloc(b->records,
+                                     b->capacity * sizeof(timeline_record));
+                if(b->records == NULL){
+                        Error("Could not allocate memory for the timeline!\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        b->records[b->count++] = (timeline_record) {.name = name, .key = key,
+                                                    .value = value,
+                                                    .start = start,
+                                                    .end = end};
+}
+
+/* Writes the timeline out and frees it. Every thread but the caller that
+ * recorded events must have finished. */
+void timeline_write(void)
+{
+        if(!timeline_on) return;
+        timeline_on = false;
+        FILE * f = fopen(timeline_path, "w");
+        if(f == NULL){
+                Error("Cannot write timeline to '%s'.\n", timeline_path);
+                return;
+        }
+        const pid_t pid = getpid();
+        fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool first = true;
+        for(timeline_buffer * b = buffers; b != NULL;){
+                for(uint64_t i = 0; i < b->count; ++i){
+                        const timeline_record * r = &b->records[i];
+                        /* Times are in microseconds since timeline_init */
+                        fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                                "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                                first ? "" : ",\n", r->name, (int) pid,
+                                (int) b->tid,
+                                (r->start - timeline_started) / 1e3,
+                                (r->end - r->start) / 1e3);
+                        if(r->key != NULL){
+                                fprintf(f, ",\"args\":{\"%s\":%"PRIu64"}",
+                                        r->key, r->value);
+                        }
+                        fprintf(f, "}");
+                        first = false;
+                }
+                timeline_buffer * next = b->next;
+                free(b->records);
+                free(b);
+                b = next;
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        buffers = NULL;
+        mine = NULL;
+}
@@ -0,0 +1,401 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Generates input for grouper from a policy, with a chosen distribution over
+ * the rules the packets match. A pool of flows is made first: each flow picks
+ * the rule it should match from the distribution and gets a header matching
+ * that rule and no earlier one, found by filling the rule's don't-cares at
+ * random until no earlier rule matches. Rules for which no such header turns
+ * up are taken to be shadowed and are never picked again. Packets are then
+ * drawn from the pool in bursts of the same flow, and the rest of each packet
+ * past the policy's bits is random. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+
+#define SHADOW_TRIES 64         /* Headers tried before a rule is taken to be
+                                 * shadowed */
+#define MISS_TRIES 4096         /* Headers tried to find one no rule matches */
+
+/* Distributions over the rules matched */
+typedef enum {
+        DIST_UNIFORM,           /* Every rule equally */
+        DIST_ZIPF,              /* The i-th most popular rule by 1 / i^s */
+        DIST_HOT,               /* A few rules take most of the traffic */
+        DIST_MISS               /* No rule at all */
+} distribution;
+
+/* A policy, as masks over the bytes of its bits */
+typedef struct {
+        long pl;                /* Packet length */
+        long n;                 /* Number of rules */
+        long b;                 /* Bits of the longest rule */
+        long nb;                /* Bytes those bits take */
+        uint8_t * q_masks;      /* n x nb, 1 where a bit is fixed */
+        uint8_t * b_masks;      /* n x nb, the fixed bits */
+} policy;
+
+/* splitmix64, so a seed gives the same traffic everywhere */
+static uint64_t state;
+static uint64_t next_random(void)
+{
+        uint64_t z = (state += UINT64_C(0x9e3779b97f4a7c15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        return z ^ (z >> 31);
+}
+
+/* Returns a random number in [0, 1) */
+static double uniform(void)
+{
+        return (next_random() >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+/* Fills len bytes with random bits */
+static void random_bytes(uint8_t * dst, long len)
+{
+        for(long i = 0; i < len; i++){
+                dst[i] = next_random();
+        }
+}
+
+/* Reads a policy file the way grouper does: the packet length, then a rule per
+ * line, the first character of a rule being the most significant bit of the
+ * first byte. The label of a rule's action, if any, is skipped. */
+static policy read_policy(FILE * file)
+{
+        policy pol = {0};
+        char * line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        if(getline(&line, &cap, file) < 0){
+                fprintf(stderr, "ERROR. Empty policy file.\n");
+                exit(EXIT_FAILURE);
+        }
+        pol.pl = atol(line);
+        long start = ftell(file);
+        while(getline(&line, &cap, file) > 0){
+                len = strcspn(line, " \t\n");
+                if(len > pol.b) pol.b = len;
+                pol.n++;
+        }
+        pol.nb = (pol.b + 7) / 8;
+        if(pol.n == 0 || pol.pl < pol.nb){
+                fprintf(stderr, "ERROR. Policy needs rules and a packet length "
+                        "of at least %ld bytes.\n", pol.nb);
+                exit(EXIT_FAILURE);
+        }
+        pol.q_masks = calloc(pol.n, pol.nb);
+        pol.b_masks = calloc(pol.n, pol.nb);
+        if(pol.q_masks == NULL || pol.b_masks == NULL){
+                fprintf(stderr, "ERROR. Could not allocate memory for policy.\n");
+                exit(EXIT_FAILURE);
+        }
+        fseek(file, start, SEEK_SET);
+        for(long i = 0; i < pol.n; i++){
+                getline(&line, &cap, file);
+                len = strcspn(line, " \t\n");
+                for(long j = 0; j < len; j++){
+                        const uint8_t bit = 0x80 >> (j % 8);
+                        if(line[j] == '?') continue;
+                        if(line[j] != '0' && line[j] != '1'){
+                                fprintf(stderr, "ERROR. Invalid character '%c' "
+                                        "in rule %ld.\n", line[j], i + 1);
+                                exit(EXIT_FAILURE);
+                        }
+                        pol.q_masks[i * pol.nb + j / 8] |= bit;
+                        if(line[j] == '1') pol.b_masks[i * pol.nb + j / 8] |= bit;
+                }
+        }
+        free(line);
+        /* Of the last byte, grouper's tables take the low b % 8 bits, which
+         * rules fill from the most significant bit down, so only those bits
+         * of a rule count */
+        const uint8_t last_mask = pol.b % 8 == 0 ? 0xff
+                : (1 << (pol.b % 8)) - 1;
+        for(long i = 0; i < pol.n; i++){
+                pol.q_masks[i * pol.nb + pol.nb - 1] &= last_mask;
+                pol.b_masks[i * pol.nb + pol.nb - 1] &= last_mask;
+        }
+        return pol;
+}
+
+/* Returns whether rule r matches a header */
+static bool matches(const policy * pol, long r, const uint8_t * header)
+{
+        const uint8_t * q = pol->q_masks + r * pol->nb;
+        const uint8_t * b = pol->b_masks + r * pol->nb;
+        for(long i = 0; i < pol->nb; i++){
+                if((header[i] & q[i]) != b[i]) return false;
+        }
+        return true;
+}
+
+/* Returns the first rule matching a header, from 1, or 0 if none does */
+static long first_match(const policy * pol, const uint8_t * header)
+{
+        for(long r = 0; r < pol->n; r++){
+                if(matches(pol, r, header)) return r + 1;
+        }
+        return 0;
+}
+
+/* Tries to make a header whose first match is rule r, returning false if it
+ * seems to be shadowed */
+static bool header_for(const policy * pol, long r, uint8_t * header)
+{
+        const uint8_t * q = pol->q_masks + r * pol->nb;
+        const uint8_t * b = pol->b_masks + r * pol->nb;
+        for(int t = 0; t < SHADOW_TRIES; t++){
+                random_bytes(header, pol->nb);
+                for(long i = 0; i < pol->nb; i++){
+                        header[i] = (header[i] & ~q[i]) | b[i];
+                }
+                if(first_match(pol, header) == r + 1) return true;
+        }
+        return false;
+}
+
+/* Makes a header no rule matches */
+static void header_missing(const policy * pol, uint8_t * header)
+{
+        for(int t = 0; t < MISS_TRIES; t++){
+                random_bytes(header, pol->nb);
+                if(first_match(pol, header) == 0) return;
+        }
+        fprintf(stderr, "ERROR. Could not find a header no rule matches.\n");
+        exit(EXIT_FAILURE);
+}
+
+/* Returns the rule whose range of the cumulative weights holds a random
+ * point, or -1 if every weight is 0 */
+static long pick_rule(const double * cumulative, long n)
+{
+        if(cumulative[n - 1] <= 0) return -1;
+        const double x = uniform() * cumulative[n - 1];
+        long lo = 0, hi = n - 1;
+        while(lo < hi){
+                long mid = (lo + hi) / 2;
+                if(cumulative[mid] > x) hi = mid;
+                else lo = mid + 1;
+        }
+        return lo;
+}
+
+/* Sums weights into cumulative */
+static void accumulate(const double * weights, double * cumulative, long n)
+{
+        double sum = 0;
+        for(long r = 0; r < n; r++){
+                sum += weights[r];
+                cumulative[r] = sum;
+        }
+}
+
+static void usage(const char * name)
+{
+        fprintf(stderr, "Usage: %s [-d uniform|zipf|hot|miss] [-z EXPONENT] "
+                "[-k HOT_RULES] [-H HOT_SHARE] [-x MISS_SHARE] [-F FLOWS] "
+                "[-l BURST] [-S SEED] [-e MATCHES_FILE] POLICY_FILE PACKETS "
+                "[OUTPUT_FILE]\n", name);
+        exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv)
+{
+        distribution dist = DIST_UNIFORM;
+        double exponent = 1.0;
+        long hot_rules = 10;
+        double hot_share = 0.9;
+        double miss_share = 0;
+        long nflows = 10000;
+        double burst = 1;
+        uint64_t seed = 1;
+        const char * matches_name = NULL;
+
+        int opt;
+        while((opt = getopt(argc, argv, "d:z:k:H:x:F:l:S:e:")) != -1){
+                switch(opt){
+                case 'd':
+                        if(strcmp(optarg, "uniform") == 0){
+                                dist = DIST_UNIFORM;
+                        }else if(strcmp(optarg, "zipf") == 0){
+                                dist = DIST_ZIPF;
+                        }else if(strcmp(optarg, "hot") == 0){
+                                dist = DIST_HOT;
+                        }else if(strcmp(optarg, "miss") == 0){
+                                dist = DIST_MISS;
+                        }else{
+                                fprintf(stderr, "ERROR. Unknown distribution "
+                                        "%s\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'z':
+                        exponent = atof(optarg);
+                        break;
+                case 'k':
+                        hot_rules = atol(optarg);
+                        break;
+                case 'H':
+                        hot_share = atof(optarg);
+                        break;
+                case 'x':
+                        miss_share = atof(optarg);
+                        break;
+                case 'F':
+                        nflows = atol(optarg);
+                        break;
+                case 'l':
+                        burst = atof(optarg);
+                        break;
+                case 'S':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 'e':
+                        matches_name = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if(argc - optind < 2 || argc - optind > 3) usage(argv[0]);
+        long packets = atol(argv[optind + 1]);
+        if(packets <= 0 || nflows <= 0 || burst < 1 || hot_rules <= 0 ||
+           hot_share < 0 || hot_share > 1 || miss_share < 0 || miss_share > 1){
+                fprintf(stderr, "ERROR. PACKETS, FLOWS and HOT_RULES must be "
+                        "> 0, BURST >= 1 and shares between 0 and 1.\n");
+                exit(EXIT_FAILURE);
+        }
+        FILE * pol_file = fopen(argv[optind], "r");
+        if(pol_file == NULL){
+                fprintf(stderr, "ERROR. Could not open %s\n", argv[optind]);
+                exit(EXIT_FAILURE);
+        }
+        policy pol = read_policy(pol_file);
+        fclose(pol_file);
+        FILE * out = stdout;
+        if(argc - optind == 3 && (out = fopen(argv[optind + 2], "w")) == NULL){
+                fprintf(stderr, "ERROR. Could not open %s\n", argv[optind + 2]);
+                exit(EXIT_FAILURE);
+        }
+        FILE * matches_file = NULL;
+        if(matches_name != NULL &&
+           (matches_file = fopen(matches_name, "w")) == NULL){
+                fprintf(stderr, "ERROR. Could not open %s\n", matches_name);
+                exit(EXIT_FAILURE);
+        }
+        state = seed;
+
+        /* Weight of each rule. Zipf and hot rank the rules in a random order,
+         * so that the popular ones are not simply the first. */
+        double * weights = malloc(pol.n * sizeof(double));
+        double * cumulative = malloc(pol.n * sizeof(double));
+        long * rank = malloc(pol.n * sizeof(long));
+        uint8_t * headers = malloc(nflows * pol.nb);
+        long * flow_rules = malloc(nflows * sizeof(long));
+        uint8_t * packet = malloc(pol.pl);
+        if(weights == NULL || cumulative == NULL || rank == NULL ||
+           headers == NULL || flow_rules == NULL || packet == NULL){
+                fprintf(stderr, "ERROR. Could not allocate memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        for(long r = 0; r < pol.n; r++){
+                rank[r] = r;
+        }
+        for(long r = pol.n - 1; r > 0; r--){
+                long other = next_random() % (r + 1);
+                long tmp = rank[r];
+                rank[r] = rank[other];
+                rank[other] = tmp;
+        }
+        for(long r = 0; r < pol.n; r++){
+                switch(dist){
+                case DIST_ZIPF:
+                        weights[rank[r]] = 1 / pow(r + 1, exponent);
+                        break;
+                case DIST_HOT:
+                        if(hot_rules >= pol.n){
+                                weights[rank[r]] = 1;
+                        }else if(r < hot_rules){
+                                weights[rank[r]] = hot_share / hot_rules;
+                        }else{
+                                weights[rank[r]] = (1 - hot_share) /
+                                        (pol.n - hot_rules);
+                        }
+                        break;
+                default:
+                        weights[rank[r]] = 1;
+                }
+        }
+        accumulate(weights, cumulative, pol.n);
+
+        /* Make the flows */
+        long shadowed = 0, missing = 0;
+        for(long f = 0; f < nflows; f++){
+                uint8_t * header = headers + f * pol.nb;
+                long r = -1;
+                if(dist != DIST_MISS && uniform() >= miss_share){
+                        while((r = pick_rule(cumulative, pol.n)) >= 0 &&
+                              !header_for(&pol, r, header)){
+                                /* Never pick a shadowed rule again */
+                                weights[r] = 0;
+                                accumulate(weights, cumulative, pol.n);
+                                shadowed++;
+                        }
+                }
+                if(r < 0){
+                        header_missing(&pol, header);
+                        missing++;
+                }
+                flow_rules[f] = r + 1;
+        }
+        fprintf(stderr, "%ld flows, %ld matching no rule, %ld rules shadowed\n",
+                nflows, missing, shadowed);
+
+        /* Draw packets from the flows, in bursts of geometric length with mean
+         * BURST */
+        long f = 0;
+        for(long p = 0; p < packets; p++){
+                if(p == 0 || uniform() >= 1 - 1 / burst){
+                        f = next_random() % nflows;
+                }
+                memcpy(packet, headers + f * pol.nb, pol.nb);
+                /* Bits past the last of the policy don't affect matching */
+                const uint8_t keep = pol.b % 8 == 0 ? 0xff
+                        : (1 << (pol.b % 8)) - 1;
+                packet[pol.nb - 1] = (packet[pol.nb - 1] & keep) |
+                        (next_random() & ~keep);
+                random_bytes(packet + pol.nb, pol.pl - pol.nb);
+                fwrite(packet, 1, pol.pl, out);
+                if(matches_file != NULL){
+                        fprintf(matches_file, "%ld\n", flow_rules[f]);
+                }
+        }
+        if(matches_file != NULL) fclose(matches_file);
+        fclose(out);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,386 @@
+/*
+Copyright (c) 2009-2010 University of South Florida
+Created by Josh Kuhn, Jay Ligatti, Chris Gage
+All rights reserved.
+
+This file is part of Grouper.
+
+    Grouper is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Grouper is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Grouper.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The decision tree engine, an alternative to the tables in the style of
+ * HiCuts and HyperCuts. Since rules are bit patterns rather than ranges of
+ * fields, each internal node cuts the rules that reach it on a few bits of the
+ * packet, with a child for every
+ * value of those bits; a rule goes to every child its pattern allows, so rules
+ * with ? in a cut bit are copied into several children. Once few enough rules
+ * are left a leaf lists them, in order, and a packet reaching it is checked
+ * against each in turn as classify_linear would.
+ *
+ * A node cuts on the bits that split its rules most evenly, counting a rule
+ * with ? on both sides, and takes as many of them (at most TREE_MAX_CUT_BITS)
+ * as it can before the copies made would take more than TREE_SPACE_FACTOR
+ * times the node's rules. Bits the rules all agree on don't split anything
+ * and are never cut, which also stops a node with no such bits left.
+ *
+ * The tree must fit in the memory budget along with the packed rules the
+ * leaves are checked against. If it doesn't, leaves are allowed twice as many
+ * rules and the tree is built again, down to a single leaf holding every rule.
+ *
+ * Whether a tree beats the tables depends on the cache more than on the number
+ * of lines either touches: a tree's leaves are scanned in order and usually
+ * stop at an early rule, while table rows are scattered. So rather than
+ * predicting which is faster, tree_faster times both on a sample of packets
+ * made from the rules.
+ *
+ * Rules and packets are compared on the same bits the tables use: the first b
+ * bits, taking the bits of each byte from the least significant. */
+
+#include "grouper.h"
+
+/* A node of the tree. Internal nodes cut on nbits bits and have 1 << nbits
+ * children, numbered by the values of the bits with bits[0] the lowest, in a
+ * run of nodes starting at first. Leaves have nbits 0 and list count rules
+ * starting at first in the tree's rule lists. */
+typedef struct {
+        uint32_t nbits;
+        uint32_t bits[TREE_MAX_CUT_BITS];
+        uint64_t first;
+        uint64_t count;
+} tree_node;
+
+struct DECISION_TREE {
+        tree_node * nodes;
+        uint64_t nnodes;
+        uint64_t node_capacity;
+        uint32_t * rules;       /* Rules of every leaf, 0 based */
+        uint64_t nrules;
+        uint64_t rule_capacity;
+        linear_rules * lr;      /* Every rule, packed for checking */
+        uint64_t leaf_rules;    /* Most rules a leaf may have, unless its rules
+                                 * cannot be split */
+        uint64_t limit;         /* Bytes the tree may take */
+        uint64_t fixed;         /* Bytes of the packed rules */
+        bool over;              /* The tree did not fit */
+};
+
+/* Returns bit p of a packet or mask */
+static inline uint64_t bit_at(const uint8_t * bytes, uint64_t p)
+{
+        return (bytes[p / BitsInByte] >> (p % BitsInByte)) & 1;
+}
+
+/* Returns the bytes a tree takes */
+static uint64_t tree_size(const decision_tree * dt)
+{
+        return dt->fixed + dt->nnodes * sizeof(tree_node) +
+                dt->nrules * sizeof(uint32_t);
+}
+
+/* Adds count nodes to the tree, returning the first or UINT64_MAX if the
+ * tree no longer fits */
+static uint64_t add_nodes(decision_tree * dt, uint64_t count)
+{
+        if(dt->nnodes + count > dt->node_capacity){
+                dt->node_capacity = max(2 * dt->node_capacity,
+                                        dt->nnodes + count);
+                dt->nodes = realloc(dt->nodes,
+                                    dt->node_capacity * sizeof(tree_node));
+                if(dt->nodes == NULL){
+                        Error("Could not allocate memory for decision "
+                              "tree!\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        const uint64_t first = dt->nnodes;
+        dt->nnodes += count;
+        if(tree_size(dt) > dt->limit) dt->over = true;
+        return first;
+}
+
+/* Makes node a leaf listing count rules */
+static void make_leaf(decision_tree * dt, uint64_t node, const uint32_t * rules,
+                      uint64_t count)
+{
+        if(dt->nrules + count > dt->rule_capacity){
+                dt->rule_capacity = max(2 * dt->rule_capacity,
+                                        dt->nrules + count);
+                dt->rules = realloc(dt->rules,
+                                    dt->rule_capacity * sizeof(uint32_t));
+                if(dt->rules == NULL){
+                        Error("Could not allocate memory for decision "
+                              "tree!\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        memcpy(dt->rules + dt->nrules, rules, count * sizeof(uint32_t));
+        dt->nodes[node] = (tree_node) {.nbits = 0, .first = dt->nrules,
+                                       .count = count};
+        dt->nrules += count;
+        if(tree_size(dt) > dt->limit) dt->over = true;
+}
+
+/* A bit to cut on and how evenly it splits the rules */
+typedef struct {
+        uint32_t bit;
+        uint64_t larger;        /* Rules on the larger side, with those with ?
+                                 * counted on both */
+} cut_choice;
+
+static int compare_cuts(const void * a, const void * b)
+{
+        const cut_choice * x = a, * y = b;
+        if(x->larger != y->larger) return x->larger < y->larger ? -1 : 1;
+        return x->bit < y->bit ? -1 : x->bit > y->bit;
+}
+
+/* Builds the subtree under node for count rules */
+static void build_node(decision_tree * dt, policy pol, uint64_t node,
+                       const uint32_t * rules, uint64_t count)
+{
+        if(dt->over) return;
+        if(count <= dt->leaf_rules){
+                make_leaf(dt, node, rules, count);
+                return;
+        }
+
+        /* Rank the bits that split the rules by how evenly they do */
+        cut_choice * cuts = malloc(pol.b * sizeof(cut_choice));
+        if(cuts == NULL){
+                Error("Could not allocate memory for decision tree!\n");
+                exit(EXIT_FAILURE);
+        }
+        uint64_t ncuts = 0;
+        for(uint64_t p = 0; p < pol.b; ++p){
+                uint64_t ones = 0, zeros = 0;
+                for(uint64_t i = 0; i < count; ++i){
+                        if(!bit_at(pol.q_masks[rules[i]], p)) continue;
+                        if(bit_at(pol.b_masks[rules[i]], p)) ones++;
+                        else zeros++;
+                }
+                if(ones == 0 || zeros == 0) continue;
+                cuts[ncuts++] = (cut_choice) {.bit = p,
+                                              .larger = count - min(ones, zeros)};
+        }
+        if(ncuts == 0){
+                /* Every bit is ? or the same in all the rules */
+                free(cuts);
+                make_leaf(dt, node, rules, count);
+                return;
+        }
+        qsort(cuts, ncuts, sizeof(cut_choice), compare_cuts);
+
+        /* Take the best bits while the copies stay within bounds. copies[i]
+         * is how many children rule i goes to. */
+        uint64_t * copies = malloc(count * sizeof(uint64_t));
+        if(copies == NULL){
+                Error("Could not allocate memory for decision tree!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t i = 0; i < count; ++i) copies[i] = 1;
+        uint64_t nbits = 0;
+        while(nbits < min(ncuts, TREE_MAX_CUT_BITS)){
+                const uint64_t p = cuts[nbits].bit;
+                uint64_t total = 0;
+                for(uint64_t i = 0; i < count; ++i){
+                        total += copies[i] *
+                                (bit_at(pol.q_masks[rules[i]], p) ? 1 : 2);
+                }
+                if(nbits > 0 && total + (UINT64_C(2) << nbits) >
+                   TREE_SPACE_FACTOR * count){
+                        break;
+                }
+                for(uint64_t i = 0; i < count; ++i){
+                        if(!bit_at(pol.q_masks[rules[i]], p)) copies[i] *= 2;
+                }
+                nbits++;
+        }
+        free(copies);
+
+        tree_node cut = {.nbits = nbits, .count = 0};
+        for(uint64_t j = 0; j < nbits; ++j) cut.bits[j] = cuts[j].bit;
+        free(cuts);
+        const uint64_t children = UINT64_C(1) << nbits;
+        cut.first = add_nodes(dt, children);
+        dt->nodes[node] = cut;
+        if(dt->over) return;
+
+        uint32_t * subset = malloc(count * sizeof(uint32_t));
+        if(subset == NULL){
+                Error("Could not allocate memory for decision tree!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t c = 0; c < children && !dt->over; ++c){
+                uint64_t n = 0;
+                for(uint64_t i = 0; i < count; ++i){
+                        const uint8_t * q = pol.q_masks[rules[i]];
+                        const uint8_t * b = pol.b_masks[rules[i]];
+                        bool fits = true;
+                        for(uint64_t j = 0; j < nbits && fits; ++j){
+                                fits = !bit_at(q, cut.bits[j]) ||
+                                        bit_at(b, cut.bits[j]) == ((c >> j) & 1);
+                        }
+                        if(fits) subset[n++] = rules[i];
+                }
+                build_node(dt, pol, cut.first + c, subset, n);
+        }
+        free(subset);
+}
+
+/* Builds a decision tree for a policy in at most m bits of memory, or returns
+ * NULL if even a single leaf holding every rule does not fit */
+decision_tree * tree_build(policy pol, uint64_t m)
+{
+        decision_tree * dt = calloc(1, sizeof(decision_tree));
+        if(dt == NULL){
+                Error("Could not allocate memory for decision tree!\n");
+                exit(EXIT_FAILURE);
+        }
+        dt->lr = linear_new(pol);
+        dt->fixed = linear_bytes(dt->lr);
+        dt->limit = m / 8;
+        uint32_t * all = malloc(pol.n * sizeof(uint32_t));
+        if(all == NULL){
+                Error("Could not allocate memory for decision tree!\n");
+                exit(EXIT_FAILURE);
+        }
+        for(uint64_t w = 0; w < pol.n; ++w) all[w] = w;
+
+        for(dt->leaf_rules = TREE_LEAF_RULES; ; dt->leaf_rules *= 2){
+                dt->nnodes = dt->nrules = 0;
+                dt->over = false;
+                add_nodes(dt, 1);
+                build_node(dt, pol, 0, all, pol.n);
+                if(!dt->over || dt->leaf_rules >= pol.n) break;
+                Trace("Decision tree with leaves of %"PRIu64" rules does not "
+                      "fit.\n", dt->leaf_rules);
+        }
+        free(all);
+        if(dt->over){
+                tree_free(dt, NULL);
+                return NULL;
+        }
+        Trace("Decision tree of %"PRIu64" nodes and %"PRIu64" leaf rules, "
+              "%"PRIu64" bytes\n", dt->nnodes, dt->nrules, tree_size(dt));
+        return dt;
+}
+
+/* Returns the bytes of memory a tree takes */
+uint64_t tree_bytes(const decision_tree * dt)
+{
+        return tree_size(dt);
+}
+
+/* Frees a tree, adding its nodes and leaf rules to rc unless it is NULL */
+void tree_free(decision_tree * dt, run_counters * rc)
+{
+        if(rc != NULL){
+                rc->tree_nodes += dt->nnodes;
+                rc->tree_leaf_rules += dt->nrules;
+        }
+        linear_free(dt->lr);
+        free(dt->nodes);
+        free(dt->rules);
+        free(dt);
+}
+
+/* Classifies a group of packets with the decision tree of ts. The packets walk
+ * down the tree together a level at a time, so the nodes each needs next are
+ * fetched from memory in parallel. */
+void classify_tree(policy pol, const table_set * ts, const uint8_t * packets,
+                   uint64_t count, uint64_t matches[count])
+{
+        const decision_tree * dt = ts->tree;
+        uint64_t at[count];
+        for(uint64_t p = 0; p < count; ++p) at[p] = 0;
+        for(bool moved = true; moved;){
+                moved = false;
+                for(uint64_t p = 0; p < count; ++p){
+                        const tree_node * nd = &dt->nodes[at[p]];
+                        if(nd->nbits == 0) continue;
+                        const uint8_t * packet = packets + p * pol.pl;
+                        uint64_t c = 0;
+                        for(uint64_t j = 0; j < nd->nbits; ++j){
+                                c |= bit_at(packet, nd->bits[j]) << j;
+                        }
+                        at[p] = nd->first + c;
+                        __builtin_prefetch(&dt->nodes[at[p]]);
+                        moved = true;
+                }
+        }
+        for(uint64_t p = 0; p < count; ++p){
+                const tree_node * nd = &dt->nodes[at[p]];
+                matches[p] = linear_first_match(dt->lr, packets + p * pol.pl,
+                                                dt->rules + nd->first,
+                                                nd->count);
+        }
+}
+
+/* Returns the nanoseconds per packet classify takes over count packets, the
+ * faster of two passes so the first can bring what it needs into the cache */
+static double time_classifier(policy pol, const table_set * ts,
+                              classifier classify, const uint8_t * packets,
+                              uint64_t count)
+{
+        uint64_t matches[opts.group_size];
+        uint64_t best = UINT64_MAX;
+        for(int pass = 0; pass < 2; ++pass){
+                const uint64_t started = now_ns();
+                for(uint64_t p = 0; p < count; p += opts.group_size){
+                        classify(pol, ts, packets + p * pol.pl,
+                                 min(opts.group_size, count - p), matches);
+                }
+                best = min(best, now_ns() - started);
+        }
+        return (double) best / count;
+}
+
+/* Times classifying a sample of packets with the tables of ts and with a
+ * decision tree, returning whether the tree was faster. Each packet is made
+ * from a rule picked at random, with random bits where it has ?, as packets
+ * that match something are what classification mostly sees. The times per
+ * packet are put in *tree_ns and *table_ns. */
+bool tree_faster(policy pol, const table_set * ts, decision_tree * dt,
+                 double * tree_ns, double * table_ns)
+{
+        const uint64_t count = TREE_TRIAL_PACKETS;
+        uint8_t * packets = malloc(count * pol.pl);
+        if(packets == NULL){
+                Error("Could not allocate memory for decision tree trial!\n");
+                exit(EXIT_FAILURE);
+        }
+        uint64_t state = UINT64_C(0x9e3779b97f4a7c15);
+        for(uint64_t p = 0; p < count; ++p){
+                uint8_t * packet = packets + p * pol.pl;
+                for(uint64_t i = 0; i < pol.pl; ++i){
+                        /* xorshift64 */
+                        state ^= state << 13;
+                        state ^= state >> 7;
+                        state ^= state << 17;
+                        packet[i] = state;
+                }
+                const uint64_t w = state % pol.n;
+                for(uint64_t i = 0; i < min(pol.pl, pol.B / BitsInByte); ++i){
+                        packet[i] = (packet[i] & ~pol.q_masks[w][i]) |
+                                pol.b_masks[w][i];
+                }
+        }
+        table_set tree_set = TABLE_SET_INIT;
+        tree_set.tree = dt;
+        *table_ns = time_classifier(pol, ts, classify_group, packets, count);
+        *tree_ns = time_classifier(pol, &tree_set, classify_tree, packets,
+                                   count);
+        free(packets);
+        return *tree_ns < *table_ns;
+}